@@ -3,34 +3,1348 @@
 #include <sys/times.h>
 #include <sstream>
 #include <iterator>
+#include <fstream>
 #include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_map>
 #include <zconf.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <tuple>
 #include <algorithm>
 
-static const int MAX_JOBS = 32;
+static const int MAX_JOBS = 65536;  // Most jobs running at once
+static const int MAX_BUFFER = 4096;
+static const long CPU_PERIOD_USEC = 100000;  // Period of the cpu.max quota
+static const int MAX_EVENTS = 64;
+static const size_t SPLICE_SIZE = 65536;
+static const int MAX_SPLICES = 16;  // Per job and event, so that one job cannot hold up the others
+static const off_t MAX_TAIL = 65536;  // Most of a log that tail looks at
+static const int TAIL_LINES = 10;
+static const int NUM_COUNTERS = 3;
+static const size_t CLONE_STACK_SIZE = 65536;  // Stack of a job from clone_job() until it calls exec
+
+extern char **environ;
 
 struct job {
     int index;
     pid_t pid;
     std::string cmd;
-    bool running;
+    bool running;  // Until the job ends and is reaped
+    bool stopped;
+    bool frozen;  // By the cgroup freezer, which the job cannot see
+    int end_code;  // How the job ended: CLD_EXITED, CLD_KILLED or CLD_DUMPED
+    int end_status;  // The exit status, or the signal that ended the job
+    double start_time;
+    double end_time;
+    std::string cgroup;  // Name of the cgroup of the job within the session, empty if it has none
+    std::string log_path;  // File the output of the job is moved to
+    rusage usage;  // Resources used by the job and the children it waited for, once it is reaped
+    std::vector<int> counter_fds;  // Hardware counters of the job and its children, empty if not counted
+    std::vector<double> counts;  // Final values of the counters, once the job is reaped
+};
+
+/**
+ * The output of a job that is still open, moved from its pipe to its log
+ */
+struct job_output {
+    int job_number;
+    pid_t pid;
+    int log_fd;  // Open for reading too, so that attach can send from it
+};
+
+/**
+ * Where to start a job: the cgroup v2 limits to apply to it, which are written as given, and the
+ * CPUs, memory policy and scheduling it gets before exec. Anything not set is inherited.
+ */
+struct job_options {
+    std::string group;  // Named job group to join, empty to give each job a cgroup of its own
+    std::string cpu;  // cpu.max
+    std::string memory;  // memory.max
+    std::string io;  // io.max
+    std::vector<int> cpus;  // CPUs the job may run on
+    bool pin = false;  // Pin each instance to one CPU of cpus, or of a1jobs, in turn
+    int numa_mode = -1;  // Memory policy, an MPOL_* mode
+    unsigned long numa_nodes = 0;  // Mask of the nodes of the memory policy
+    int sched_policy = -1;  // Scheduler class, a SCHED_* policy
+    int sched_priority = 0;  // Priority for SCHED_FIFO and SCHED_RR
+    bool set_nice = false;
+    int nice = 0;
+    bool perf = false;  // Count cycles, instructions and cache misses
+};
+
+/**
+ * Selects jobs by number, by a range of numbers, or by a glob pattern on their command
+ */
+struct job_spec {
+    int first;
+    int last;
+    std::string pattern;  // Empty to select by number
+};
+
+enum batch_state {
+    BATCH_WAITING,
+    BATCH_READY,
+    BATCH_RUNNING,
+    BATCH_DONE,
+    BATCH_FAILED,
+    BATCH_SKIPPED
+};
+
+/**
+ * A job of a job graph run by batch
+ */
+struct batch_node {
+    std::string name;
+    std::vector<std::string> args;
+    job_options options;
+    std::vector<int> deps;  // Jobs that must succeed before this one starts
+    std::vector<int> dependents;  // Jobs that run after this one
+    std::vector<std::string> tags;  // Resources held while the job runs
+    double cost;  // Expected run time, relative to the other jobs
+    double priority;  // Cost of the longest path from the start of the job to the end of the graph
+    int waiting;  // Jobs in deps that have not succeeded yet
+    batch_state state;
+    int job_number;  // Number of the job while it runs
+    pid_t pid;
+};
+
+// The job table. A job keeps its slot after it ends, until the slot is reused for a new job.
+std::vector<job> job_table;  // Indexed by job number
+std::deque<int> free_jobs;  // Numbers of ended jobs, reused oldest first
+std::unordered_map<pid_t, int> job_pids;  // Number of each job that has not been reaped, by pid
+int live_jobs = 0;
+
+// The output of the jobs. Each job writes its stdout and stderr to a pipe, which is spliced into a
+// log file, so that it never passes through a1jobs or reaches the terminal unless attached.
+int epoll_fd = -1;  // Watches stdin, the signalfd and the output pipes
+bool input_is_file = false;  // Whether stdin is a regular file, which epoll cannot watch
+std::string log_dir;  // Made the first time a job starts
+bool keep_logs = false;  // Whether log_dir was given, otherwise it is removed at exit
+int log_count = 0;  // Number of logs made, to give each a new name
+std::unordered_map<int, job_output> job_outputs;  // By the read end of the pipe
+int attached_fd = -1;  // Pipe of the job whose output is sent to the terminal, -1 if none
+off_t attached_offset = 0;  // How much of its log was sent
+
+// The cgroups of the session. Jobs with limits get a cgroup under a session cgroup that is made
+// the first time one is needed, and removed with the groups when a1jobs exits.
+std::string cgroup_parent;  // Directory the session cgroup is made in, empty without cgroup v2
+std::string cgroup_session;  // Empty until it is made
+std::set<std::string> cgroup_groups;  // Names of the job groups made so far
+int cgroup_jobs = 0;  // Number of cgroups made for single jobs, to give each a new name
+bool use_freezer = false;  // Whether every job gets a cgroup, to be frozen and killed with its children
+
+// Commands are read from the terminal after a prompt, or from a script without prompts, in which
+// case each is followed by a line with its result
+bool script_mode = false;
+int command_errors = 0;  // Errors printed so far, to tell whether a command failed
+
+// Hardware counters, in the order of counter_fds
+const char *counter_names[NUM_COUNTERS] = {"cycles", "instructions", "cache_misses"};
+const uint64_t counter_events[NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                               PERF_COUNT_HW_CACHE_MISSES};
+FILE *report_file = nullptr;  // Gets a line for every job that ends, if report=FILE was given
+double report_start = 0;  // Time a1jobs started, which start times in the report count from
+
+/**
+ * Get the current time of the monotonic clock
+ * @return The time in seconds
+ */
+double now_sec() {
+    timespec now {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Print an error, which counts against the command being run
+ * @param format The message, formatted like printf()
+ */
+void print_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("ERROR: ");
+    vprintf(format, args);
+    va_end(args);
+    command_errors++;
+}
+
+/**
+ * Split a command into words separated by spaces or tabs
+ * @param cmd The command
+ * @return The words
+ */
+std::vector<std::string> split_words(const std::string &cmd) {
+    std::vector<std::string> words;
+    size_t end = 0;
+    while (true) {
+        size_t start = cmd.find_first_not_of(" \t\r", end);
+        if (start == std::string::npos) {
+            return words;
+        }
+        end = cmd.find_first_of(" \t\r", start);
+        words.push_back(cmd.substr(start, end - start));
+    }
+}
+
+/**
+ * Describe the current state of a job
+ * @param this_job The job to describe
+ * @return The state, such as "running" or "exited 0"
+ */
+std::string job_state(const job &this_job) {
+    if (this_job.running) {
+        return this_job.frozen ? "frozen" : this_job.stopped ? "stopped" : "running";
+    } else if (this_job.end_code == CLD_EXITED) {
+        return "exited " + std::to_string(this_job.end_status);
+    } else {
+        return "killed by signal " + std::to_string(this_job.end_status) + " (" + strsignal(this_job.end_status) +
+               (this_job.end_code == CLD_DUMPED ? ", core dumped)" : ")");
+    }
+}
+
+/**
+ * Start a job running a command, searching PATH for it like the shell does.
+ * posix_spawnp() does not copy the address space of a1jobs, and reports a command that cannot be
+ * executed to the caller instead of leaving a copy of a1jobs behind. The job reads /dev/null as
+ * stdin, so that it cannot take the commands meant for a1jobs, such as the rest of a script.
+ * @param args The command followed by any number of arguments
+ * @param output_fd Where the job writes its stdout and stderr
+ * @param c_pid Set to the pid of the new job
+ * @return 0 upon success, an error number otherwise
+ */
+int spawn_job(const std::vector<std::string> &args, int output_fd, pid_t &c_pid) {
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDERR_FILENO);
+
+    // a1jobs blocks SIGCHLD to read it from a signalfd, which the job should not inherit
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &empty_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    int error = posix_spawnp(&c_pid, argv[0], &actions, &attr, argv.data(), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return error;
+}
+
+/**
+ * Open the hardware counters of a job that has not called exec yet. They start counting when it
+ * does, and are inherited by its children, whose counts are added to the job's as they exit. Only
+ * user space is counted, which does not need privileges. Prints a warning the first time the
+ * counters cannot be opened, for instance on a machine without a PMU.
+ * @param c_pid The pid of the job
+ * @param counter_fds Set to the counters, in the order of counter_events, or left empty upon failure
+ */
+void open_counters(pid_t c_pid, std::vector<int> &counter_fds) {
+    static bool warned = false;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        perf_event_attr attr {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = counter_events[i];
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int fd = (int) syscall(SYS_perf_event_open, &attr, c_pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            if (!warned) {
+                printf("WARNING: Failed to open the %s counter: %s\n", counter_names[i], strerror(errno));
+                warned = true;
+            }
+            for (int counter_fd : counter_fds) {
+                close(counter_fd);
+            }
+            counter_fds.clear();
+            break;
+        }
+        counter_fds.push_back(fd);
+    }
+    errno = 0;
+}
+
+/**
+ * Read the hardware counters of a job. Counters that shared the PMU with others only ran part of
+ * the time, so their values are scaled up to the whole time they were enabled.
+ * @param counter_fds The counters
+ * @return The value of each counter
+ */
+std::vector<double> read_counters(const std::vector<int> &counter_fds) {
+    std::vector<double> counts;
+    for (int fd : counter_fds) {
+        uint64_t values[3];  // The value, the time enabled and the time running
+        if (read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+            counts.push_back(0);
+        } else {
+            counts.push_back((double) values[0] * values[1] / values[2]);
+        }
+    }
+    errno = 0;
+    return counts;
+}
+
+/**
+ * What the child of clone_job() needs to set itself up, and what failed if it could not. The
+ * child shares the memory of a1jobs, so it reports a failure by setting step and error here.
+ */
+struct clone_context {
+    char *const *argv;
+    const job_options *options;
+    const cpu_set_t *cpus;  // nullptr to inherit the CPUs of a1jobs
+    int output_fd;
+    int procs_fd;  // cgroup.procs of the cgroup of the job, -1 to stay in the cgroup of a1jobs
+    int go_fd;  // Read end of the pipe the child waits on until its counters are open, -1 if none
+    int step;  // What failed, an index of the steps of clone_job(), -1 if nothing did
+    int error;
 };
 
-std::vector<job> job_list;
+/**
+ * Set up the child of clone_job() and exec the command. Runs on its own stack in the memory of
+ * a1jobs, so it only makes system calls and never returns.
+ * @param arg The clone_context of the job
+ * @return Never returns
+ */
+int start_clone(void *arg) {
+    clone_context *context = (clone_context *) arg;
+    const job_options &options = *context->options;
+
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+
+    // Wait until the parent opened the counters, before anything that could fail sets errno,
+    // which the child shares with the parent
+    if (context->go_fd >= 0) {
+        char go;
+        while (read(context->go_fd, &go, 1) < 0 && errno == EINTR) {}
+    }
+
+    // Like spawn_job(), the job reads /dev/null rather than the stdin of a1jobs
+    sched_param param {};
+    param.sched_priority = options.sched_priority;
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (context->procs_fd >= 0 && write(context->procs_fd, "0", 1) < 0) {
+        context->step = 6;
+    } else if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0 || dup2(context->output_fd, STDOUT_FILENO) < 0 ||
+               dup2(context->output_fd, STDERR_FILENO) < 0) {
+        context->step = 5;
+    } else if (context->cpus && sched_setaffinity(0, sizeof(cpu_set_t), context->cpus) < 0) {
+        context->step = 1;
+    } else if (options.numa_mode >= 0 &&
+               syscall(SYS_set_mempolicy, options.numa_mode, options.numa_nodes ? &options.numa_nodes : nullptr,
+                       options.numa_nodes ? sizeof(options.numa_nodes) * 8 : 0) < 0) {
+        context->step = 2;
+    } else if (options.sched_policy >= 0 && sched_setscheduler(0, options.sched_policy, &param) < 0) {
+        context->step = 3;
+    } else if (options.set_nice && setpriority(PRIO_PROCESS, 0, options.nice) < 0) {
+        context->step = 4;
+    } else {
+        execvp(context->argv[0], context->argv);
+        context->step = 0;
+    }
+    context->error = errno;
+    _exit(127);
+}
+
+/**
+ * Start a job with clone() and set it up before it calls exec: its cgroup, CPUs, memory policy
+ * and scheduling are set in the child, so that the command never runs without them. Like vfork(),
+ * the child shares the memory of a1jobs and runs on a stack of its own, and a1jobs waits until it
+ * calls exec, so that nothing is copied and starting a job costs the same however large a1jobs
+ * grows. With hardware counters, the child waits for them to be opened before it calls exec, like
+ * perf stat does, so that they count the whole command. a1jobs cannot wait for the exec then, so
+ * it runs alongside the child and waits for exec to close a pipe instead.
+ * @param args The command followed by any number of arguments
+ * @param cgroup_dir The directory of the cgroup, or an empty string to stay in the cgroup of a1jobs
+ * @param options The memory policy, scheduling and counters of the job
+ * @param cpus The CPUs the job may run on, or nullptr to inherit those of a1jobs
+ * @param output_fd Where the job writes its stdout and stderr
+ * @param c_pid Set to the pid of the new job
+ * @param failed Set to what failed: "exec", or the setting that could not be applied
+ * @param counter_fds Set to the hardware counters of the job, if options asks for them
+ * @return 0 upon success, an error number otherwise
+ */
+int clone_job(const std::vector<std::string> &args, const std::string &cgroup_dir, const job_options &options,
+              const cpu_set_t *cpus, int output_fd, pid_t &c_pid, std::string &failed, std::vector<int> &counter_fds) {
+    static const char *steps[] = {"exec", "CPU affinity", "NUMA policy", "scheduler", "nice level", "input and output",
+                                  "cgroup"};
+    // Only one child uses it at a time, since a1jobs waits for each to call exec
+    alignas(16) static char stack[CLONE_STACK_SIZE];
+
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    clone_context context = {
+        .argv = argv.data(),
+        .options = &options,
+        .cpus = cpus,
+        .output_fd = output_fd,
+        .procs_fd = -1,
+        .go_fd = -1,
+        .step = -1,
+        .error = 0
+    };
+    if (!cgroup_dir.empty()) {
+        context.procs_fd = open((cgroup_dir + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+        if (context.procs_fd < 0) {
+            int error = errno;
+            errno = 0;
+            return error;
+        }
+    }
+    int go_pipe[2] = {-1, -1};
+    int exec_pipe[2] = {-1, -1};
+    if (options.perf && (pipe2(go_pipe, O_CLOEXEC) < 0 || pipe2(exec_pipe, O_CLOEXEC) < 0)) {
+        int error = errno;
+        for (int fd : {context.procs_fd, go_pipe[0], go_pipe[1]}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        errno = 0;
+        return error;
+    }
+    context.go_fd = go_pipe[0];
+
+    pid_t result = clone(start_clone, stack + sizeof(stack), CLONE_VM | (options.perf ? 0 : CLONE_VFORK) | SIGCHLD,
+                         &context);
+    int error = result < 0 ? errno : 0;
+    if (options.perf) {
+        // The child has the write ends too, so it is woken with a byte, and closes them when it calls
+        // exec or exits
+        if (result > 0) {
+            open_counters(result, counter_fds);
+            write(go_pipe[1], "", 1);
+        }
+        close(go_pipe[1]);
+        close(exec_pipe[1]);
+        char done;
+        while (result > 0 && read(exec_pipe[0], &done, 1) < 0 && errno == EINTR) {}
+        close(go_pipe[0]);
+        close(exec_pipe[0]);
+    }
+    if (context.procs_fd >= 0) {
+        close(context.procs_fd);
+    }
+
+    if (result > 0 && context.step >= 0) {
+        waitpid(result, nullptr, 0);
+        failed = steps[context.step];
+        error = context.error;
+        for (int fd : counter_fds) {
+            close(fd);
+        }
+        counter_fds.clear();
+    } else if (result > 0) {
+        c_pid = result;
+    }
+    errno = 0;
+    return error;
+}
+
+/**
+ * Format a set of CPUs as a list of ranges, such as 0-3,6
+ * @param cpus The set
+ * @return The list
+ */
+std::string format_cpus(const cpu_set_t &cpus) {
+    std::string list;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &cpus)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus)) {
+            last++;
+        }
+        list += (list.empty() ? "" : ",") + std::to_string(cpu) + (last > cpu ? "-" + std::to_string(last) : "");
+        cpu = last;
+    }
+    return list;
+}
+
+/**
+ * Parse a list of ranges, such as 0-3,6, as used for CPUs and NUMA nodes
+ * @param list The list
+ * @param limit Numbers must be below this
+ * @param numbers Set to the numbers in the list, in order
+ * @return true upon success, false if the list is not valid
+ */
+bool parse_ranges(const std::string &list, int limit, std::vector<int> &numbers) {
+    std::istringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        char *end = nullptr;
+        long first = strtol(range.c_str(), &end, 10);
+        long last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+        if (range.empty() || !isdigit(range.at(0)) || *end != '\0' || last < first || last >= limit) {
+            return false;
+        }
+        for (long number = first; number <= last; number++) {
+            numbers.push_back((int) number);
+        }
+    }
+    errno = 0;
+    return !numbers.empty();
+}
+
+/**
+ * Describe where a running job is placed: its CPUs, scheduler class, nice level and memory policy
+ * @param this_job The job
+ * @return The placement, or an empty string if the job has ended
+ */
+std::string job_placement(const job &this_job) {
+    cpu_set_t cpus;
+    int policy = sched_getscheduler(this_job.pid);
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, (id_t) this_job.pid);
+    if (!this_job.running || policy < 0 || errno || sched_getaffinity(this_job.pid, sizeof(cpus), &cpus) < 0) {
+        errno = 0;
+        return "";
+    }
+
+    std::string sched = policy == SCHED_BATCH ? "batch" : policy == SCHED_IDLE ? "idle" :
+                        policy == SCHED_FIFO ? "fifo" : policy == SCHED_RR ? "rr" : "other";
+    sched_param param {};
+    if ((policy == SCHED_FIFO || policy == SCHED_RR) && sched_getparam(this_job.pid, &param) == 0) {
+        sched += ":" + std::to_string(param.sched_priority);
+    }
+
+    // Each mapping shows the policy of the job unless it has one of its own
+    std::ifstream numa_maps("/proc/" + std::to_string(this_job.pid) + "/numa_maps");
+    std::string address, numa = "default";
+    numa_maps >> address >> numa;
+    errno = 0;
+
+    return ", cpus= " + format_cpus(cpus) + " sched= " + sched + " nice= " + std::to_string(nice) + " numa= " + numa;
+}
+
+/**
+ * Find the cgroup v2 directory of a1jobs from the mount table and its own cgroup
+ * @return The directory, or an empty string if cgroup v2 is not mounted
+ */
+std::string find_cgroup_dir() {
+    std::string mount_point;
+    std::ifstream mounts("/proc/self/mountinfo");
+    std::string line;
+    while (mount_point.empty() && std::getline(mounts, line)) {
+        // Fields: id parent dev root mount_point options [optional ...] - type source options
+        std::istringstream fields(line);
+        std::vector<std::string> tokens {
+            std::istream_iterator<std::string>{fields},
+            std::istream_iterator<std::string>{}
+        };
+        auto separator = std::find(tokens.begin(), tokens.end(), "-");
+        if (tokens.size() > 4 && separator + 1 < tokens.end() && *(separator + 1) == "cgroup2") {
+            mount_point = tokens.at(4);
+        }
+    }
+    if (mount_point.empty()) {
+        return "";
+    }
+
+    std::ifstream cgroups("/proc/self/cgroup");
+    while (std::getline(cgroups, line)) {
+        if (line.compare(0, 3, "0::") == 0) {
+            return mount_point + (line.size() > 4 ? line.substr(3) : "");
+        }
+    }
+    return mount_point;
+}
+
+/**
+ * Write a value to a file of a cgroup
+ * @param cgroup_dir The directory of the cgroup
+ * @param name The name of the file, such as "memory.max"
+ * @param value The value to write
+ * @return 0 upon success, an error number otherwise
+ */
+int write_cgroup_file(const std::string &cgroup_dir, const std::string &name, const std::string &value) {
+    int fd = open((cgroup_dir + "/" + name).c_str(), O_WRONLY | O_CLOEXEC);
+    int error = 0;
+    if (fd < 0 || write(fd, value.c_str(), value.size()) < 0) {
+        error = errno;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    errno = 0;
+    return error;
+}
+
+/**
+ * Read the value of a key in a flat keyed file of a cgroup, or the whole file if key is empty
+ * @param cgroup_dir The directory of the cgroup
+ * @param name The name of the file, such as "cpu.stat"
+ * @param key The key, such as "usage_usec"
+ * @param value Set to the value
+ * @return true upon success, false if the file or key does not exist
+ */
+bool read_cgroup_value(const std::string &cgroup_dir, const std::string &name, const std::string &key, long long &value) {
+    std::ifstream file(cgroup_dir + "/" + name);
+    std::string field;
+    while (file >> field) {
+        if (key.empty()) {
+            value = std::stoll(field);
+            return true;
+        } else if (field == key && file >> value) {
+            return true;
+        }
+    }
+    errno = 0;
+    return false;
+}
+
+/**
+ * Make the session cgroup if it does not exist yet, and pass the cpu, memory and io controllers
+ * down to it and to the cgroups of its jobs. A controller that cannot be enabled only prints a
+ * warning, since jobs can still be placed in a cgroup and have their CPU usage measured.
+ * @return The directory of the session cgroup, or an empty string upon failure
+ */
+std::string session_cgroup() {
+    if (!cgroup_session.empty()) {
+        return cgroup_session;
+    } else if (cgroup_parent.empty()) {
+        print_error("cgroup v2 is not mounted\n");
+        return "";
+    }
+
+    std::string session = cgroup_parent + "/a1jobs." + std::to_string(getpid());
+    if (mkdir(session.c_str(), 0755) < 0 && errno != EEXIST) {
+        print_error("Failed to make cgroup %s: %s\n", session.c_str(), strerror(errno));
+        errno = 0;
+        return "";
+    }
+    errno = 0;
+
+    for (const char *controller : {"+cpu", "+memory", "+io"}) {
+        write_cgroup_file(cgroup_parent, "cgroup.subtree_control", controller);
+        int error = write_cgroup_file(session, "cgroup.subtree_control", controller);
+        if (error) {
+            printf("WARNING: cgroup controller %s is not available: %s\n", controller + 1, strerror(error));
+        }
+    }
+
+    cgroup_session = session;
+    return cgroup_session;
+}
+
+/**
+ * Make the cgroup for the next job and apply the limits to it. A job group is made once and
+ * shared; otherwise every job gets a new cgroup.
+ * @param options The group and limits
+ * @return The name of the cgroup within the session, or an empty string upon failure
+ */
+std::string prepare_cgroup(const job_options &options) {
+    std::string session = session_cgroup();
+    if (session.empty()) {
+        return "";
+    }
+
+    std::string name = options.group.empty() ? "job." + std::to_string(cgroup_jobs++) : options.group;
+    std::string cgroup_dir = session + "/" + name;
+    if (mkdir(cgroup_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        print_error("Failed to make cgroup %s: %s\n", cgroup_dir.c_str(), strerror(errno));
+        errno = 0;
+        return "";
+    }
+    errno = 0;
+    if (!options.group.empty()) {
+        cgroup_groups.insert(options.group);
+    }
+
+    std::vector<std::pair<std::string, std::string>> files {
+        {"cpu.max", options.cpu}, {"memory.max", options.memory}, {"io.max", options.io}
+    };
+    for (auto &file : files) {
+        int error = file.second.empty() ? 0 : write_cgroup_file(cgroup_dir, file.first, file.second);
+        if (error) {
+            printf("WARNING: Failed to set %s of %s: %s\n", file.first.c_str(), name.c_str(), strerror(error));
+        }
+    }
+    return name;
+}
+
+/**
+ * Describe the CPU and memory used by the cgroup of a job so far
+ * @param this_job The job
+ * @return The usage, or an empty string if the job has no cgroup
+ */
+std::string cgroup_usage(const job &this_job) {
+    std::string cgroup_dir = cgroup_session + "/" + this_job.cgroup;
+    long long cpu_usec;
+    if (this_job.cgroup.empty() || !read_cgroup_value(cgroup_dir, "cpu.stat", "usage_usec", cpu_usec)) {
+        return "";
+    }
+
+    char usage[MAX_BUFFER];
+    int length = snprintf(usage, MAX_BUFFER, ", cgroup= %s cpu= %.2f sec", this_job.cgroup.c_str(), cpu_usec / 1e6);
+    long long memory;
+    if (read_cgroup_value(cgroup_dir, "memory.current", "", memory)) {
+        snprintf(usage + length, MAX_BUFFER - length, " mem= %.1f MiB", memory / 1048576.0);
+    }
+    return usage;
+}
+
+/**
+ * Kill every process of a cgroup at once with cgroup.kill. Before Linux 5.14, which does not have
+ * it, the cgroup is frozen so that none of its processes can fork, each is killed, and the cgroup
+ * is thawed so that they can die.
+ * @param cgroup_dir The directory of the cgroup
+ * @return 0 upon success, an error number otherwise
+ */
+int kill_cgroup(const std::string &cgroup_dir) {
+    int error = write_cgroup_file(cgroup_dir, "cgroup.kill", "1");
+    if (error != ENOENT) {
+        return error;
+    }
+
+    error = write_cgroup_file(cgroup_dir, "cgroup.freeze", "1");
+    if (error) {
+        return error;
+    }
+    std::ifstream procs(cgroup_dir + "/cgroup.procs");
+    pid_t pid;
+    while (procs >> pid) {
+        kill(pid, SIGKILL);
+    }
+    write_cgroup_file(cgroup_dir, "cgroup.freeze", "0");
+    errno = 0;
+    return 0;
+}
+
+/**
+ * Remove the cgroups of the session once their jobs have ended. Processes that outlived their job,
+ * such as the children of a job killed by a signal, are killed first, so that nothing is left
+ * behind in a cgroup that cannot be removed.
+ */
+void remove_cgroups() {
+    if (cgroup_session.empty()) {
+        return;
+    }
+
+    // The cgroups of single jobs are removed as the jobs end, unless their children are still in them
+    DIR *dir = opendir(cgroup_session.c_str());
+    while (dirent *entry = dir ? readdir(dir) : nullptr) {
+        std::string cgroup_dir = cgroup_session + "/" + entry->d_name;
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.' || rmdir(cgroup_dir.c_str()) == 0 || errno != EBUSY) {
+            continue;
+        }
+        kill_cgroup(cgroup_dir);
+        long long populated = 1;
+        for (int i = 0; i < 1000 && read_cgroup_value(cgroup_dir, "cgroup.events", "populated", populated) &&
+                        populated; i++) {
+            usleep(1000);
+        }
+        rmdir(cgroup_dir.c_str());
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    rmdir(cgroup_session.c_str());
+    errno = 0;
+}
+
+/**
+ * Make the pipe a job writes its output to, and the log the output is moved to
+ * @param output_pipe Set to the pipe. Its read end does not block.
+ * @param log_fd Set to the log, open for reading and writing
+ * @param log_path Set to the path of the log
+ * @return true upon success, false if the pipe or log cannot be made
+ */
+bool open_job_output(int output_pipe[2], int &log_fd, std::string &log_path) {
+    if (log_count == 0 && mkdir(log_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        print_error("Failed to make log directory %s: %s\n", log_dir.c_str(), strerror(errno));
+        errno = 0;
+        return false;
+    }
+
+    log_path = log_dir + "/job." + std::to_string(log_count++) + ".log";
+    log_fd = open(log_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        print_error("Failed to open %s: %s\n", log_path.c_str(), strerror(errno));
+        errno = 0;
+        return false;
+    }
+    if (pipe2(output_pipe, O_CLOEXEC) < 0) {
+        print_error("%s\n", strerror(errno));
+        close(log_fd);
+        unlink(log_path.c_str());
+        errno = 0;
+        return false;
+    }
+    fcntl(output_pipe[0], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+/**
+ * Stop watching the output of a job, once the job and any children it left have closed the pipe.
+ * Stops sending it to the terminal if it is attached.
+ * @param fd The read end of the pipe
+ * @param prompted Whether the prompt is waiting for input, cleared if anything is printed
+ */
+void close_output(int fd, bool &prompted) {
+    job_output &output = job_outputs.at(fd);
+    if (fd == attached_fd) {
+        printf("%sOutput of job %i ended, detached\n", prompted ? "\n" : "", output.job_number);
+        attached_fd = -1;
+        prompted = false;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(output.log_fd);
+    close(fd);
+    job_outputs.erase(fd);
+}
+
+/**
+ * Send the part of the log of the attached job that was not sent yet to the terminal. sendfile()
+ * copies within the kernel, but cannot write to every kind of file, such as one opened to append,
+ * in which case the log is read and written instead.
+ * @param log_fd The log of the attached job
+ */
+void send_attached(int log_fd) {
+    fflush(stdout);
+    off_t end = lseek(log_fd, 0, SEEK_CUR);
+    while (attached_offset < end) {
+        ssize_t n = sendfile(STDOUT_FILENO, log_fd, &attached_offset, end - attached_offset);
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            char buffer[MAX_BUFFER];
+            n = pread(log_fd, buffer, std::min((off_t) MAX_BUFFER, end - attached_offset), attached_offset);
+            if (n > 0 && (n = write(STDOUT_FILENO, buffer, n)) > 0) {
+                attached_offset += n;
+            }
+        }
+        if (n <= 0) {
+            break;
+        }
+    }
+    errno = 0;
+}
+
+/**
+ * Move the output a job has written from its pipe to its log with splice(), so that it never
+ * passes through a1jobs. If the job is attached, the new part of the log is sent on to the
+ * terminal with sendfile().
+ * @param fd The read end of the pipe
+ * @param prompted Whether the prompt is waiting for input, cleared if anything is printed
+ */
+void drain_output(int fd, bool &prompted) {
+    job_output &output = job_outputs.at(fd);
+    for (int i = 0; i < MAX_SPLICES; i++) {
+        ssize_t n = splice(fd, nullptr, output.log_fd, nullptr, SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EAGAIN) {
+            errno = 0;
+            return;
+        } else if (n <= 0) {
+            errno = 0;
+            close_output(fd, prompted);
+            return;
+        }
+
+        if (fd == attached_fd) {
+            send_attached(output.log_fd);
+        }
+    }
+}
+
+/**
+ * Move what is left in the output pipes of the jobs to their logs and close them. Removes the logs
+ * unless their directory was given.
+ */
+void close_outputs() {
+    bool prompted = false;
+    while (!job_outputs.empty()) {
+        int fd = job_outputs.begin()->first;
+        job_output &output = job_outputs.begin()->second;
+        while (splice(fd, nullptr, output.log_fd, nullptr, SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK) > 0) {}
+        close_output(fd, prompted);
+    }
+
+    DIR *dir = keep_logs || log_count == 0 ? nullptr : opendir(log_dir.c_str());
+    if (dir) {
+        while (dirent *entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "job.", 4) == 0) {
+                unlink((log_dir + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(dir);
+        rmdir(log_dir.c_str());
+    }
+    errno = 0;
+}
+
+/**
+ * Add a started job to the job table, in the slot of the job that ended first if there is one
+ * @param c_pid The pid of the job
+ * @param cmd The command the job runs
+ * @param cgroup The name of the cgroup of the job, empty if it has none
+ * @param log_path The file the output of the job is moved to
+ * @param counter_fds The hardware counters of the job, empty if it is not counted
+ * @return The number of the job
+ */
+int add_job(pid_t c_pid, const std::string &cmd, const std::string &cgroup, const std::string &log_path,
+            const std::vector<int> &counter_fds) {
+    int job_number;
+    if (free_jobs.empty()) {
+        job_number = (int) job_table.size();
+        job_table.emplace_back();
+    } else {
+        job_number = free_jobs.front();
+        free_jobs.pop_front();
+    }
+
+    job new_job = {
+        .index = job_number,
+        .pid = c_pid,
+        .cmd = cmd,
+        .running = true,
+        .stopped = false,
+        .frozen = false,
+        .end_code = 0,
+        .end_status = 0,
+        .start_time = now_sec(),
+        .end_time = 0,
+        .cgroup = cgroup,
+        .log_path = log_path,
+        .usage = {},
+        .counter_fds = counter_fds,
+        .counts = {}
+    };
+    job_table[job_number] = new_job;
+    job_pids[c_pid] = job_number;
+    live_jobs++;
+    return job_number;
+}
+
+/**
+ * Write a line about an ended job to the report, with the resources it used
+ * @param this_job The job that ended
+ */
+void report_job(const job &this_job) {
+    const rusage &usage = this_job.usage;
+    fprintf(report_file, "%i\t%i\t%s\t%s\t%i\t%.3f\t%.3f\t%.3f\t%.3f\t%li\t%li\t%li\t%li\t%li",
+            this_job.index, this_job.pid, this_job.cmd.c_str(),
+            this_job.end_code == CLD_EXITED ? "exited" : this_job.end_code == CLD_DUMPED ? "dumped" : "killed",
+            this_job.end_status, this_job.start_time - report_start, this_job.end_time - this_job.start_time,
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+            usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw, usage.ru_nivcsw);
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (this_job.counts.empty()) {
+            fprintf(report_file, "\t-");
+        } else {
+            fprintf(report_file, "\t%.0f", this_job.counts[i]);
+        }
+    }
+    fprintf(report_file, "\n");
+    fflush(report_file);
+}
+
+/**
+ * Mark a reaped job as ended and free its slot for reuse. Its counters are read one last time and
+ * closed, and it is added to the report.
+ * @param this_job The job that ended
+ * @param status The status it was reaped with
+ * @param usage The resources it used
+ */
+void end_job(job &this_job, int status, const rusage &usage) {
+    this_job.running = false;
+    this_job.stopped = false;
+    this_job.frozen = false;
+    this_job.end_time = now_sec();
+    this_job.end_code = !WIFSIGNALED(status) ? CLD_EXITED : WCOREDUMP(status) ? CLD_DUMPED : CLD_KILLED;
+    this_job.end_status = WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status);
+    this_job.usage = usage;
+    this_job.counts = read_counters(this_job.counter_fds);
+    for (int fd : this_job.counter_fds) {
+        close(fd);
+    }
+    this_job.counter_fds.clear();
+    if (report_file) {
+        report_job(this_job);
+    }
+    job_pids.erase(this_job.pid);
+    free_jobs.push_back(this_job.index);
+    live_jobs--;
+
+    // The cgroup of a single job is empty once the job is reaped
+    if (!this_job.cgroup.empty() && !cgroup_groups.count(this_job.cgroup)) {
+        rmdir((cgroup_session + "/" + this_job.cgroup).c_str());
+        this_job.cgroup.clear();
+        errno = 0;
+    }
+}
+
+/**
+ * Start a job and add it to the job table, unless the job limit is reached
+ * @param args The command followed by its arguments
+ * @param options The cgroup to start the job in, its limits and its placement
+ * @param instance Which of several instances started with the same options this is, from 0. The
+ * options of a job group are applied by the first, and pinned jobs take CPUs in turn.
+ * @return The number of the job, or -1 upon failure
+ */
+int start_job(const std::vector<std::string> &args, const job_options &options, int instance) {
+    if (live_jobs >= MAX_JOBS) {
+        print_error("Too many jobs running\n");
+        return -1;
+    }
+
+    std::string cgroup;
+    if (!options.group.empty() || !options.cpu.empty() || !options.memory.empty() || !options.io.empty() ||
+        use_freezer) {
+        // A job group is prepared once, the cgroup of a single job for every job
+        cgroup = !options.group.empty() && instance > 0 ? options.group : prepare_cgroup(options);
+        if (cgroup.empty()) {
+            return -1;
+        }
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    std::vector<int> allowed = options.cpus;
+    if (options.pin && allowed.empty()) {
+        cpu_set_t own_cpus;
+        sched_getaffinity(0, sizeof(own_cpus), &own_cpus);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &own_cpus)) {
+                allowed.push_back(cpu);
+            }
+        }
+    }
+    for (size_t i = 0; i < allowed.size(); i++) {
+        if (!options.pin || i == instance % allowed.size()) {
+            CPU_SET(allowed[i], &cpus);
+        }
+    }
+
+    int output_pipe[2];
+    int log_fd;
+    std::string log_path;
+    if (!open_job_output(output_pipe, log_fd, log_path)) {
+        return -1;
+    }
+
+    pid_t c_pid;
+    std::string failed = "exec";
+    std::vector<int> counter_fds;
+    bool placed = !allowed.empty() || options.numa_mode >= 0 || options.sched_policy >= 0 || options.set_nice ||
+                  options.perf;
+    int error = cgroup.empty() && !placed ? spawn_job(args, output_pipe[1], c_pid) :
+                clone_job(args, cgroup.empty() ? "" : cgroup_session + "/" + cgroup, options,
+                          allowed.empty() ? nullptr : &cpus, output_pipe[1], c_pid, failed, counter_fds);
+    close(output_pipe[1]);
+    if (error) {
+        close(output_pipe[0]);
+        close(log_fd);
+        unlink(log_path.c_str());
+        if (failed == "exec") {
+            print_error("%s\n", strerror(error));
+        } else {
+            print_error("Failed to set %s: %s\n", failed.c_str(), strerror(error));
+        }
+        if (!cgroup.empty() && !cgroup_groups.count(cgroup)) {
+            rmdir((cgroup_session + "/" + cgroup).c_str());
+            errno = 0;
+        }
+        return -1;
+    }
+
+    int job_number = add_job(c_pid, args.at(0), cgroup, log_path, counter_fds);
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = output_pipe[0]}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, output_pipe[0], &event);
+    job_outputs[output_pipe[0]] = {.job_number = job_number, .pid = c_pid, .log_fd = log_fd};
+    return job_number;
+}
+
+/**
+ * Start instances of a command and add them to the job table, until the job limit is reached.
+ * @param args The command followed by its arguments
+ * @param count The number of instances to start
+ * @param options The cgroup to start the jobs in and its options
+ * @return The number of jobs started
+ */
+int run_jobs(const std::vector<std::string> &args, int count, const job_options &options) {
+    int started = 0;
+    while (started < count && start_job(args, options, started) >= 0) {
+        started++;
+    }
+    return started;
+}
+
+/**
+ * Reap every job that changed state since the last call, without blocking. A job is marked as no
+ * longer running only once it is reaped, so its pid cannot have been reused by then.
+ * @param signal_fd The signalfd that SIGCHLD is read from
+ * @param prompted Whether the prompt is waiting for input, cleared if a change is printed
+ */
+void reap_jobs(int signal_fd, bool &prompted) {
+    // Several SIGCHLD may be merged into one, so each read is followed by as many waits as needed
+    signalfd_siginfo fd_info;
+    while (read(signal_fd, &fd_info, sizeof(fd_info)) == sizeof(fd_info)) {}
+    errno = 0;
+
+    while (true) {
+        // wait4() reports what the job used as well, which waitid() does not
+        int status;
+        rusage usage {};
+        pid_t c_pid = wait4(-1, &status, WUNTRACED | WCONTINUED | WNOHANG, &usage);
+        if (c_pid <= 0) {
+            break;
+        }
+
+        auto found = job_pids.find(c_pid);
+        if (found == job_pids.end()) {
+            continue;
+        }
+        job *this_job = &job_table[found->second];
+
+        if (WIFSTOPPED(status)) {
+            this_job->stopped = true;
+        } else if (WIFCONTINUED(status)) {
+            this_job->stopped = false;
+        } else {
+            end_job(*this_job, status, usage);
+        }
+
+        if (prompted) {
+            printf("\n");
+            prompted = false;
+        }
+        printf("Job %i (pid= %i, cmd= %s): %s\n", this_job->index, this_job->pid, this_job->cmd.c_str(),
+               WIFCONTINUED(status) ? "continued" : job_state(*this_job).c_str());
+    }
+    errno = 0;
+}
 
 /**
- * List the spawned jobs that are running
+ * Wait for events and handle them: output of jobs is moved to their logs, and jobs are reaped
+ * upon SIGCHLD. Stdin is only checked, so that the caller can read it.
+ * @param signal_fd The signalfd that SIGCHLD is read from
+ * @param prompted Whether the prompt is waiting for input, cleared if anything is printed
+ * @param timeout_ms How long to wait for an event, -1 to wait until there is one
+ * @return true if stdin is ready to be read
  */
-void list() {
-    for (auto &this_job : job_list) {
-        if (this_job.running) {
-            printf("%i: (pid= %i, cmd= %s)\n", this_job.index, this_job.pid, this_job.cmd.c_str());
+bool handle_events(int signal_fd, bool &prompted, int timeout_ms) {
+    epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    bool input_ready = false;
+    bool child_ready = false;
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == STDIN_FILENO) {
+            input_ready = true;
+        } else if (fd == signal_fd) {
+            child_ready = true;
+        } else if (job_outputs.count(fd)) {
+            drain_output(fd, prompted);
+        }
+    }
+
+    // Jobs are reaped after their output is moved, so that their end is reported after it
+    if (child_ready) {
+        reap_jobs(signal_fd, prompted);
+    }
+    errno = 0;
+    return input_ready;
+}
+
+/**
+ * Start or stop watching stdin for commands
+ * @param watch Whether to watch it
+ */
+void watch_input(bool watch) {
+    if (input_is_file) {
+        return;
+    }
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = STDIN_FILENO}};
+    epoll_ctl(epoll_fd, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDIN_FILENO, &event);
+    errno = 0;
+}
+
+/**
+ * Print the end of the log of a job
+ * @param job_number The number of the job
+ * @param lines The number of lines to print
+ */
+void tail(int job_number, int lines) {
+    if (job_number < 0 || job_number >= (int) job_table.size()) {
+        print_error("Failed to find job: %i\n", job_number);
+        return;
+    }
+
+    int fd = open(job_table[job_number].log_path.c_str(), O_RDONLY | O_CLOEXEC);
+    off_t size = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+        print_error("Failed to open log of job %i: %s\n", job_number, strerror(errno));
+        errno = 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    off_t start = std::max(size - MAX_TAIL, (off_t) 0);
+    std::string text(size - start, '\0');
+    ssize_t n = pread(fd, &text[0], text.size(), start);
+    close(fd);
+    text.resize(n > 0 ? n : 0);
+
+    // Count lines back from the end, not counting the newline that ends the last one
+    size_t begin = text.empty() || text.back() != '\n' ? text.size() : text.size() - 1;
+    for (int count = 0; begin > 0; begin--) {
+        if (text[begin - 1] == '\n' && ++count == lines) {
+            break;
+        }
+    }
+    fwrite(text.data() + begin, 1, text.size() - begin, stdout);
+    if (!text.empty() && text.back() != '\n') {
+        printf("\n");
+    }
+}
+
+/**
+ * Print the end of the log of a job, then send its output to the terminal as it is written, until
+ * it ends or a line is entered
+ * @param job_number The number of the job
+ */
+void attach(int job_number) {
+    tail(job_number, TAIL_LINES);
+    if (job_number < 0 || job_number >= (int) job_table.size()) {
+        return;
+    }
+
+    for (auto &output : job_outputs) {
+        if (output.second.job_number == job_number && output.second.pid == job_table[job_number].pid) {
+            attached_fd = output.first;
+            attached_offset = lseek(output.second.log_fd, 0, SEEK_CUR);
+            printf("Attached to job %i, enter a line to detach\n", job_number);
+            return;
+        }
+    }
+    printf("Output of job %i ended\n", job_number);
+}
+
+/**
+ * Format a count with a metric suffix, such as 1.25G
+ * @param count The count
+ * @return The formatted count
+ */
+std::string format_count(double count) {
+    static const char *suffixes[] = {"", "K", "M", "G", "T"};
+    int i = 0;
+    while (count >= 1000 && i < 4) {
+        count /= 1000;
+        i++;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), i == 0 ? "%.0f%s" : "%.2f%s", count, suffixes[i]);
+    return text;
+}
+
+/**
+ * Describe the resources a job used: what wait4() reported once it ended, and its hardware counters
+ * @param this_job The job
+ * @return The usage, starting with a comma, or an empty string if there is none yet
+ */
+std::string job_usage(const job &this_job) {
+    std::string usage;
+    if (!this_job.running) {
+        usage = ", rss " + std::to_string(this_job.usage.ru_maxrss) + " KiB, faults " +
+                std::to_string(this_job.usage.ru_minflt) + "/" + std::to_string(this_job.usage.ru_majflt) +
+                ", csw " + std::to_string(this_job.usage.ru_nvcsw) + "/" + std::to_string(this_job.usage.ru_nivcsw);
+    }
+
+    std::vector<double> counts = this_job.running ? read_counters(this_job.counter_fds) : this_job.counts;
+    if (!counts.empty()) {
+        usage += ", " + format_count(counts[0]) + " cycles, " + format_count(counts[1]) + " instructions";
+        if (counts[0] > 0) {
+            char ipc[32];
+            snprintf(ipc, sizeof(ipc), " (%.2f IPC)", counts[1] / counts[0]);
+            usage += ipc;
+        }
+        usage += ", " + format_count(counts[2]) + " cache misses";
+    }
+    return usage;
+}
+
+/**
+ * List the spawned jobs, with their state and how long they ran
+ * @param state Only list jobs in this state: "running", "stopped", which includes frozen jobs, or
+ * "done". Empty to list all jobs.
+ */
+void list(const std::string &state) {
+    double now = now_sec();
+    for (auto &this_job : job_table) {
+        if ((state == "running" && (!this_job.running || this_job.stopped || this_job.frozen)) ||
+            (state == "stopped" && !this_job.stopped && !this_job.frozen) ||
+            (state == "done" && this_job.running)) {
+            continue;
+        }
+        double run_time = (this_job.running ? now : this_job.end_time) - this_job.start_time;
+        printf("%i: (pid= %i, cmd= %s) %s, %.1f sec%s%s%s\n", this_job.index, this_job.pid, this_job.cmd.c_str(),
+               job_state(this_job).c_str(), run_time, job_placement(this_job).c_str(),
+               cgroup_usage(this_job).c_str(), job_usage(this_job).c_str());
+    }
+}
+
+/**
+ * Suspend, resume or kill a job. With freezer=on, a job with a cgroup of its own is frozen, thawed
+ * or killed through its cgroup instead, which acts on all of its processes at once, including
+ * those it forked, and which they cannot see. Signals are the fallback for jobs in a job group,
+ * since the group is shared, and for kernels without the cgroup freezer.
+ * @param this_job The job
+ * @param signal SIGSTOP, SIGCONT or SIGKILL
+ */
+void signal_job(job &this_job, int signal) {
+    if (use_freezer && !this_job.cgroup.empty() && !cgroup_groups.count(this_job.cgroup)) {
+        std::string cgroup_dir = cgroup_session + "/" + this_job.cgroup;
+        int error = signal == SIGKILL ? kill_cgroup(cgroup_dir) :
+                    write_cgroup_file(cgroup_dir, "cgroup.freeze", signal == SIGSTOP ? "1" : "0");
+        if (!error) {
+            this_job.frozen = signal == SIGSTOP;
+            // A job stopped by a signal of its own still needs SIGCONT once thawed
+            if (signal != SIGCONT || !this_job.stopped) {
+                return;
+            }
         }
     }
+    kill(this_job.pid, signal);
 }
 
 /**
@@ -40,14 +1354,14 @@ void list() {
  */
 void suspend(int job_number) {
     try {
-        if (!job_list.at(job_number).running) {
+        if (!job_table.at(job_number).running) {
             printf("Job %i already terminated\n", job_number);
             return;
         }
-        kill(job_list.at(job_number).pid, SIGSTOP);
+        signal_job(job_table.at(job_number), SIGSTOP);
         printf("Suspended job: %i\n", job_number);
     } catch (const std::out_of_range& _) {
-        printf("ERROR: Failed to find job: %i - not suspending\n", job_number);
+        print_error("Failed to find job: %i - not suspending\n", job_number);
     }
 }
 
@@ -58,14 +1372,14 @@ void suspend(int job_number) {
  */
 void resume(int job_number) {
     try {
-        if (!job_list.at(job_number).running) {
+        if (!job_table.at(job_number).running) {
             printf("Job %i already terminated\n", job_number);
             return;
         }
-        kill(job_list.at(job_number).pid, SIGCONT);
+        signal_job(job_table.at(job_number), SIGCONT);
         printf("Resumed job: %i\n", job_number);
     } catch (const std::out_of_range& _) {
-        printf("ERROR: Failed to find job: %i - not resuming\n", job_number);
+        print_error("Failed to find job: %i - not resuming\n", job_number);
     }
 }
 
@@ -76,28 +1390,645 @@ void resume(int job_number) {
  */
 void terminate(int job_number) {
     try {
-        if (!job_list.at(job_number).running) {
+        if (!job_table.at(job_number).running) {
             printf("Job %i already terminated\n", job_number);
             return;
         }
-        job_list.at(job_number).running = false;
-        kill(job_list.at(job_number).pid, SIGKILL);
+        signal_job(job_table.at(job_number), SIGKILL);
         printf("Killed job: %i\n", job_number);
     } catch (const std::out_of_range& _) {
-        printf("ERROR: Invalid job number: %i - not terminating\n", job_number);
+        print_error("Invalid job number: %i - not terminating\n", job_number);
+    }
+}
+
+/**
+ * Parse the jobs selected by the arguments of a command. Each argument is a job number, a range of
+ * numbers such as 3-10, "all", or a glob pattern matched against the command of the job.
+ * @param tokens The command followed by its arguments
+ * @param specs Set to the parsed selections
+ * @return true upon success, false if an argument is not valid
+ */
+bool parse_job_specs(const std::vector<std::string> &tokens, std::vector<job_spec> &specs) {
+    for (size_t i = 1; i < tokens.size(); i++) {
+        const std::string &token = tokens.at(i);
+        job_spec spec = {.first = 0, .last = INT_MAX, .pattern = ""};
+
+        if (isdigit(token.at(0))) {
+            char *end = nullptr;
+            long first = strtol(token.c_str(), &end, 10);
+            long last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+            if (*end != '\0' || last < first || last > INT_MAX) {
+                print_error("Invalid job range: %s\n", token.c_str());
+                return false;
+            }
+            spec.first = (int) first;
+            spec.last = (int) last;
+        } else if (token != "all") {
+            spec.pattern = token;
+        }
+        specs.push_back(spec);
+    }
+    errno = 0;
+    return true;
+}
+
+/**
+ * Determine whether a job is selected by any of the given selections
+ * @param this_job The job to check
+ * @param specs The selections
+ * @return true if the job is selected
+ */
+bool job_selected(const job &this_job, const std::vector<job_spec> &specs) {
+    for (auto &spec : specs) {
+        if (spec.pattern.empty() ? this_job.index >= spec.first && this_job.index <= spec.last :
+            fnmatch(spec.pattern.c_str(), this_job.cmd.c_str(), 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Send a signal to every job that has not ended and is selected. A single range is walked
+ * directly, other selections in a single pass over the job table.
+ * @param specs The selections
+ * @param signal The signal to send
+ * @param action What the signal does, printed with the number of jobs signalled
+ */
+void signal_jobs(const std::vector<job_spec> &specs, int signal, const char *action) {
+    int first = 0;
+    int last = (int) job_table.size() - 1;
+    if (specs.size() == 1 && specs.at(0).pattern.empty()) {
+        first = std::max(first, specs.at(0).first);
+        last = std::min(last, specs.at(0).last);
+    }
+
+    int count = 0;
+    for (int job_number = first; job_number <= last; job_number++) {
+        job &this_job = job_table[job_number];
+        if (this_job.running && job_selected(this_job, specs)) {
+            signal_job(this_job, signal);
+            count++;
+        }
+    }
+    printf("%s %i jobs\n", action, count);
+}
+
+/**
+ * Parse the options that come before the command of run and runmany. The cgroup options are
+ * group=NAME to start the jobs in a named job group, cpu=PERCENT of one CPU or max,
+ * mem=BYTES or max, and io=MAJ:MIN,KEY=VALUE,... such as io=8:0,rbps=1048576,wbps=max.
+ * The placement options are cpus=LIST such as 0-3,6, pin=rr to pin each job to one of those CPUs
+ * in turn, numa=local, numa=bind:NODES, numa=interleave:NODES or numa=preferred:NODE,
+ * sched=other, sched=batch, sched=idle, sched=fifo:PRIORITY or sched=rr:PRIORITY, and nice=N.
+ * perf=on counts the cycles, instructions and cache misses of the jobs.
+ * @param tokens The command line
+ * @param first The index of the first option
+ * @param options Set to the parsed options
+ * @return The index of the command to run, or 0 if an option is not valid
+ */
+size_t parse_job_options(const std::vector<std::string> &tokens, size_t first, job_options &options) {
+    size_t i = first;
+    for (; i < tokens.size(); i++) {
+        const std::string &token = tokens.at(i);
+        if (token.compare(0, 6, "group=") == 0) {
+            // Names of the cgroups of single jobs start with "job."
+            options.group = token.substr(6);
+            if (options.group.empty() || options.group.find('/') != std::string::npos ||
+                options.group.compare(0, 4, "job.") == 0 || options.group[0] == '.') {
+                print_error("Invalid job group: %s\n", options.group.c_str());
+                return 0;
+            }
+        } else if (token.compare(0, 4, "cpu=") == 0) {
+            char *end = nullptr;
+            long percent = strtol(token.c_str() + 4, &end, 10);
+            if (token.substr(4) == "max") {
+                options.cpu = "max " + std::to_string(CPU_PERIOD_USEC);
+            } else if (*end == '\0' && percent > 0) {
+                options.cpu = std::to_string(percent * CPU_PERIOD_USEC / 100) + " " + std::to_string(CPU_PERIOD_USEC);
+            } else {
+                print_error("Invalid CPU limit: %s\n", token.c_str());
+                return 0;
+            }
+        } else if (token.compare(0, 5, "cpus=") == 0) {
+            options.cpus.clear();
+            if (!parse_ranges(token.substr(5), CPU_SETSIZE, options.cpus)) {
+                print_error("Invalid CPU list: %s\n", token.c_str());
+                return 0;
+            }
+        } else if (token == "pin=rr") {
+            options.pin = true;
+        } else if (token.compare(0, 5, "numa=") == 0) {
+            std::string mode = token.substr(5, token.find(':') - 5);
+            std::vector<int> nodes;
+            bool has_nodes = token.find(':') != std::string::npos &&
+                             parse_ranges(token.substr(token.find(':') + 1), sizeof(options.numa_nodes) * 8, nodes);
+            options.numa_mode = mode == "local" && token.find(':') == std::string::npos ? MPOL_LOCAL :
+                                mode == "bind" && has_nodes ? MPOL_BIND :
+                                mode == "interleave" && has_nodes ? MPOL_INTERLEAVE :
+                                mode == "preferred" && has_nodes && nodes.size() == 1 ? MPOL_PREFERRED : -1;
+            if (options.numa_mode < 0) {
+                print_error("Invalid NUMA policy: %s\n", token.c_str());
+                return 0;
+            }
+            options.numa_nodes = 0;
+            for (int node : nodes) {
+                options.numa_nodes |= 1UL << node;
+            }
+        } else if (token.compare(0, 6, "sched=") == 0) {
+            std::string policy = token.substr(6, token.find(':') - 6);
+            bool realtime = policy == "fifo" || policy == "rr";
+            char *end = nullptr;
+            options.sched_priority = realtime && token.find(':') != std::string::npos ?
+                                     (int) strtol(token.c_str() + token.find(':') + 1, &end, 10) : 0;
+            options.sched_policy = policy == "other" ? SCHED_OTHER : policy == "batch" ? SCHED_BATCH :
+                                   policy == "idle" ? SCHED_IDLE : policy == "fifo" ? SCHED_FIFO :
+                                   policy == "rr" ? SCHED_RR : -1;
+            if (options.sched_policy < 0 || (realtime ? !end || *end != '\0' :
+                                             token.find(':') != std::string::npos)) {
+                print_error("Invalid scheduler class: %s\n", token.c_str());
+                return 0;
+            }
+        } else if (token.compare(0, 5, "nice=") == 0) {
+            char *end = nullptr;
+            options.nice = (int) strtol(token.c_str() + 5, &end, 10);
+            options.set_nice = true;
+            if (token.size() == 5 || *end != '\0' || options.nice < -20 || options.nice > 19) {
+                print_error("Invalid nice level: %s\n", token.c_str());
+                return 0;
+            }
+        } else if (token == "perf=on") {
+            options.perf = true;
+        } else if (token.compare(0, 4, "mem=") == 0) {
+            options.memory = token.substr(4);
+        } else if (token.compare(0, 3, "io=") == 0) {
+            options.io = token.substr(3);
+            std::replace(options.io.begin(), options.io.end(), ',', ' ');
+        } else {
+            break;
+        }
     }
+    errno = 0;
+    return i;
 }
 
 /**
- * Terminate all spawned jobs
+ * Terminate all spawned jobs and wait for them, so that their times are counted as child times
  */
 void terminate_all() {
-    for (auto &this_job : job_list) {
+    for (auto &this_job : job_table) {
         if (this_job.running) {
-            kill(this_job.pid, SIGKILL);
+            signal_job(this_job, SIGKILL);
             printf("Terminated job: %i (pid= %i)\n", this_job.index, this_job.pid);
         }
     }
+    for (auto &this_job : job_table) {
+        int status;
+        rusage usage {};
+        if (this_job.running && wait4(this_job.pid, &status, 0, &usage) == this_job.pid) {
+            end_job(this_job, status, usage);
+        }
+    }
+}
+
+/**
+ * Print the time spent between two calls to times(), by a1jobs and by the jobs it reaped
+ * @param start_time The time returned by the first call
+ * @param start_cpu The times recorded by the first call
+ * @param end_time The time returned by the second call
+ * @param end_cpu The times recorded by the second call
+ */
+void print_times(clock_t start_time, const tms &start_cpu, clock_t end_time, const tms &end_cpu) {
+    double ticks = sysconf(_SC_CLK_TCK);
+    printf("Real time: %.2f sec\n", (end_time - start_time) / ticks);
+    printf("User time: %.2f sec\n", (end_cpu.tms_utime - start_cpu.tms_utime) / ticks);
+    printf("Sys time: %.2f sec\n", (end_cpu.tms_stime - start_cpu.tms_stime) / ticks);
+    printf("Child user time: %.2f sec\n", (end_cpu.tms_cutime - start_cpu.tms_cutime) / ticks);
+    printf("Child sys time: %.2f sec\n", (end_cpu.tms_cstime - start_cpu.tms_cstime) / ticks);
+}
+
+/**
+ * Load a job graph for batch. Each line is either a job:
+ *   NAME [after=JOB,...] [tags=RESOURCE,...] [cost=N]: [options] cmd [arg ...]
+ * or the number of jobs that may hold a resource at once, which is 1 unless given:
+ *   resource NAME N
+ * Blank lines and lines starting with # are ignored. Jobs may run after jobs further down.
+ * @param path The file to load
+ * @param nodes Set to the jobs of the graph
+ * @param capacity Set to the number of jobs that may hold each resource at once
+ * @return true upon success, false if the file cannot be read or is not valid
+ */
+bool load_batch(const std::string &path, std::vector<batch_node> &nodes, std::map<std::string, int> &capacity) {
+    std::ifstream file(path);
+    if (!file) {
+        print_error("Failed to open %s: %s\n", path.c_str(), strerror(errno));
+        errno = 0;
+        return false;
+    }
+
+    std::map<std::string, int> names;
+    std::vector<std::vector<std::string>> after;
+    std::string line;
+    for (int line_number = 1; std::getline(file, line); line_number++) {
+        std::istringstream head_stream(line.substr(0, line.find(':')));
+        std::vector<std::string> head {
+            std::istream_iterator<std::string>{head_stream},
+            std::istream_iterator<std::string>{}
+        };
+        if (head.empty() || head.at(0).at(0) == '#') {
+            continue;
+        }
+
+        if (head.at(0) == "resource" && line.find(':') == std::string::npos) {
+            char *end = nullptr;
+            long count = head.size() == 3 ? strtol(head.at(2).c_str(), &end, 10) : 0;
+            if (count < 1 || *end != '\0' || count > INT_MAX) {
+                print_error("%s:%i: Expected 'resource NAME N'\n", path.c_str(), line_number);
+                return false;
+            }
+            capacity[head.at(1)] = (int) count;
+            continue;
+        }
+
+        batch_node node = {.name = head.at(0), .args = {}, .options = {}, .deps = {}, .dependents = {},
+                           .tags = {}, .cost = 1, .priority = 0, .waiting = 0, .state = BATCH_WAITING,
+                           .job_number = -1, .pid = 0};
+        std::vector<std::string> node_after;
+        bool valid = line.find(':') != std::string::npos && !names.count(node.name);
+        for (size_t i = 1; valid && i < head.size(); i++) {
+            std::string &option = head.at(i);
+            std::string value = option.substr(option.find('=') + 1);
+            std::replace(value.begin(), value.end(), ',', ' ');
+            std::istringstream values(value);
+            if (option.compare(0, 6, "after=") == 0) {
+                node_after.insert(node_after.end(), std::istream_iterator<std::string>{values},
+                                  std::istream_iterator<std::string>{});
+            } else if (option.compare(0, 5, "tags=") == 0) {
+                node.tags.insert(node.tags.end(), std::istream_iterator<std::string>{values},
+                                 std::istream_iterator<std::string>{});
+            } else if (option.compare(0, 5, "cost=") == 0) {
+                char *end = nullptr;
+                node.cost = strtod(value.c_str(), &end);
+                valid = node.cost > 0 && *end == '\0';
+            } else {
+                valid = false;
+            }
+        }
+
+        // The command is parsed like the arguments of run
+        std::istringstream command_stream("run " + (valid ? line.substr(line.find(':') + 1) : ""));
+        std::vector<std::string> command {
+            std::istream_iterator<std::string>{command_stream},
+            std::istream_iterator<std::string>{}
+        };
+        size_t first = parse_job_options(command, 1, node.options);
+        if (!valid || first == 0 || first >= command.size()) {
+            print_error("%s:%i: Expected 'NAME [after=JOB,...] [tags=RESOURCE,...] [cost=N]: cmd [arg ...]'\n",
+                        path.c_str(), line_number);
+            return false;
+        }
+        node.args.assign(command.begin() + first, command.end());
+
+        names[node.name] = (int) nodes.size();
+        nodes.push_back(node);
+        after.push_back(node_after);
+    }
+    errno = 0;
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        for (auto &name : after.at(i)) {
+            if (!names.count(name)) {
+                print_error("%s: Job %s runs after unknown job %s\n", path.c_str(), nodes[i].name.c_str(),
+                            name.c_str());
+                return false;
+            }
+            nodes[i].deps.push_back(names[name]);
+            nodes[names[name]].dependents.push_back((int) i);
+        }
+        nodes[i].waiting = (int) nodes[i].deps.size();
+    }
+    return true;
+}
+
+/**
+ * Order a job graph so that every job comes after the jobs it runs after, and give each job the
+ * cost of the longest path from its start to the end of the graph as its priority
+ * @param nodes The jobs of the graph
+ * @return false if the graph has a cycle
+ */
+bool prioritize_batch(std::vector<batch_node> &nodes) {
+    std::vector<int> order;
+    std::vector<int> waiting;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        waiting.push_back((int) nodes[i].deps.size());
+        if (waiting.back() == 0) {
+            order.push_back((int) i);
+        }
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        for (int dependent : nodes[order[i]].dependents) {
+            if (--waiting[dependent] == 0) {
+                order.push_back(dependent);
+            }
+        }
+    }
+    if (order.size() < nodes.size()) {
+        return false;
+    }
+
+    for (auto it = order.rbegin(); it != order.rend(); it++) {
+        batch_node &node = nodes[*it];
+        node.priority = node.cost;
+        for (int dependent : node.dependents) {
+            node.priority = std::max(node.priority, node.cost + nodes[dependent].priority);
+        }
+    }
+    return true;
+}
+
+/**
+ * Record the end of a batch job, and make the jobs that run after it ready, or skip them all the
+ * way down the graph if it failed
+ * @param nodes The jobs of the graph
+ * @param index The job that ended
+ * @param state BATCH_DONE, BATCH_FAILED or BATCH_SKIPPED
+ * @param ready Set of ready jobs, by priority
+ * @return The number of jobs that ended, counting the ones skipped
+ */
+int finish_batch_node(std::vector<batch_node> &nodes, int index, batch_state state,
+                      std::set<std::pair<double, int>> &ready) {
+    nodes[index].state = state;
+    int finished = 1;
+    for (int dependent : nodes[index].dependents) {
+        batch_node &next = nodes[dependent];
+        if (next.state != BATCH_WAITING) {
+            continue;
+        } else if (state != BATCH_DONE) {
+            printf("Batch job %s skipped: %s did not succeed\n", next.name.c_str(), nodes[index].name.c_str());
+            finished += finish_batch_node(nodes, dependent, BATCH_SKIPPED, ready);
+        } else if (--next.waiting == 0) {
+            next.state = BATCH_READY;
+            ready.insert({-next.priority, dependent});
+        }
+    }
+    return finished;
+}
+
+/**
+ * Run a job graph to completion. Up to max_running jobs run at once, and a job starts as soon as
+ * the jobs it runs after succeed and its resources are free. Of the jobs that are ready, the ones
+ * with the longest path to the end of the graph start first. Jobs that run after a job that failed
+ * are skipped.
+ * @param path The file of the job graph, read by load_batch()
+ * @param max_running The most jobs to run at once
+ * @param signal_fd The signalfd that SIGCHLD is read from
+ */
+void run_batch(const std::string &path, int max_running, int signal_fd) {
+    std::vector<batch_node> nodes;
+    std::map<std::string, int> capacity;
+    if (!load_batch(path, nodes, capacity)) {
+        return;
+    } else if (!prioritize_batch(nodes)) {
+        print_error("%s: The job graph has a cycle\n", path.c_str());
+        return;
+    }
+
+    tms start_cpu;
+    clock_t start_time = times(&start_cpu);
+    watch_input(false);
+
+    std::set<std::pair<double, int>> ready;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].waiting == 0) {
+            nodes[i].state = BATCH_READY;
+            ready.insert({-nodes[i].priority, (int) i});
+        }
+    }
+
+    std::map<std::string, int> in_use;
+    std::vector<int> running;
+    int finished = 0;
+    double job_time = 0;
+    while (finished < (int) nodes.size()) {
+        // Start the ready jobs with the longest paths first, passing over those waiting on resources
+        for (auto it = ready.begin(); it != ready.end() && (int) running.size() < max_running;) {
+            int index = it->second;
+            batch_node &node = nodes[index];
+            bool free = true;
+            for (auto &tag : node.tags) {
+                free = free && in_use[tag] < (capacity.count(tag) ? capacity[tag] : 1);
+            }
+            if (!free) {
+                it++;
+                continue;
+            }
+
+            it = ready.erase(it);
+            node.job_number = start_job(node.args, node.options, 0);
+            if (node.job_number < 0) {
+                printf("Batch job %s failed to start\n", node.name.c_str());
+                finished += finish_batch_node(nodes, index, BATCH_FAILED, ready);
+                it = ready.begin();
+                continue;
+            }
+            node.state = BATCH_RUNNING;
+            node.pid = job_table[node.job_number].pid;
+            for (auto &tag : node.tags) {
+                in_use[tag]++;
+            }
+            running.push_back(index);
+        }
+        if (running.empty()) {
+            break;
+        }
+
+        bool prompted = false;
+        handle_events(signal_fd, prompted, -1);
+
+        // A job that ended keeps its slot until the next job is started, so it can be found there
+        for (size_t i = 0; i < running.size();) {
+            batch_node &node = nodes[running[i]];
+            job &this_job = job_table[node.job_number];
+            if (this_job.pid == node.pid && this_job.running) {
+                i++;
+                continue;
+            }
+
+            for (auto &tag : node.tags) {
+                in_use[tag]--;
+            }
+            job_time += this_job.end_time - this_job.start_time;
+            bool succeeded = this_job.end_code == CLD_EXITED && this_job.end_status == 0;
+            if (!succeeded) {
+                printf("Batch job %s failed: %s\n", node.name.c_str(), job_state(this_job).c_str());
+            }
+            finished += finish_batch_node(nodes, running[i], succeeded ? BATCH_DONE : BATCH_FAILED, ready);
+            running.erase(running.begin() + i);
+        }
+    }
+
+    tms end_cpu;
+    clock_t end_time = times(&end_cpu);
+    watch_input(true);
+
+    int counts[BATCH_SKIPPED + 1] = {};
+    for (auto &node : nodes) {
+        counts[node.state]++;
+    }
+    double ticks = sysconf(_SC_CLK_TCK);
+    double wall = std::max(end_time - start_time, (clock_t) 1) / ticks;
+    double cpu = (end_cpu.tms_cutime - start_cpu.tms_cutime + end_cpu.tms_cstime - start_cpu.tms_cstime) / ticks;
+
+    printf("Batch %s: %zu jobs, %i succeeded, %i failed, %i skipped\n", path.c_str(), nodes.size(),
+           counts[BATCH_DONE], counts[BATCH_FAILED], counts[BATCH_SKIPPED]);
+    print_times(start_time, start_cpu, end_time, end_cpu);
+    printf("Parallelism: %.2f jobs, %.2f CPUs (limit %i jobs)\n", job_time / wall, cpu / wall, max_running);
+}
+
+/**
+ * Wait until no job is running. Stopped and frozen jobs are not waited for, since they would not
+ * end until resumed.
+ * @param signal_fd The signalfd that SIGCHLD is read from
+ */
+void wait_jobs(int signal_fd) {
+    watch_input(false);
+    while (true) {
+        int running = 0;
+        for (auto &found : job_pids) {
+            const job &this_job = job_table[found.second];
+            running += !this_job.stopped && !this_job.frozen;
+        }
+        if (running == 0) {
+            break;
+        }
+        bool prompted = false;
+        handle_events(signal_fd, prompted, -1);
+    }
+    watch_input(true);
+}
+
+/**
+ * Run one command entered at the prompt or read from a script
+ * @param cmd The command line
+ * @param signal_fd The signalfd that SIGCHLD is read from
+ * @return false if a1jobs should exit, true otherwise
+ */
+bool run_command(const std::string &cmd, int signal_fd) {
+    // Tokenize the command input (space delimited)
+    std::vector<std::string> tokens = split_words(cmd);
+
+    if (tokens.empty()) {
+        printf("No command inputted\n");
+    } else if (tokens.at(0) == "list") {
+        // list [running|stopped|done]: List every job with its state, or only those in one state
+        if (tokens.size() > 1 && tokens.at(1) != "running" && tokens.at(1) != "stopped" &&
+            tokens.at(1) != "done") {
+            print_error("Invalid job state: %s\n", tokens.at(1).c_str());
+        } else {
+            list(tokens.size() > 1 ? tokens.at(1) : "");
+        }
+    } else if (tokens.at(0) == "run") {
+        // run [options] cmd [arg ...]: Start a job with any number of arguments
+        job_options options;
+        size_t command = parse_job_options(tokens, 1, options);
+        if (command == 0) {
+            return true;
+        } else if (command >= tokens.size()) {
+            print_error("Too few argument to run\n");
+        } else {
+            run_jobs(std::vector<std::string>(tokens.begin() + command, tokens.end()), 1, options);
+        }
+    } else if (tokens.at(0) == "runmany") {
+        // runmany N [options] cmd [arg ...]: Start N instances of a job at once
+        job_options options;
+        size_t command = tokens.size() < 2 ? 2 : parse_job_options(tokens, 2, options);
+        char *end = nullptr;
+        long count = command < tokens.size() ? strtol(tokens.at(1).c_str(), &end, 10) : 0;
+        if (command == 0) {
+            return true;
+        } else if (command >= tokens.size()) {
+            print_error("Too few argument to runmany\n");
+        } else if (*end != '\0' || count < 1 || count > MAX_JOBS) {
+            print_error("Invalid number of jobs: %s\n", tokens.at(1).c_str());
+        } else {
+            int started = run_jobs(std::vector<std::string>(tokens.begin() + command, tokens.end()), (int) count,
+                                   options);
+            printf("Started %i of %li jobs\n", started, count);
+        }
+    } else if (tokens.at(0) == "suspend" || tokens.at(0) == "resume" || tokens.at(0) == "terminate") {
+        // suspend|resume|terminate job ...: Signal one job, or every job selected by numbers,
+        // ranges, "all" or patterns
+        std::vector<job_spec> specs;
+        if (tokens.size() < 2) {
+            print_error("No job number specified\n");
+        } else if (parse_job_specs(tokens, specs)) {
+            bool single = specs.size() == 1 && specs.at(0).pattern.empty() &&
+                          specs.at(0).first == specs.at(0).last;
+            if (tokens.at(0) == "suspend") {
+                single ? suspend(specs.at(0).first) : signal_jobs(specs, SIGSTOP, "Suspended");
+            } else if (tokens.at(0) == "resume") {
+                single ? resume(specs.at(0).first) : signal_jobs(specs, SIGCONT, "Resumed");
+            } else {
+                single ? terminate(specs.at(0).first) : signal_jobs(specs, SIGKILL, "Killed");
+            }
+        }
+    } else if (tokens.at(0) == "tail" || tokens.at(0) == "attach") {
+        // tail N [lines]: Print the end of the output of job N
+        // attach N: Follow the output of job N until a line is entered
+        char *end = nullptr;
+        long job_number = tokens.size() > 1 ? strtol(tokens.at(1).c_str(), &end, 10) : -1;
+        bool valid = tokens.size() > 1 && isdigit(tokens.at(1).at(0)) && *end == '\0' && job_number <= INT_MAX;
+        long lines = tokens.size() > 2 ? strtol(tokens.at(2).c_str(), &end, 10) : TAIL_LINES;
+        valid = valid && (tokens.size() < 3 || *end == '\0') && lines >= 1 && lines <= INT_MAX;
+        if (tokens.size() < 2) {
+            print_error("No job number specified\n");
+        } else if (!valid || tokens.size() > 3 || (tokens.at(0) == "attach" && tokens.size() > 2)) {
+            print_error("Expected 'tail N [lines]' or 'attach N'\n");
+        } else if (tokens.at(0) == "tail") {
+            tail((int) job_number, (int) lines);
+        } else if (script_mode) {
+            print_error("A script cannot attach to a job\n");
+        } else {
+            attach((int) job_number);
+        }
+    } else if (tokens.at(0) == "batch") {
+        // batch FILE [-j N]: Run a job graph with up to N jobs at once, one per CPU by default
+        std::string path;
+        long max_running = sysconf(_SC_NPROCESSORS_ONLN);
+        for (size_t i = 1; i < tokens.size(); i++) {
+            if (tokens.at(i).compare(0, 2, "-j") == 0) {
+                std::string value = tokens.at(i).size() > 2 ? tokens.at(i).substr(2) :
+                                    i + 1 < tokens.size() ? tokens.at(++i) : "";
+                char *end = nullptr;
+                max_running = strtol(value.c_str(), &end, 10);
+                if (*end != '\0') {
+                    max_running = 0;
+                }
+            } else {
+                path = tokens.at(i);
+            }
+        }
+
+        if (path.empty() || max_running < 1 || max_running > INT_MAX) {
+            print_error("Expected 'batch FILE [-j N]'\n");
+        } else {
+            run_batch(path, (int) max_running, signal_fd);
+        }
+    } else if (tokens.at(0) == "wait") {
+        // wait: Wait until every running job ended
+        wait_jobs(signal_fd);
+    } else if (tokens.at(0) == "exit") {
+        terminate_all();
+        remove_cgroups();
+        return false;
+    } else if (tokens.at(0) == "quit") {
+        printf("WARNING: Exiting a1jobs without terminating head processes\n");
+        return false;
+    } else {
+        print_error("Invalid input\n");
+    }
+
+    return true;
 }
 
 /**
@@ -114,8 +2045,6 @@ int main(int argc, char *argv[]) {
     };
     setrlimit(RLIMIT_CPU, &time_limit);
 
-    int job_idx = 0;
-
     // 2. Call function times() to record the user and CPU start times
     tms start_cpu;
     clock_t start_time = times(&start_cpu);
@@ -123,121 +2052,170 @@ int main(int argc, char *argv[]) {
     // Get this process's pid
     pid_t pid = getpid();
 
-    // 3. Run the main loop of the program
-    while (true) {
-        std::string cmd;
+    // Jobs with cgroup options get cgroups under the cgroup of a1jobs, or under cgroup=DIR. The
+    // output of jobs is logged to a temporary directory, or kept in logs=DIR. report=FILE gets a
+    // tab-separated line with the resources of every job as it ends. freezer=on gives every job a
+    // cgroup, so that suspend, resume and terminate act on the whole process tree of the job.
+    // script reads commands from stdin without prompts, and script=FILE from FILE.
+    report_start = now_sec();
+    cgroup_parent = find_cgroup_dir();
+    log_dir = std::string(getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp") + "/a1jobs." + std::to_string(pid);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "cgroup=", 7) == 0) {
+            cgroup_parent = argv[i] + 7;
+        } else if (strncmp(argv[i], "logs=", 5) == 0 && argv[i][5] != '\0') {
+            log_dir = argv[i] + 5;
+            keep_logs = true;
+        } else if (strcmp(argv[i], "freezer=on") == 0) {
+            use_freezer = true;
+        } else if (strcmp(argv[i], "script") == 0) {
+            script_mode = true;
+        } else if (strncmp(argv[i], "script=", 7) == 0 && argv[i][7] != '\0') {
+            // The script takes the place of stdin, so that it is read like commands typed in
+            int script_fd = open(argv[i] + 7, O_RDONLY | O_CLOEXEC);
+            if (script_fd < 0 || dup2(script_fd, STDIN_FILENO) < 0) {
+                print_error("%s: %s\n", argv[i] + 7, strerror(errno));
+                return 1;
+            }
+            close(script_fd);
+            script_mode = true;
+        } else if (strncmp(argv[i], "report=", 7) == 0 && argv[i][7] != '\0' && !report_file) {
+            report_file = fopen(argv[i] + 7, "w");
+            if (!report_file) {
+                print_error("%s: %s\n", argv[i] + 7, strerror(errno));
+                return 1;
+            }
+            fprintf(report_file, "job\tpid\tcmd\tend\tstatus\tstart_sec\trun_sec\tuser_sec\tsys_sec\tmax_rss_kb"
+                                 "\tminflt\tmajflt\tnvcsw\tnivcsw");
+            for (auto name : counter_names) {
+                fprintf(report_file, "\t%s", name);
+            }
+            fprintf(report_file, "\n");
+        } else {
+            print_error("Unknown argument %s. Expected 'a1jobs [cgroup=dir] [logs=dir] [report=file] "
+                        "[freezer=on] [script[=file]]'\n", argv[i]);
+            return 1;
+        }
+    }
 
-        // Get the current command input
-        std::cin.clear();
-        printf("a1jobs[%i]: ", pid);
-        std::getline(std::cin, cmd);
+    // 3. Block SIGCHLD and read it from a signalfd, so that jobs are reaped as they change state
+    // while the prompt waits for input
+    sigset_t child_mask;
+    sigemptyset(&child_mask);
+    sigaddset(&child_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_mask, nullptr);
+    int signal_fd = signalfd(-1, &child_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        print_error("%s\n", strerror(errno));
+        return 1;
+    }
 
-        // Tokenize the command input (space delimited)
-        std::istringstream iss(cmd);
-        std::vector<std::string> tokens {
-            std::istream_iterator<std::string>{iss},
-            std::istream_iterator<std::string>{}
-        };
+    // One epoll set watches the commands, the jobs and their output
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = signal_fd}};
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0) {
+        print_error("%s\n", strerror(errno));
+        return 1;
+    }
+    event.data.fd = STDIN_FILENO;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0) {
+        // A regular file cannot be watched, but can always be read without waiting
+        input_is_file = errno == EPERM;
+        errno = 0;
+    }
 
-        if (tokens.empty()) {
-            printf("No command inputted\n");
-        } else if (tokens.at(0) == "list") {
-            // List all jobs that have not been explicitly terminated by the user
-            list();
-        } else if (tokens.at(0) == "run") {
-            if (job_idx < MAX_JOBS) {
-                pid_t c_pid = fork();
-                errno = 0;
-
-                if (c_pid == 0) {
-                    switch (tokens.size()) {
-                        case 1:
-                            printf("Too few argument to run\n");
-                            break;
-                        case 2:
-                            execlp(tokens.at(1).c_str(), tokens.at(1).c_str(), (char *) nullptr);
-                            break;
-                        case 3:
-                            execlp(tokens.at(1).c_str(), tokens.at(1).c_str(), tokens.at(2).c_str(), (char *) nullptr);
-                            break;
-                        case 4:
-                            execlp(tokens.at(1).c_str(), tokens.at(1).c_str(), tokens.at(2).c_str(),
-                                tokens.at(3).c_str(), (char *) nullptr);
-                            break;
-                        case 5:
-                            execlp(tokens.at(1).c_str(), tokens.at(1).c_str(), tokens.at(2).c_str(),
-                                tokens.at(3).c_str(), tokens.at(4).c_str(), (char *) nullptr);
-                            break;
-                        case 6:
-                            execlp(tokens.at(1).c_str(), tokens.at(1).c_str(), tokens.at(2).c_str(),
-                                tokens.at(3).c_str(), tokens.at(4).c_str(), tokens.at(5).c_str(), (char *) nullptr);
-                            break;
-                        default:
-                            printf("Too many arguments to run\n");
-                            break;
-                    }
+    std::string input;
+    bool prompted = false;
+    bool done = false;
+    int commands = 0;
+    int failed = 0;
+    double script_start = now_sec();
+    double script_end = script_start;  // When the last command of the script finished
 
-                    return 0;
-                }
+    // 4. Run the main loop of the program
+    while (!done) {
+        if (!script_mode && !prompted && attached_fd < 0) {
+            printf("a1jobs[%i]: ", pid);
+            fflush(stdout);
+            prompted = true;
+        }
 
-                if (errno) {
-                    printf("ERROR: %s\n", strerror(errno));
-                    errno = 0;
-                } else {
-                    job new_job = {
-                        .index = job_idx,
-                        .pid = c_pid,
-                        .cmd = tokens.at(1),
-                        .running = true
-                    };
-                    job_list.push_back(new_job);
-                    job_idx++;
-                }
-            } else {
-                printf("Too many jobs running\n");
-            }
-        } else if (tokens.at(0) == "suspend") {
-            if (tokens.size() < 2) {
-                printf("ERROR: No job number specified\n");
+        if (handle_events(signal_fd, prompted, input_is_file ? 0 : -1) || input_is_file) {
+            char buffer[MAX_BUFFER];
+            ssize_t n = read(STDIN_FILENO, buffer, MAX_BUFFER);
+            bool at_end = n <= 0;
+            if (at_end) {
+                // A last line without a newline is still run
+                input.append(input.empty() ? "" : "\n");
             } else {
-                int job_number = std::stoi(tokens.at(1), nullptr, 10);
-                suspend(job_number);
+                input.append(buffer, (size_t) n);
             }
-        } else if (tokens.at(0) == "resume") {
-            if (tokens.size() < 2) {
-                printf("ERROR: No job number specified\n");
-            } else {
-                int job_number = std::stoi(tokens.at(1), nullptr, 10);
-                resume(job_number);
+
+            // Run each complete line, leaving a partial line for the next read
+            size_t newline;
+            while (!done && (newline = input.find('\n')) != std::string::npos) {
+                std::string cmd = input.substr(0, newline);
+                input.erase(0, newline + 1);
+                if (attached_fd >= 0) {
+                    // Any line detaches, and is run if it is a command
+                    printf("Detached from job %i\n", job_outputs.at(attached_fd).job_number);
+                    attached_fd = -1;
+                    if (cmd.find_first_not_of(" \t") == std::string::npos) {
+                        continue;
+                    }
+                }
+                if (script_mode) {
+                    // Each command is followed by a tab-separated line: its number, ok or error, how
+                    // long it took and the command itself. Blank lines and comments are skipped.
+                    size_t first = cmd.find_first_not_of(" \t\r");
+                    if (first == std::string::npos || cmd[first] == '#') {
+                        continue;
+                    }
+                    int errors = command_errors;
+                    double command_start = now_sec();
+                    done = !run_command(cmd, signal_fd);
+                    bool ok = command_errors == errors;
+                    failed += !ok;
+                    script_end = now_sec();
+                    printf("result\t%i\t%s\t%.6f\t%s\n", ++commands, ok ? "ok" : "error", script_end - command_start,
+                           cmd.c_str());
+                    continue;
+                }
+                if (!prompted) {
+                    printf("a1jobs[%i]: ", pid);
+                }
+                prompted = false;
+                done = !run_command(cmd, signal_fd);
             }
-        } else if (tokens.at(0) == "terminate") {
-            if (tokens.size() < 2) {
-                printf("ERROR: No job number specified\n");
-            } else {
-                int job_number = std::stoi(tokens.at(1), nullptr, 10);
-                terminate(job_number);
+
+            if (at_end && !done) {
+                // End of input ends the session like exit, so that no job is left behind
+                if (!script_mode) {
+                    printf("\n");
+                }
+                terminate_all();
+                remove_cgroups();
+                break;
             }
-        } else if (tokens.at(0) == "exit") {
-            terminate_all();
-            break;
-        } else if (tokens.at(0) == "quit") {
-            printf("WARNING: Exiting a1jobs without terminating head processes\n");
-            break;
-        } else {
-            printf("ERROR: Invalid input\n");
         }
     }
+    close_outputs();
+    close(epoll_fd);
+    close(signal_fd);
+    if (report_file) {
+        fclose(report_file);
+    }
+
+    if (script_mode) {
+        double elapsed = script_end - script_start;
+        printf("Script: %i commands, %i failed, %.3f sec, %.0f commands/s\n", commands, failed, elapsed,
+               elapsed > 0 ? commands / elapsed : 0);
+    }
 
-    // Call function times() to record the user and CPU end times
+    // Call function times() to record the user and CPU end times, and print the recorded times
     tms end_cpu;
     clock_t end_time = times(&end_cpu);
-
-    // Calculate and print recorded times
-    printf("Real time: %li sec\n", (long int) (end_time - start_time) / sysconf(_SC_CLK_TCK));
-    printf("User time: %li sec\n", (long int) (end_cpu.tms_utime - start_cpu.tms_utime) / sysconf(_SC_CLK_TCK));
-    printf("Sys time: %li sec\n", (long int) (end_cpu.tms_stime - start_cpu.tms_stime) / sysconf(_SC_CLK_TCK));
-    printf("Child user time: %li sec\n", (long int) (end_cpu.tms_cutime - start_cpu.tms_cutime) / sysconf(_SC_CLK_TCK));
-    printf("Child sys time: %li sec\n", (long int) (end_cpu.tms_cstime - start_cpu.tms_cstime) / sysconf(_SC_CLK_TCK));
+    print_times(start_time, start_cpu, end_time, end_cpu);
 
     return 0;
 }
\ No newline at end of file
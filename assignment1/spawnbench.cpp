@@ -0,0 +1,139 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <zconf.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const long DEFAULT_MB = 256;
+static const long DEFAULT_COUNT = 200;
+static const long MAX_MB = 1L << 20;  // 1 TiB, far beyond any parent worth measuring
+static const long MAX_COUNT = 1000000;
+
+extern char **environ;
+
+/**
+ * Get the current time of the monotonic clock
+ * @return The time in seconds
+ */
+double now_sec() {
+    timespec now {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Start a copy of the command with fork() and execvp(), the way a1jobs used to
+ * @param argv The command and its arguments, terminated by nullptr
+ * @return The pid of the child, or -1 upon failure
+ */
+pid_t spawn_fork(char *const argv[]) {
+    pid_t c_pid = fork();
+    if (c_pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return c_pid;
+}
+
+/**
+ * Start a copy of the command with vfork() and execvp(). The child borrows the memory of the parent
+ * until it calls exec, so nothing is copied.
+ * @param argv The command and its arguments, terminated by nullptr
+ * @return The pid of the child, or -1 upon failure
+ */
+pid_t spawn_vfork(char *const argv[]) {
+    pid_t c_pid = vfork();
+    if (c_pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return c_pid;
+}
+
+/**
+ * Start a copy of the command with posix_spawnp(), the way a1jobs does
+ * @param argv The command and its arguments, terminated by nullptr
+ * @return The pid of the child, or -1 upon failure
+ */
+pid_t spawn_posix(char *const argv[]) {
+    pid_t c_pid;
+    int error = posix_spawnp(&c_pid, argv[0], nullptr, nullptr, argv, environ);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return c_pid;
+}
+
+/**
+ * Start and wait for the command count times, one at a time, and print the spawn rate
+ * @param name The name of the method printed in the results
+ * @param spawn The method used to start the command
+ * @param argv The command and its arguments, terminated by nullptr
+ * @param count The number of times to start the command
+ */
+void run_bench(const char *name, pid_t (*spawn)(char *const[]), char *const argv[], long count) {
+    double start = now_sec();
+    for (long i = 0; i < count; i++) {
+        pid_t c_pid = spawn(argv);
+        if (c_pid < 0) {
+            printf("ERROR: %s\n", strerror(errno));
+            return;
+        }
+        waitpid(c_pid, nullptr, 0);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%-14s %10.1f spawns/s %10.1f us/spawn\n", name, count / elapsed, elapsed * 1e6 / count);
+}
+
+/**
+ * Measures how fast jobs can be started from a parent with a large address space. Each method
+ * starts the command count times after the parent touched mb MiB of memory, so fork() has that
+ * many page table entries to copy.
+ * Usage: spawnbench [mb] [count] [cmd [arg ...]]
+ */
+int main(int argc, char *argv[]) {
+    char *mb_end = nullptr;
+    char *count_end = nullptr;
+    errno = 0;
+    long mb = argc > 1 ? strtol(argv[1], &mb_end, 10) : DEFAULT_MB;
+    long count = argc > 2 ? strtol(argv[2], &count_end, 10) : DEFAULT_COUNT;
+    bool numbers = (argc < 2 || (*argv[1] != '\0' && *mb_end == '\0')) &&
+                   (argc < 3 || (*argv[2] != '\0' && *count_end == '\0')) && !errno;
+    if (!numbers || mb < 0 || mb > MAX_MB || count < 1 || count > MAX_COUNT) {
+        printf("ERROR: Usage: spawnbench [mb] [count] [cmd [arg ...]]\n");
+        return 1;
+    }
+
+    std::vector<char *> cmd;
+    if (argc > 3) {
+        cmd.assign(argv + 3, argv + argc);
+    } else {
+        cmd.push_back(const_cast<char *>("true"));
+    }
+    cmd.push_back(nullptr);
+
+    // Grow the address space of the parent and touch every page so it is mapped
+    size_t size = (size_t) mb * 1024 * 1024;
+    if (size > 0) {
+        void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            printf("ERROR: %s\n", strerror(errno));
+            return 1;
+        }
+        memset(memory, 1, size);
+    }
+
+    printf("Parent: %li MiB touched, %li spawns of %s\n", mb, count, cmd.at(0));
+    run_bench("fork+exec", spawn_fork, cmd.data(), count);
+    run_bench("vfork+exec", spawn_vfork, cmd.data(), count);
+    run_bench("posix_spawnp", spawn_posix, cmd.data(), count);
+
+    return 0;
+}
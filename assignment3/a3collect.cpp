@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include "flowexport.h"
+#include "ip.h"
+#include "util.h"
+
+#define DEFAULT_REPORT_MS 5000
+#define MAX_BUFFER 1024
+
+using namespace std;
+
+/**
+ * Latest counters of a rule, as last exported by its switch
+ */
+typedef struct {
+    FlowExportRecord record;
+    uint64_t reportedCount;  // pktCount at the previous report
+} CollectedFlow;
+
+/**
+ * Per switch totals seen by the collector
+ */
+typedef struct {
+    uint32_t nextSequence;
+    int datagrams;
+    int lost;
+    uint64_t packets;  // Sum of the exported deltas
+    uint64_t reportedPackets;  // packets at the previous report
+} CollectedSwitch;
+
+/**
+ * Adds one export datagram to the aggregated state. Malformed datagrams are ignored.
+ */
+void collectDatagram(char *datagram, ssize_t length, map<int, CollectedSwitch> &switches,
+                     map<pair<int, uint32_t>, CollectedFlow> &flows) {
+  if (length < (ssize_t) sizeof(FlowExportHeader)) return;
+
+  FlowExportHeader header {};
+  memcpy(&header, datagram, sizeof(header));
+  if (header.version != FLOW_EXPORT_VERSION ||
+      length != (ssize_t) (sizeof(header) + header.count * sizeof(FlowExportRecord))) {
+    return;
+  }
+
+  if (!switches.count(header.switchId)) {
+    switches[header.switchId] = {header.sequence, 0, 0, 0, 0};
+  }
+  CollectedSwitch &collected = switches[header.switchId];
+
+  // A sequence gap means datagrams were dropped on the way
+  if (header.sequence > collected.nextSequence) {
+    collected.lost += (int) (header.sequence - collected.nextSequence);
+  }
+  collected.nextSequence = header.sequence + 1;
+  collected.datagrams++;
+
+  for (uint16_t i = 0; i < header.count; i++) {
+    FlowExportRecord record {};
+    memcpy(&record, datagram + sizeof(header) + i * sizeof(record), sizeof(record));
+    collected.packets += record.pktDelta;
+
+    pair<int, uint32_t> key = make_pair(header.switchId, record.ruleIndex);
+    if (!flows.count(key)) flows[key] = {record, 0};
+    flows[key].record = record;
+  }
+}
+
+/**
+ * Prints the aggregated counters of every switch and rule, with rates since the last report.
+ */
+void collectorReport(map<int, CollectedSwitch> &switches,
+                     map<pair<int, uint32_t>, CollectedFlow> &flows, long elapsedMs) {
+  double seconds = elapsedMs > 0 ? elapsedMs / 1000.0 : 1.0;
+  uint64_t totalPackets = 0;
+  uint64_t totalNew = 0;
+
+  printf("Switches:\n");
+  for (auto &entry : switches) {
+    CollectedSwitch &collected = entry.second;
+    uint64_t newPackets = collected.packets - collected.reportedPackets;
+    printf("[sw%i] packets= %lu, rate= %.1f pkt/s, datagrams= %i, lost= %i\n", entry.first,
+           (unsigned long) collected.packets, newPackets / seconds, collected.datagrams,
+           collected.lost);
+    totalPackets += collected.packets;
+    totalNew += newPackets;
+    collected.reportedPackets = collected.packets;
+  }
+
+  printf("Flows:\n");
+  for (auto &entry : flows) {
+    FlowExportRecord &record = entry.second.record;
+    printf("[sw%i:%u] (destIp= %s, action= %s:%u, pktCount= %lu, rate= %.1f pkt/s)\n",
+           entry.first.first, record.ruleIndex,
+           formatIpRange(record.destIpLow, record.destIpHigh).c_str(),
+           record.action ? "FORWARD" : "DROP", record.actionVal, (unsigned long) record.pktCount,
+           (record.pktCount - entry.second.reportedCount) / seconds);
+    entry.second.reportedCount = record.pktCount;
+  }
+
+  printf("Total: packets= %lu, rate= %.1f pkt/s\n\n", (unsigned long) totalPackets,
+         totalNew / seconds);
+}
+
+/**
+ * Flow collector. Receives the flow records exported by switches started with export=<path> and
+ * aggregates them across switches. Reports periodically and on the list command.
+ * Usage: a3collect [socketPath] [reportMs]
+ */
+int main(int argc, char **argv) {
+  // Set a 10 minute CPU time limit
+  rlimit timeLimit{.rlim_cur = 600, .rlim_max = 600};
+  setrlimit(RLIMIT_CPU, &timeLimit);
+
+  string path = argc > 1 ? argv[1] : FLOW_EXPORT_DEFAULT_PATH;
+  long reportMs = DEFAULT_REPORT_MS;
+  char *end = nullptr;
+  errno = 0;
+  if (argc > 2) {
+    reportMs = strtol(argv[2], &end, 10);
+  }
+  if (reportMs < 1 || (end != nullptr && *end != '\0') || errno) {
+    printf("Error: Invalid report interval. Expected 'a3collect [socketPath] [reportMs]'\n");
+    return EXIT_FAILURE;
+  }
+
+  struct sockaddr_un address {};
+  if (path.length() >= sizeof(address.sun_path)) {
+    printf("Error: Socket path too long.\n");
+    return EXIT_FAILURE;
+  }
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+  struct pollfd pfds[2];
+  pfds[0].fd = STDIN_FILENO;
+  pfds[0].events = POLLIN;
+  pfds[0].revents = 0;
+
+  if ((pfds[1].fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    perror("socket() failure");
+    exit(errno);
+  }
+  pfds[1].events = POLLIN;
+  pfds[1].revents = 0;
+
+  unlink(path.c_str());  // Remove the socket of a previous run
+  errno = 0;
+  if (bind(pfds[1].fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    perror("bind() failure");
+    exit(errno);
+  }
+  printf("Collecting flows on %s\n", path.c_str());
+
+  map<int, CollectedSwitch> switches;
+  map<pair<int, uint32_t>, CollectedFlow> flows;
+  char datagram[sizeof(FlowExportHeader) + FLOW_EXPORT_MAX_RECORDS * sizeof(FlowExportRecord)];
+  char buffer[MAX_BUFFER];
+  long lastReportMs = monotonicMs();
+
+  while (true) {
+    long waitMs = reportMs - (monotonicMs() - lastReportMs);
+    if (poll(pfds, 2, (int) max(waitMs, 0L)) == -1) {
+      perror("poll() failure");
+      exit(errno);
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      memset(buffer, 0, sizeof(buffer));
+      if (read(pfds[0].fd, buffer, MAX_BUFFER - 1) <= 0) {
+        printf("Error: stdin closed.\n");
+        break;
+      }
+
+      string cmd = string(buffer);
+      trim(cmd);
+
+      if (cmd == "list") {
+        collectorReport(switches, flows, monotonicMs() - lastReportMs);
+        lastReportMs = monotonicMs();
+      } else if (cmd == "exit") {
+        collectorReport(switches, flows, monotonicMs() - lastReportMs);
+        break;
+      } else {
+        printf("Error: Unrecognized command. Please use \"list\" or \"exit\".\n");
+      }
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      ssize_t length = recv(pfds[1].fd, datagram, sizeof(datagram), 0);
+      if (length > 0) collectDatagram(datagram, length, switches, flows);
+    }
+
+    if (monotonicMs() - lastReportMs >= reportMs) {
+      collectorReport(switches, flows, monotonicMs() - lastReportMs);
+      lastReportMs = monotonicMs();
+    }
+  }
+
+  close(pfds[1].fd);
+  unlink(path.c_str());
+  return EXIT_SUCCESS;
+}
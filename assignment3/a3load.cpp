@@ -0,0 +1,470 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ip.h"
+#include "util.h"
+
+#define MAX_BUFFER 4096
+#define MAX_EVENTS 256
+#define OPEN_TIMEOUT_MS 10000
+#define ZIPF_RANKS 65536
+
+using namespace std;
+using namespace chrono;
+
+/**
+ * Load generator settings, from key=value arguments
+ */
+typedef struct {
+    vector<int> sweep;  // Connection counts to step through
+    long durationMs;  // Length of each step
+    double rate;  // QUERY packets per second per connection
+    int window;  // Most unanswered QUERY packets per connection
+    double zipfExponent;  // 0 for uniformly distributed destinations
+    uint32_t destLow;
+    uint32_t destHigh;
+    uint32_t ownBase;  // Address range announced by the first emulated switch
+    uint32_t ownBlock;  // Size of the address range announced by each emulated switch
+} LoadOptions;
+
+/**
+ * An emulated switch connected to the controller
+ */
+typedef struct {
+    int fd;
+    int id;
+    bool acked;
+    uint32_t ownLow;  // First address announced in OPEN, used as the QUERY source
+    long long openSentNs;
+    string pending;  // Partially received packets
+    string outbox;  // Packets the socket did not accept yet
+    deque<long long> querySentNs;  // Send times of unanswered QUERY packets, oldest first
+} LoadConnection;
+
+/**
+ * Latency samples and counters of one sweep step
+ */
+typedef struct {
+    vector<long long> ackUs;
+    vector<long long> addUs;
+    long long queries;
+    long long windowFull;  // Scheduled QUERY packets skipped because the window was full
+} LoadStats;
+
+/**
+ * Returns the monotonic clock in nanoseconds.
+ */
+long long nowNs() {
+  return (long long) duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Resolves the controller address. Exits the program if it cannot be resolved.
+ */
+struct sockaddr_in resolveController(const string &host, uint16_t port) {
+  struct addrinfo hints {}, *res;
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int errorCode = getaddrinfo(host.c_str(), nullptr, &hints, &res);
+  if (errorCode != 0) {
+    printf("Error: getaddrinfo() failure: %s\n", gai_strerror(errorCode));
+    exit(EXIT_FAILURE);
+  }
+
+  struct sockaddr_in server = *(struct sockaddr_in *) res->ai_addr;
+  server.sin_port = htons(port);
+  freeaddrinfo(res);
+  return server;
+}
+
+/**
+ * Writes as much of the connection's outbox as the socket accepts. Anything left is written when
+ * epoll reports the socket as writable again.
+ */
+void flushOutbox(int epollFd, LoadConnection &conn) {
+  while (!conn.outbox.empty()) {
+    ssize_t written = write(conn.fd, conn.outbox.c_str(), conn.outbox.length());
+    if (written < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("write() failure");
+        exit(errno);
+      }
+      errno = 0;
+      break;
+    }
+    conn.outbox.erase(0, (size_t) written);
+  }
+
+  struct epoll_event event {};
+  event.events = EPOLLIN | (conn.outbox.empty() ? 0u : (uint32_t) EPOLLOUT);
+  event.data.u32 = (uint32_t) conn.id - 1;
+  epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &event);
+}
+
+/**
+ * Connects a new emulated switch and sends its OPEN packet.
+ */
+void openConnection(int epollFd, struct sockaddr_in &server, LoadOptions &options,
+                    vector<LoadConnection> &conns) {
+  LoadConnection conn {};
+  conn.id = (int) conns.size() + 1;
+
+  if ((conn.fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    perror("socket() failure");
+    exit(errno);
+  }
+  if (connect(conn.fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+    perror("connect() failure");
+    exit(errno);
+  }
+
+  int opt = 1;
+  setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  if (fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL) | O_NONBLOCK) < 0) {
+    perror("fcntl() failure");
+    exit(errno);
+  }
+
+  struct epoll_event event {};
+  event.events = EPOLLIN;
+  event.data.u32 = (uint32_t) conns.size();
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, conn.fd, &event) < 0) {
+    perror("epoll_ctl() failure");
+    exit(errno);
+  }
+
+  // Each emulated switch announces its own block of addresses, without neighbours
+  conn.ownLow = options.ownBase + (uint32_t) (conn.id - 1) * options.ownBlock;
+  conn.outbox = "OPEN:" + to_string(conn.id) + "," + to_string(conn.ownLow) + "," +
+                to_string(conn.ownLow + options.ownBlock - 1) + PACKET_DELIMITER;
+  conn.openSentNs = nowNs();
+
+  conns.push_back(conn);
+  flushOutbox(epollFd, conns.back());
+}
+
+/**
+ * Reads the controller's replies on a connection and records ACK and ADD latencies. The controller
+ * answers QUERY packets in order, so each ADD completes the oldest unanswered QUERY.
+ */
+void readConnection(LoadConnection &conn, LoadStats &stats) {
+  char buffer[MAX_BUFFER];
+  ssize_t bytesRead;
+  while ((bytesRead = read(conn.fd, buffer, MAX_BUFFER)) > 0) {
+    long long now = nowNs();
+    for (auto &packet : extractPackets(conn.pending, buffer, (size_t) bytesRead)) {
+      string type = packet.substr(0, packet.find(':'));
+      if (type == "ACK" && !conn.acked) {
+        conn.acked = true;
+        stats.ackUs.push_back((now - conn.openSentNs) / 1000);
+      } else if (type == "ADD" && !conn.querySentNs.empty()) {
+        stats.addUs.push_back((now - conn.querySentNs.front()) / 1000);
+        conn.querySentNs.pop_front();
+      }
+    }
+  }
+
+  if (bytesRead == 0) {
+    printf("Error: Controller closed connection %i.\n", conn.id);
+    exit(EXIT_FAILURE);
+  }
+  errno = 0;
+}
+
+/**
+ * Handles ready connections for at most timeoutMs milliseconds.
+ */
+void pollConnections(int epollFd, vector<LoadConnection> &conns, LoadStats &stats,
+                     int timeoutMs) {
+  struct epoll_event events[MAX_EVENTS];
+  int ready = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+  if (ready < 0) {
+    if (errno == EINTR) {
+      errno = 0;
+      return;
+    }
+    perror("epoll_wait() failure");
+    exit(errno);
+  }
+
+  for (int i = 0; i < ready; i++) {
+    LoadConnection &conn = conns[events[i].data.u32];
+    if (events[i].events & EPOLLOUT) flushOutbox(epollFd, conn);
+    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) readConnection(conn, stats);
+  }
+}
+
+/**
+ * Picks QUERY destinations: uniformly over the destination range, or Zipf distributed over its
+ * first ZIPF_RANKS addresses so that a few destinations are hot
+ */
+typedef struct {
+    mt19937 rng;
+    uint32_t destLow;
+    uint32_t destHigh;
+    vector<double> cdf;  // Cumulative Zipf probability of each rank, empty if uniform
+} DestinationPicker;
+
+/**
+ * Prepares the destination picker for the configured distribution.
+ */
+void initDestinationPicker(DestinationPicker &picker, LoadOptions &options) {
+  picker.rng.seed(379);
+  picker.destLow = options.destLow;
+  picker.destHigh = options.destHigh;
+  picker.cdf.clear();
+
+  if (options.zipfExponent > 0) {
+    uint64_t span = (uint64_t) options.destHigh - options.destLow + 1;
+    auto ranks = (size_t) min(span, (uint64_t) ZIPF_RANKS);
+    double total = 0;
+    for (size_t rank = 1; rank <= ranks; rank++) {
+      total += 1.0 / pow((double) rank, options.zipfExponent);
+      picker.cdf.push_back(total);
+    }
+    for (auto &value : picker.cdf) value /= total;
+  }
+}
+
+/**
+ * Returns the destination of the next QUERY.
+ */
+uint32_t pickDestination(DestinationPicker &picker) {
+  if (picker.cdf.empty()) {
+    uniform_int_distribution<uint32_t> address(picker.destLow, picker.destHigh);
+    return address(picker.rng);
+  }
+
+  uniform_real_distribution<double> unit(0.0, 1.0);
+  auto rank = lower_bound(picker.cdf.begin(), picker.cdf.end(), unit(picker.rng)) -
+              picker.cdf.begin();
+  return picker.destLow + (uint32_t) rank;
+}
+
+/**
+ * Returns the given percentile of sorted samples, or 0 if there are none.
+ */
+long long percentile(vector<long long> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  auto index = (size_t) ceil(p / 100.0 * (double) sorted.size());
+  return sorted[min(sorted.size() - 1, index ? index - 1 : 0)];
+}
+
+/**
+ * Parses the key=value arguments. Exits the program if an argument is invalid.
+ */
+LoadOptions parseLoadOptions(int argc, char **argv, int first) {
+  LoadOptions options = {{1, 10, 100}, 5000, 100.0, 1, 0.0, 0, 0, 0, 256};
+  parseIpRangeString("10.0.0.0/16", options.destLow, options.destHigh);
+  parseIp("10.0.0.0", options.ownBase);
+
+  for (int i = first; i < argc; i++) {
+    string option = argv[i];
+    size_t separator = option.find('=');
+    string key = option.substr(0, separator);
+    string value = separator == string::npos ? "" : option.substr(separator + 1);
+    uint32_t unused = 0;
+    bool ok = !value.empty();
+
+    // Numbers must use the whole value, with nothing after them
+    char *end = nullptr;
+    errno = 0;
+
+    if (ok && key == "conns") {
+      options.sweep.clear();
+      stringstream ss(value);
+      string count;
+      while (getline(ss, count, ',')) {
+        int connections = (int) strtol(count.c_str(), &end, 10);
+        ok = ok && *end == '\0' && connections > 0 &&
+             (options.sweep.empty() || connections > options.sweep.back());
+        options.sweep.push_back(connections);
+      }
+    } else if (ok && key == "duration") {
+      options.durationMs = strtol(value.c_str(), &end, 10);
+      ok = *end == '\0' && options.durationMs > 0;
+    } else if (ok && key == "rate") {
+      options.rate = strtod(value.c_str(), &end);
+      ok = *end == '\0' && options.rate > 0;
+    } else if (ok && key == "window") {
+      options.window = (int) strtol(value.c_str(), &end, 10);
+      ok = *end == '\0' && options.window > 0;
+    } else if (ok && key == "zipf") {
+      options.zipfExponent = strtod(value.c_str(), &end);
+      ok = *end == '\0' && options.zipfExponent >= 0;
+    } else if (ok && key == "dest") {
+      ok = parseIpRangeString(value, options.destLow, options.destHigh);
+    } else if (ok && key == "own") {
+      ok = parseIpRangeString(value, options.ownBase, unused);
+    } else if (ok && key == "block") {
+      long block = strtol(value.c_str(), &end, 10);
+      options.ownBlock = (uint32_t) block;
+      ok = *end == '\0' && block > 0 && block <= UINT32_MAX;
+    } else {
+      ok = false;
+    }
+
+    if (!ok || errno) {
+      printf("Error: Invalid option %s.\n", option.c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return options;
+}
+
+/**
+ * Swarm load generator. Emulates many switches from one epoll driven process to measure the
+ * controller. For each connection count in the sweep it opens the missing connections (each sends
+ * OPEN and waits for the ACK), then every connection sends QUERY packets at the configured rate for
+ * the step duration. Reports offered and achieved QUERY rates and ACK/ADD latency percentiles.
+ * Usage: a3load serverAddress portNumber [conns=1,10,100] [duration=ms] [rate=qps] [window=n]
+ *        [zipf=s] [dest=range] [own=address] [block=n]
+ */
+int main(int argc, char **argv) {
+  // Set a 10 minute CPU time limit
+  rlimit timeLimit{.rlim_cur = 600, .rlim_max = 600};
+  setrlimit(RLIMIT_CPU, &timeLimit);
+
+  if (argc < 3) {
+    printf("Error: Invalid arguments. Expected 'a3load serverAddress portNumber [key=value...]'\n");
+    return EXIT_FAILURE;
+  }
+
+  char *end = nullptr;
+  errno = 0;
+  long portNumber = strtol(argv[2], &end, 10);
+  if (portNumber < 1 || portNumber > UINT16_MAX || *end != '\0' || errno) {
+    printf("Error: Invalid port number %s.\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+  struct sockaddr_in server = resolveController(argv[1], (uint16_t) portNumber);
+  LoadOptions options = parseLoadOptions(argc, argv, 3);
+
+  // Thousands of connections need more than the default descriptor limit
+  rlimit fileLimit {};
+  getrlimit(RLIMIT_NOFILE, &fileLimit);
+  fileLimit.rlim_cur = fileLimit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &fileLimit);
+
+  int epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    perror("epoll_create1() failure");
+    exit(errno);
+  }
+
+  vector<LoadConnection> conns;
+  conns.reserve((size_t) options.sweep.back());
+  DestinationPicker picker;
+  initDestinationPicker(picker, options);
+  auto intervalNs = (long long) (1e9 / options.rate);
+  double bestThroughput = 0;
+
+  printf("%8s %12s %12s %10s %10s %10s %10s %10s %10s\n", "conns", "offered/s", "achieved/s",
+         "ack p50us", "ack p99us", "add p50us", "add p99us", "add p999us", "add maxus");
+
+  for (int connections : options.sweep) {
+    LoadStats stats = {{}, {}, 0, 0};
+
+    // Open the connections this step adds and wait for all of their ACKs
+    while ((int) conns.size() < connections) openConnection(epollFd, server, options, conns);
+    long long openDeadline = nowNs() + (long long) OPEN_TIMEOUT_MS * 1000000;
+    while (count_if(conns.begin(), conns.end(), [](LoadConnection &c) { return c.acked; }) <
+           connections) {
+      if (nowNs() > openDeadline) {
+        printf("Error: Controller did not ACK all %i connections. Is it running with at least %i "
+               "switches?\n", connections, connections);
+        exit(EXIT_FAILURE);
+      }
+      pollConnections(epollFd, conns, stats, 10);
+    }
+
+    // Stagger the first QUERY of each connection over one interval
+    typedef pair<long long, int> Scheduled;
+    priority_queue<Scheduled, vector<Scheduled>, greater<Scheduled>> schedule;
+    long long stepStart = nowNs();
+    for (int i = 0; i < connections; i++) {
+      schedule.push(make_pair(stepStart + intervalNs * i / connections, i));
+    }
+
+    long long stepEnd = stepStart + options.durationMs * 1000000;
+    size_t addsBefore = stats.addUs.size();
+    long long now;
+    while ((now = nowNs()) < stepEnd) {
+      // Send every QUERY that is due
+      while (!schedule.empty() && schedule.top().first <= now) {
+        Scheduled due = schedule.top();
+        schedule.pop();
+
+        LoadConnection &conn = conns[due.second];
+        if ((int) conn.querySentNs.size() < options.window) {
+          uint32_t destIp = pickDestination(picker);
+          conn.outbox += "QUERY:" + to_string(conn.ownLow) + "," + to_string(destIp) +
+                         PACKET_DELIMITER;
+          conn.querySentNs.push_back(now);
+          flushOutbox(epollFd, conn);
+          stats.queries++;
+        } else {
+          stats.windowFull++;
+        }
+        schedule.push(make_pair(due.first + intervalNs, due.second));
+      }
+
+      long long nextNs = schedule.empty() ? stepEnd : min(schedule.top().first, stepEnd);
+      auto timeoutMs = (int) max(0LL, (nextNs - nowNs()) / 1000000);
+      pollConnections(epollFd, conns, stats, timeoutMs);
+    }
+
+    // Only replies that arrived within the step count towards throughput
+    double seconds = (nowNs() - stepStart) / 1e9;
+    double achieved = (stats.addUs.size() - addsBefore) / seconds;
+    bestThroughput = max(bestThroughput, achieved);
+
+    sort(stats.ackUs.begin(), stats.ackUs.end());
+    sort(stats.addUs.begin(), stats.addUs.end());
+    printf("%8i %12.0f %12.0f %10lli %10lli %10lli %10lli %10lli %10lli\n", connections,
+           connections * options.rate, achieved, percentile(stats.ackUs, 50),
+           percentile(stats.ackUs, 99), percentile(stats.addUs, 50), percentile(stats.addUs, 99),
+           percentile(stats.addUs, 99.9), stats.addUs.empty() ? 0 : stats.addUs.back());
+    if (stats.windowFull) {
+      printf("         %lli of %lli scheduled QUERY packets skipped (window full)\n",
+             stats.windowFull, stats.windowFull + stats.queries);
+    }
+
+    // Drain outstanding replies so they do not count towards the next step
+    long long drainDeadline = nowNs() + 1000000000LL;
+    while (nowNs() < drainDeadline &&
+           any_of(conns.begin(), conns.end(),
+                  [](LoadConnection &c) { return !c.querySentNs.empty(); })) {
+      pollConnections(epollFd, conns, stats, 10);
+    }
+    for (auto &conn : conns) conn.querySentNs.clear();
+  }
+
+  printf("Saturation throughput: %.0f ADD/s\n", bestThroughput);
+
+  for (auto &conn : conns) close(conn.fd);
+  close(epollFd);
+  return EXIT_SUCCESS;
+}
@@ -1,18 +1,34 @@
 #include <fcntl.h>
 #include <sys/resource.h>
-#include <fstream>
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <tuple>
+#include <vector>
 #include <netdb.h>
 #include <cstring>
 #include <arpa/inet.h>
 #include "controller.h"
+#include "flowexport.h"
+#include "ip.h"
 #include "switch.h"
+#include "traffic.h"
+#include "uring.h"
 #include "util.h"
 
 #define MAX_NSW 7
-#define MAX_IP 1000
+#define MAX_CONT_SWITCHES 16384  // Emulated switches (a3load) may connect beyond MAX_NSW
+#define DEFAULT_BATCH_SIZE 16
+#define DEFAULT_BATCH_BUDGET_US 1000
+#define DEFAULT_EXPORT_INTERVAL_MS 1000
+#define DEFAULT_EXPORT_MAX_RECORDS 256
+#define DEFAULT_TRACE_PREFIX "a3trace"
+#define DEFAULT_TRACE_SAMPLE 1
+#define DEFAULT_CONTROL_WEIGHT 16
+#define DEFAULT_DATA_WEIGHT 64
+#define DEFAULT_DATA_QUEUE_MAX 4096
+#define DEFAULT_RATE_PPS 0  // Untimestamped traffic is admitted as fast as the switch can
+#define DEFAULT_SPEED 1.0
 
 using namespace std;
 
@@ -62,45 +78,159 @@ string getAddressInfo(string &address) {
 }
 
 /**
- * Parses IP range from command line argument input. Returns a tuple comprised of the lower and
- * upper IP range bounds if successful. Exits the program if there is an error in parsing.
+ * Parses IP range from command line argument input. The range may be given as low-high, with each
+ * bound in dotted-quad or integer form, or in CIDR notation. Returns a tuple comprised of the lower
+ * and upper IP range bounds if successful. Exits the program if there is an error in parsing.
  */
-tuple<int, int> parseIpRange(const string &input) {
-  int ipLow = 0;
-  int ipHigh = 0;
-
-  stringstream ss(input);
-  string token;
-
-  int i = 0;
-  while (getline(ss, token, '-')) {
-    if (token.length()) {
-      if (i == 0) {
-        ipLow = (int) strtol(token.c_str(), (char **) nullptr, 10);
-        if (ipLow < 0 || ipLow > MAX_IP || errno) {
-          printf("Error: Invalid IP lower bound.\n");
-          exit(EXIT_FAILURE);
-        }
-      } else if (i == 1) {
-        ipHigh = (int) strtol(token.c_str(), (char **) nullptr, 10);
-        if (ipHigh < 0 || ipHigh > MAX_IP || errno) {
-          printf("Error: Invalid IP lower bound.\n");
-          exit(EXIT_FAILURE);
-        }
+tuple<uint32_t, uint32_t> parseIpRange(const string &input) {
+  uint32_t ipLow = 0;
+  uint32_t ipHigh = 0;
+
+  if (!parseIpRangeString(input, ipLow, ipHigh)) {
+    printf("Error: Malformed IP range %s. Expected low-high or prefix/length.\n", input.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  return make_tuple(ipLow, ipHigh);
+}
+
+/**
+ * Parses the optional key=value arguments that follow the required switch arguments. Exits the
+ * program if an option is unknown or its value is invalid.
+ */
+SwitchOptions parseSwitchOptions(int argc, char **argv, int first) {
+  SwitchOptions options = {DEFAULT_BATCH_SIZE, DEFAULT_BATCH_BUDGET_US, "",
+                           DEFAULT_EXPORT_INTERVAL_MS, DEFAULT_EXPORT_MAX_RECORDS, "",
+                           DEFAULT_TRACE_SAMPLE, DEFAULT_CONTROL_WEIGHT, DEFAULT_DATA_WEIGHT,
+                           DEFAULT_DATA_QUEUE_MAX, IO_BACKEND_POLL, DEFAULT_RATE_PPS,
+                           DEFAULT_SPEED};
+
+  for (int i = first; i < argc; i++) {
+    string option = argv[i];
+    size_t separator = option.find('=');
+    if (separator == string::npos) {
+      printf("Error: Malformed option %s. Expected key=value.\n", option.c_str());
+      exit(EXIT_FAILURE);
+    }
+
+    string key = option.substr(0, separator);
+    string text = option.substr(separator + 1);
+
+    // Numeric options must be a whole number, with nothing after it
+    char *end = nullptr;
+    errno = 0;
+    long value = strtol(text.c_str(), &end, 10);
+    bool number = !text.empty() && *end == '\0' && !errno;
+
+    if (key == "batch") {
+      if (value < 1 || !number) {
+        printf("Error: Invalid batch size. Must be at least 1.\n");
+        exit(EXIT_FAILURE);
+      }
+      options.batchSize = (int) value;
+    } else if (key == "budget") {
+      if (value < 1 || !number) {
+        printf("Error: Invalid batch budget. Must be at least 1 microsecond.\n");
+        exit(EXIT_FAILURE);
+      }
+      options.batchBudgetUs = value;
+    } else if (key == "export") {
+      options.exportPath = text.empty() ? FLOW_EXPORT_DEFAULT_PATH : text;
+      errno = 0;
+    } else if (key == "exportms") {
+      if (value < 1 || !number) {
+        printf("Error: Invalid export interval. Must be at least 1 millisecond.\n");
+        exit(EXIT_FAILURE);
+      }
+      options.exportIntervalMs = value;
+    } else if (key == "exportmax") {
+      if (value < 1 || !number) {
+        printf("Error: Invalid export record limit. Must be at least 1.\n");
+        exit(EXIT_FAILURE);
+      }
+      options.exportMaxRecords = (int) value;
+    } else if (key == "trace") {
+      options.tracePrefix = text.empty() ? DEFAULT_TRACE_PREFIX : text;
+      errno = 0;
+    } else if (key == "tracesample") {
+      if (value < 1 || !number) {
+        printf("Error: Invalid trace sampling. Must be at least 1.\n");
+        exit(EXIT_FAILURE);
+      }
+      options.traceSample = (int) value;
+    } else if (key == "ctlweight" || key == "dataweight") {
+      if (value < 1 || !number) {
+        printf("Error: Invalid scheduling weight. Must be at least 1.\n");
+        exit(EXIT_FAILURE);
+      }
+      (key == "ctlweight" ? options.controlWeight : options.dataWeight) = (int) value;
+    } else if (key == "dataqueue") {
+      if (value < 1 || !number) {
+        printf("Error: Invalid data queue size. Must be at least 1.\n");
+        exit(EXIT_FAILURE);
+      }
+      options.dataQueueMax = (int) value;
+    } else if (key == "io") {
+      if (!parseIoBackend(text, options.io)) {
+        printf("Error: Invalid I/O backend %s. Expected poll, epoll or uring.\n", text.c_str());
+        exit(EXIT_FAILURE);
       }
-      i++;
+      errno = 0;
+    } else if (key == "rate") {
+      if (value < 0 || !number) {
+        printf("Error: Invalid rate. Must be at least 0 packets per second.\n");
+        exit(EXIT_FAILURE);
+      }
+      options.ratePps = value;
+    } else if (key == "speed") {
+      errno = 0;
+      double speed = strtod(text.c_str(), &end);
+      if (speed <= 0.0 || *end != '\0' || errno) {
+        printf("Error: Invalid speed. Must be greater than 0.\n");
+        exit(EXIT_FAILURE);
+      }
+      options.speed = speed;
     } else {
-      printf("Error: Malformed IP range.\n");
+      printf("Error: Unknown option %s.\n", key.c_str());
       exit(EXIT_FAILURE);
     }
   }
 
-  if (ipHigh < ipLow) {
-    printf("Error: Invalid range.\n");
-    exit(EXIT_FAILURE);
+  return options;
+}
+
+/**
+ * Parses the optional key=value arguments that follow the required controller arguments. Exits the
+ * program if an option is unknown.
+ */
+ControllerOptions parseControllerOptions(int argc, char **argv, int first) {
+  ControllerOptions options = {"", IO_BACKEND_POLL};
+
+  for (int i = first; i < argc; i++) {
+    string option = argv[i];
+    size_t separator = option.find('=');
+    if (separator == string::npos) {
+      printf("Error: Malformed option %s. Expected key=value.\n", option.c_str());
+      exit(EXIT_FAILURE);
+    }
+
+    string key = option.substr(0, separator);
+    string text = option.substr(separator + 1);
+
+    if (key == "trace") {
+      options.tracePrefix = text.empty() ? DEFAULT_TRACE_PREFIX : text;
+    } else if (key == "io") {
+      if (!parseIoBackend(text, options.io)) {
+        printf("Error: Invalid I/O backend %s. Expected poll, epoll or uring.\n", text.c_str());
+        exit(EXIT_FAILURE);
+      }
+    } else {
+      printf("Error: Unknown option %s.\n", key.c_str());
+      exit(EXIT_FAILURE);
+    }
   }
 
-  return make_tuple(ipLow, ipHigh);
+  return options;
 }
 
 /**
@@ -119,48 +249,82 @@ int main(int argc, char **argv) {
 
   string mode = argv[1];  // cont or swi
   if (mode == "cont") {
-    if (argc != 4) {
-      printf("Error: Invalid number of arguments. Expected 4.\n");
+    if (argc < 4) {
+      printf("Error: Invalid number of arguments. Expected at least 4.\n");
       return EXIT_FAILURE;
     }
 
     int numSwitches = (int) strtol(argv[2], (char **) nullptr, 10);
-    if (numSwitches > MAX_NSW || numSwitches < 1 || errno) {
-      printf("Error: Invalid number of switches. Must be 1-7.\n");
+    if (numSwitches > MAX_CONT_SWITCHES || numSwitches < 1 || errno) {
+      printf("Error: Invalid number of switches. Must be 1-%i.\n", MAX_CONT_SWITCHES);
       return EXIT_FAILURE;
     }
 
+    // Every switch connection needs a descriptor
+    rlimit fileLimit {};
+    getrlimit(RLIMIT_NOFILE, &fileLimit);
+    if (fileLimit.rlim_cur < (rlim_t) numSwitches + 16) {
+      fileLimit.rlim_cur = min(fileLimit.rlim_max, (rlim_t) numSwitches + 16);
+      setrlimit(RLIMIT_NOFILE, &fileLimit);
+    }
+
     auto portNumber = (uint16_t) strtol(argv[3], (char **) nullptr, 10);
 
-    controllerLoop(numSwitches, portNumber);
+    // Optional arguments: trace=<dump file prefix> io=<poll|epoll|uring>
+    ControllerOptions options = parseControllerOptions(argc, argv, 4);
+
+    controllerLoop(numSwitches, portNumber, options);
   } else if (mode.find("sw") != std::string::npos) {
-    if (argc != 8) {
-      printf("Error: Invalid number of arguments. Expected 8.\n");
+    if (argc < 6) {
+      printf("Error: Invalid number of arguments. Expected at least 6.\n");
       return EXIT_FAILURE;
     }
 
     int switchId = parseSwitchId(argv[1]);
 
-    ifstream in(argv[2]);
-
-    if (!in) {
-      printf("Error: Cannot open file.\n");
+    // Traffic comes from a file, stdin ("-"), a named pipe or a Unix socket ("unix:<path>")
+    TrafficStream in;
+    if (!openTrafficStream(argv[2], switchId, in)) {
+      printf("Error: Cannot open traffic source %s.\n", argv[2]);
       return EXIT_FAILURE;
     }
 
-    int switchId1 = parseSwitchId(argv[3]);
-    int switchId2 = parseSwitchId(argv[4]);
+    // The neighbour on each port from port 1 follows, swN or null, up to the switch's IP range
+    vector<int> neighbours;
+    int arg = 3;
+    for (; arg < argc && (strcmp(argv[arg], "null") == 0 || strncmp(argv[arg], "sw", 2) == 0);
+         arg++) {
+      int neighbourId = parseSwitchId(argv[arg]);
+      if (neighbourId == switchId ||
+          (neighbourId != -1 && count(neighbours.begin(), neighbours.end(), neighbourId))) {
+        printf("Error: Invalid neighbour %s. Each port needs a different switch.\n", argv[arg]);
+        return EXIT_FAILURE;
+      }
+      neighbours.push_back(neighbourId);
+    }
 
-    tuple<int, int> ipRange = parseIpRange(argv[5]);
+    if (argc < arg + 3) {
+      printf("Error: Invalid number of arguments. Expected an IP range, server and port after "
+             "the neighbours.\n");
+      return EXIT_FAILURE;
+    }
+
+    tuple<uint32_t, uint32_t> ipRange = parseIpRange(argv[arg]);
 
-    string serverAddress = argv[6];
+    string serverAddress = argv[arg + 1];
     string ipAddress = getAddressInfo(serverAddress);
     printf("Found IP: %s\n", ipAddress.c_str());
 
-    auto portNumber = (uint16_t) strtol(argv[7], (char **) nullptr, 10);
+    auto portNumber = (uint16_t) strtol(argv[arg + 2], (char **) nullptr, 10);
+
+    // Optional arguments: batch=<packets> budget=<microseconds> export=<socket path>
+    // exportms=<milliseconds> exportmax=<records> trace=<dump file prefix> tracesample=<packets>
+    // ctlweight=<packets> dataweight=<packets> dataqueue=<packets> io=<poll|epoll|uring>
+    // rate=<packets per second> speed=<multiplier>
+    SwitchOptions options = parseSwitchOptions(argc, argv, arg + 3);
 
-    switchLoop(switchId, switchId1, switchId2, get<0>(ipRange), get<1>(ipRange), in, ipAddress,
-               portNumber);
+    switchLoop(switchId, neighbours, get<0>(ipRange), get<1>(ipRange), in, ipAddress, portNumber,
+               options);
   } else {
     printf("Error: Invalid mode specified. Expected cont or swi.\n");
     return EXIT_FAILURE;
@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "statseg.h"
+
+#define DEFAULT_INTERVAL_MS 1000
+#define MIN_COLUMN_WIDTH 10
+
+using namespace std;
+
+/**
+ * A stats segment being watched, with the snapshot taken at the previous refresh
+ */
+typedef struct {
+    StatSegment *segment;
+    StatSnapshot previous;
+    StatSnapshot current;
+    bool fresh;  // Whether previous holds a snapshot yet
+    bool alive;
+} WatchedSegment;
+
+/**
+ * Returns the rate of a counter between two snapshots of the same segment, per second of the
+ * publisher's clock. Returns 0 if the publisher did not publish in between.
+ */
+double counterRate(StatSnapshot &previous, StatSnapshot &current, size_t i) {
+  int64_t elapsedNs = current.publishedNs - previous.publishedNs;
+  if (elapsedNs <= 0 || i >= previous.stats.size()) return 0.0;
+  return (double) (current.stats[i].value - previous.stats[i].value) * 1e9 / (double) elapsedNs;
+}
+
+/**
+ * Returns the stat names of a snapshot joined into one key, so that processes publishing the same
+ * stats are shown in the same table.
+ */
+string layoutKey(StatSnapshot &snapshot) {
+  string key;
+  for (auto &stat : snapshot.stats) key += string(stat.name) + ",";
+  return key;
+}
+
+/**
+ * Maps new segments, drops the ones that were removed and takes a snapshot of each.
+ */
+void refreshSegments(map<string, WatchedSegment> &watched) {
+  vector<string> paths = listStatSegments();
+
+  for (auto it = watched.begin(); it != watched.end();) {
+    if (!binary_search(paths.begin(), paths.end(), it->first)) {
+      unmapStatSegment(it->second.segment);
+      it = watched.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  for (auto &path : paths) {
+    if (!watched.count(path)) {
+      StatSegment *segment = mapStatSegment(path);
+      if (!segment) continue;
+      watched[path] = {segment, {}, {}, false, true};
+    }
+
+    WatchedSegment &entry = watched[path];
+    if (!entry.current.stats.empty()) {
+      entry.previous = entry.current;
+      entry.fresh = true;
+    }
+    if (!readStatSegment(entry.segment, entry.current)) continue;
+
+    // A segment left behind by a process that was killed is shown until it is removed
+    entry.alive = kill(entry.current.pid, 0) == 0 || errno == EPERM;
+    errno = 0;
+  }
+}
+
+/**
+ * Prints one table per set of stats: a row per process and a total row. Counters are shown as
+ * rates, gauges as their current value.
+ */
+void printTables(map<string, WatchedSegment> &watched) {
+  map<string, vector<WatchedSegment *>> layouts;
+  for (auto &entry : watched) {
+    if (entry.second.current.stats.empty()) continue;
+    layouts[layoutKey(entry.second.current)].push_back(&entry.second);
+  }
+
+  for (auto &layout : layouts) {
+    vector<WatchedSegment *> &rows = layout.second;
+    vector<StatEntry> &stats = rows.front()->current.stats;
+
+    vector<int> widths;
+    printf("%-12s %7s", "PROCESS", "PID");
+    for (auto &stat : stats) {
+      string label = string(stat.name) + (stat.kind == STAT_COUNTER ? "/s" : "");
+      widths.push_back(max((int) label.size(), MIN_COLUMN_WIDTH));
+      printf(" %*s", widths.back(), label.c_str());
+    }
+    printf("\n");
+
+    vector<double> totals(stats.size(), 0.0);
+    for (auto *row : rows) {
+      string name = row->current.name + (row->alive ? "" : "*");
+      printf("%-12s %7i", name.c_str(), row->current.pid);
+      for (size_t i = 0; i < stats.size(); i++) {
+        double value = stats[i].kind == STAT_COUNTER ?
+                       (row->fresh ? counterRate(row->previous, row->current, i) : 0.0) :
+                       (double) row->current.stats[i].value;
+        totals[i] += value;
+        printf(" %*.*f", widths[i], stats[i].kind == STAT_COUNTER ? 1 : 0, value);
+      }
+      printf("\n");
+    }
+
+    if (rows.size() > 1) {
+      printf("%-12s %7s", "total", "");
+      for (size_t i = 0; i < stats.size(); i++) {
+        printf(" %*.*f", widths[i], stats[i].kind == STAT_COUNTER ? 1 : 0, totals[i]);
+      }
+      printf("\n");
+    }
+    printf("\n");
+  }
+}
+
+/**
+ * Shows live rates of every process that publishes a stats segment under /dev/shm: the controller
+ * and switches of a3sdn and a4tasks. Reading never blocks or slows the publishers. Processes
+ * marked * have exited without removing their segment.
+ * Usage: a3top [interval=ms] [iterations=n]
+ */
+int main(int argc, char **argv) {
+  long intervalMs = DEFAULT_INTERVAL_MS;
+  long iterations = 0;  // 0 to run until interrupted
+  bool valid = true;
+
+  errno = 0;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    char *end = nullptr;
+    if (arg.compare(0, 9, "interval=") == 0) {
+      intervalMs = strtol(arg.c_str() + 9, &end, 10);
+      valid = valid && end != arg.c_str() + 9 && *end == '\0' && intervalMs >= 1;
+    } else if (arg.compare(0, 11, "iterations=") == 0) {
+      iterations = strtol(arg.c_str() + 11, &end, 10);
+      valid = valid && end != arg.c_str() + 11 && *end == '\0' && iterations >= 0;
+    } else {
+      printf("Error: Unknown argument %s. Expected 'a3top [interval=ms] [iterations=n]'\n",
+             arg.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!valid || errno) {
+    printf("Error: Invalid arguments. Expected 'a3top [interval=ms] [iterations=n]'\n");
+    return EXIT_FAILURE;
+  }
+
+  // Redraw in place on a terminal, append refreshes otherwise
+  bool terminal = isatty(STDOUT_FILENO);
+  map<string, WatchedSegment> watched;
+
+  refreshSegments(watched);
+  for (long n = 0; iterations == 0 || n < iterations; n++) {
+    timespec interval {intervalMs / 1000, (intervalMs % 1000) * 1000000};
+    nanosleep(&interval, nullptr);
+    errno = 0;
+    refreshSegments(watched);
+
+    if (terminal) printf("\033[H\033[2J");
+    printf("a3top: %zu processes, every %li ms\n\n", watched.size(), intervalMs);
+    printTables(watched);
+    fflush(stdout);
+  }
+
+  for (auto &entry : watched) unmapStatSegment(entry.second.segment);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "trace.h"
+
+#define DEFAULT_SHOW_PATHS 10
+
+using namespace std;
+
+/**
+ * Latency samples of one kind of hop, in nanoseconds
+ */
+typedef struct {
+    vector<int64_t> link;  // From the previous hop's send to this hop's receive
+    vector<int64_t> residency;  // From receive to send (or delivery) within the node
+} HopSamples;
+
+/**
+ * Returns the given percentile of sorted samples.
+ */
+int64_t percentile(vector<int64_t> &sorted, double fraction) {
+  if (sorted.empty()) return 0;
+  size_t index = (size_t) (fraction * (double) (sorted.size() - 1));
+  return sorted[index];
+}
+
+/**
+ * Prints the average, median and 99th percentile of samples, in microseconds.
+ */
+void printSamples(const string &label, vector<int64_t> &samples) {
+  if (samples.empty()) return;
+
+  sort(samples.begin(), samples.end());
+  double total = 0;
+  for (auto sample : samples) total += (double) sample;
+
+  printf("\t%-10s n= %zu, avg= %.1f us, p50= %.1f us, p99= %.1f us, max= %.1f us\n",
+         label.c_str(), samples.size(), total / (double) samples.size() / 1e3,
+         (double) percentile(samples, 0.5) / 1e3, (double) percentile(samples, 0.99) / 1e3,
+         (double) samples.back() / 1e3);
+}
+
+/**
+ * Returns the name of the node that recorded a hop.
+ */
+string nodeName(int node) {
+  return node == TRACE_CONTROLLER_NODE ? "cont" : "sw" + to_string(node);
+}
+
+/**
+ * Returns the time between the first hop's admission and the last hop's send or delivery.
+ */
+int64_t pathLatency(vector<TraceRecord> &path) {
+  return path.back().egressNs - path.front().ingressNs;
+}
+
+/**
+ * Prints every hop of a path with its link and residency times.
+ */
+void printPath(int64_t traceId, vector<TraceRecord> &path) {
+  printf("Trace %lld (%.1f us end to end):\n", (long long) traceId, pathLatency(path) / 1e3);
+  for (auto &hop : path) {
+    string link = hop.sentNs ? to_string((hop.ingressNs - hop.sentNs) / 1000) + " us" : "-";
+    printf("\t%-5s %-10s link= %-9s residency= %lld us\n", nodeName(hop.node).c_str(),
+           traceKindName(hop.kind).c_str(), link.c_str(),
+           (long long) ((hop.egressNs - hop.ingressNs) / 1000));
+  }
+}
+
+/**
+ * Reconstructs the path of every traced packet from the hop dumps of the switches and the
+ * controller, and reports where the time went.
+ * Usage: a3trace traceFile... [paths=n]
+ */
+int main(int argc, char **argv) {
+  vector<TraceRecord> records;
+  int showPaths = DEFAULT_SHOW_PATHS;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.compare(0, 6, "paths=") == 0) {
+      char *end = nullptr;
+      errno = 0;
+      long value = strtol(arg.c_str() + 6, &end, 10);
+      if (value < 0 || value > INT_MAX || end == arg.c_str() + 6 || *end != '\0' || errno) {
+        printf("Error: Invalid path count %s. Expected 'a3trace traceFile... [paths=n]'\n",
+               arg.c_str() + 6);
+        return EXIT_FAILURE;
+      }
+      showPaths = (int) value;
+    } else if (!readTraceFile(arg, records)) {
+      printf("Error: Cannot read trace file %s.\n", arg.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (records.empty()) {
+    printf("Error: No hops recorded. Expected 'a3trace traceFile... [paths=n]'\n");
+    return EXIT_FAILURE;
+  }
+
+  // Group hops by packet. Every process stamps hops with the same monotonic clock, so sorting by
+  // receive time restores the order of the hops along the path.
+  map<int64_t, vector<TraceRecord>> paths;
+  for (auto &record : records) paths[record.traceId].push_back(record);
+
+  map<int, HopSamples> kinds;
+  vector<int64_t> endToEnd;
+  vector<pair<int64_t, int64_t>> slowest;
+  int incomplete = 0;
+
+  for (auto &entry : paths) {
+    vector<TraceRecord> &path = entry.second;
+    sort(path.begin(), path.end(), [](const TraceRecord &a, const TraceRecord &b) {
+      return a.ingressNs < b.ingressNs;
+    });
+
+    for (auto &hop : path) {
+      HopSamples &samples = kinds[hop.kind];
+      if (hop.sentNs) samples.link.push_back(hop.ingressNs - hop.sentNs);
+      samples.residency.push_back(hop.egressNs - hop.ingressNs);
+    }
+
+    // A path is complete once the packet was delivered or dropped
+    int last = path.back().kind;
+    if (last != TRACE_DELIVER && last != TRACE_DROP) {
+      incomplete++;
+      continue;
+    }
+    endToEnd.push_back(pathLatency(path));
+    slowest.push_back(make_pair(pathLatency(path), entry.first));
+  }
+
+  printf("Traced packets: %zu (%zu hops, %i incomplete)\n\n", paths.size(), records.size(),
+         incomplete);
+
+  sort(slowest.rbegin(), slowest.rend());
+  for (int i = 0; i < showPaths && i < (int) slowest.size(); i++) {
+    printPath(slowest[i].second, paths[slowest[i].second]);
+  }
+
+  printf("\nLink time by hop:\n");
+  for (auto &entry : kinds) printSamples(traceKindName(entry.first), entry.second.link);
+  printf("Residency by hop:\n");
+  for (auto &entry : kinds) printSamples(traceKindName(entry.first), entry.second.residency);
+  printf("End to end:\n");
+  printSamples("complete", endToEnd);
+
+  return EXIT_SUCCESS;
+}
@@ -4,11 +4,14 @@
 #include <poll.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <algorithm>
+#include <deque>
+#include <iterator>
 #include <map>
 #include <sstream>
 #include <string>
@@ -17,11 +20,24 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <cstring>
+#include "controller.h"
+#include "ip.h"
+#include "trace.h"
+#include "statseg.h"
+#include "uring.h"
 #include "util.h"
 
 #define CONTROLLER_ID 0
 #define MAX_BUFFER 1024
-#define MAX_IP 1000
+#define MAX_EPOLL_EVENTS 256
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 4096
+#define URING_STDIN 1  // Tags in the upper half of io_uring user data
+#define URING_ACCEPT 2
+#define URING_RECV 3
+#define URING_SEND 4
+#define URING_TIMEOUT 5
+#define DROP_GAP_PREFIX 16  // A DROP rule for an unowned gap never leaves the enclosing /16
 
 using namespace std;
 
@@ -40,12 +56,96 @@ typedef struct {
  */
 typedef struct {
     int id;
-    int port1Id;
-    int port2Id;
-    int ipLow;
-    int ipHigh;
+    int conn;  // Index of the switch's connection
+    vector<int> ports;  // Neighbour on each port from port 1, -1 for unconnected ports
+    uint32_t ipLow;
+    uint32_t ipHigh;
 } SwitchInfo;
 
+/**
+ * Sorted index over the IP ranges of opened switches
+ */
+typedef struct {
+    map<uint32_t, size_t> byLow;  // Lowest address of a range to its switch's switchInfoTable index
+    map<uint32_t, uint32_t> owned;  // Union of all ranges as disjoint, non-adjacent intervals
+} RangeIndex;
+
+/**
+ * Adds the range of a newly opened switch to the index.
+ */
+void indexSwitchRange(RangeIndex &index, uint32_t ipLow, uint32_t ipHigh, size_t infoIdx) {
+  if (!index.byLow.count(ipLow)) index.byLow[ipLow] = infoIdx;
+
+  // Merge the range with every owned interval it overlaps or touches
+  uint32_t low = ipLow;
+  uint32_t high = ipHigh;
+  auto it = index.owned.upper_bound(low);
+  if (it != index.owned.begin() && (low == 0 || prev(it)->second >= low - 1)) it--;
+  while (it != index.owned.end() && (high == IP_MAX || it->first <= high + 1)) {
+    low = min(low, it->first);
+    high = max(high, it->second);
+    it = index.owned.erase(it);
+  }
+  index.owned[low] = high;
+}
+
+/**
+ * Returns the switchInfoTable index of the switch owning an address, or -1 if no switch owns it.
+ */
+int findRangeOwner(RangeIndex &index, vector<SwitchInfo> &switchInfoTable, uint32_t ip) {
+  auto it = index.byLow.upper_bound(ip);
+  if (it == index.byLow.begin()) return -1;
+  it--;
+  if (ip <= switchInfoTable[it->second].ipHigh) return (int) it->second;
+
+  // Only overlapping ranges can hide the owner from the nearest range below the address
+  auto owned = index.owned.upper_bound(ip);
+  if (owned == index.owned.begin() || prev(owned)->second < ip) return -1;
+  for (size_t i = 0; i < switchInfoTable.size(); i++) {
+    if (ip >= switchInfoTable[i].ipLow && ip <= switchInfoTable[i].ipHigh) return (int) i;
+  }
+  return -1;
+}
+
+/**
+ * Returns the largest interval around an unowned address that no switch owns, within the enclosing
+ * /DROP_GAP_PREFIX block. The bound keeps a DROP rule from filling most of a switch's lookup table.
+ */
+pair<uint32_t, uint32_t> findRangeGap(RangeIndex &index, uint32_t ip) {
+  uint32_t blockMask = IP_MAX << (32 - DROP_GAP_PREFIX);
+  uint32_t low = ip & blockMask;
+  uint32_t high = low | ~blockMask;
+
+  auto next = index.owned.upper_bound(ip);
+  if (next != index.owned.end()) high = min(high, next->first - 1);
+  if (next != index.owned.begin()) low = max(low, prev(next)->second + 1);
+
+  return make_pair(low, high);
+}
+
+/**
+ * State of the controller, shared by its I/O backends
+ */
+typedef struct {
+    int numSwitches;
+    pollfd *pfds;  // stdin, the switch connections in accept order and the managing socket
+    int socketIdx;  // Index of the next accepted connection
+    vector<string> pending;  // Partially received packets of each connection
+    vector<SwitchInfo> switchInfoTable;  // Table containing info about opened switches
+    map<int, size_t> idToInfo;  // Switch IDs to their switchInfoTable index
+    map<int, size_t> connToInfo;  // Connection indices to their switch's switchInfoTable index
+    RangeIndex rangeIndex;  // Answers QUERY packets without scanning switchInfoTable
+    ControllerPacketCounts counts;  // Counts of each type of packet seen
+    vector<int> closed;  // Keeps track of closed switches
+    TraceBuffer trace;  // Hops of traced QUERY packets, dumped when the controller exits
+    IoBackend io;
+    uint64_t syscalls;  // I/O system calls made outside io_uring_enter()
+    Uring ring;
+    map<int, string> outgoing;  // io_uring: packets not yet submitted, by connection
+    map<int, string> sending;  // io_uring: the send in flight on each connection
+    StatPublisher stats;  // Counters shared with external readers such as a3top
+} Controller;
+
 /**
  * Function used to close all FD connections before exiting.
  */
@@ -54,90 +154,606 @@ void cleanup(int numSwitches, pollfd pfds[]) {
   exit(EXIT_SUCCESS);
 }
 
+/**
+ * Publishes the controller's counters to its stats segment if they are due.
+ */
+void publishControllerStats(Controller &cont) {
+  if (!statsDue(cont.stats)) return;
+
+  uint64_t connected = cont.switchInfoTable.size() - cont.closed.size();
+  publishStats(cont.stats, {(uint64_t) cont.counts.open, (uint64_t) cont.counts.query,
+                            (uint64_t) cont.counts.ack, (uint64_t) cont.counts.add,
+                            cont.syscalls + cont.ring.enters, connected});
+}
+
+/**
+ * Returns the ID of the switch on connection i, or i until the switch sent its OPEN.
+ */
+int connSwitchId(Controller &cont, int i) {
+  auto it = cont.connToInfo.find(i);
+  return it == cont.connToInfo.end() ? i : cont.switchInfoTable[it->second].id;
+}
+
+/**
+ * Returns whether a switch lists another as one of its neighbours.
+ */
+bool listsNeighbour(SwitchInfo &info, int id) {
+  return find(info.ports.begin(), info.ports.end(), id) != info.ports.end();
+}
+
+/**
+ * Returns the port through which a switch reaches another over the fewest hops, or 0 if they are
+ * not connected. Links are only used if both of their switches are open and list each other, as
+ * each switch creates the FIFO it reads a neighbour from. The local port follows the neighbour
+ * ports, so a switch reaches itself through ports.size() + 1. Only the switches reachable from
+ * the source are visited.
+ */
+int findRelayPort(Controller &cont, size_t from, size_t to) {
+  vector<SwitchInfo> &infos = cont.switchInfoTable;
+  if (from == to) return (int) infos[from].ports.size() + 1;
+
+  map<size_t, int> firstPort;  // Visited switches and the source port that leads to them
+  deque<size_t> frontier {from};
+  firstPort[from] = 0;
+  while (!frontier.empty()) {
+    size_t current = frontier.front();
+    frontier.pop_front();
+
+    vector<int> &ports = infos[current].ports;
+    for (size_t k = 0; k < ports.size(); k++) {
+      auto neighbour = cont.idToInfo.find(ports[k]);
+      if (neighbour == cont.idToInfo.end() || firstPort.count(neighbour->second)) continue;
+
+      SwitchInfo &next = infos[neighbour->second];
+      if (find(cont.closed.begin(), cont.closed.end(), next.conn) != cont.closed.end() ||
+          !listsNeighbour(next, infos[current].id)) {
+        continue;
+      }
+
+      int port = current == from ? (int) k + 1 : firstPort[current];
+      if (neighbour->second == to) return port;
+      firstPort[neighbour->second] = port;
+      frontier.push_back(neighbour->second);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Sends a packet on a switch connection. The io_uring backend queues it for the next batch of
+ * sends; the other backends write it right away.
+ */
+void controllerSend(Controller &cont, int conn, string &packet) {
+  if (cont.io == IO_BACKEND_URING) {
+    cont.outgoing[conn] += packet;
+    return;
+  }
+
+  cont.syscalls++;
+  write(cont.pfds[conn].fd, packet.c_str(), packet.length());
+}
+
 /**
  * Sends an ACK packet to a connected switch.
  */
-void sendAckPacket(int numSwitches, pollfd pfds[], int fd, int destId) {
+void sendAckPacket(Controller &cont, int conn, int destId) {
   string ackString = "ACK:";
-  write(fd, ackString.c_str(), strlen(ackString.c_str()));
+  ackString += PACKET_DELIMITER;
+  controllerSend(cont, conn, ackString);
   if (errno) {
     perror("write() failure");
-    cleanup(numSwitches, pfds);
+    cleanup(cont.numSwitches, cont.pfds);
     exit(errno);
   }
 
   // Log the successful packet transmission
   string direction = "Transmitted";
   string type = "ACK";
-  pair<string, vector<int>> parsedPacket = parsePacketString(ackString);
+  pair<string, vector<int64_t>> parsedPacket = parsePacketString(ackString);
   printPacketMessage(direction, 0, destId, type, parsedPacket.second);
 }
 
 /**
- * Sends an ADD packet to a connected switch.
+ * Sends an ADD packet to a connected switch. The ADD answering a traced QUERY carries its trace ID
+ * and the send time. Returns the send time of a traced packet, or 0.
  */
-void sendAddPacket(int numSwitches, pollfd pfds[], int fd, int destId, int action, int ipLow,
-                   int ipHigh, int relayPort, int srcIp) {
+int64_t sendAddPacket(Controller &cont, int conn, int destId, int action, uint32_t ipLow,
+                      uint32_t ipHigh, int relayPort, uint32_t srcIp, int64_t traceId) {
   string addString = "ADD:" + to_string(action) + "," + to_string(ipLow) + "," + to_string(ipHigh)
                      + "," + to_string(relayPort) + "," + to_string(srcIp);
-  write(fd, addString.c_str(), strlen(addString.c_str()));
+  int64_t sentNs = 0;
+  if (traceId) {
+    sentNs = monotonicNs();
+    addString += "," + to_string(traceId) + "," + to_string(sentNs);
+  }
+  addString += PACKET_DELIMITER;
+  controllerSend(cont, conn, addString);
   if (errno) {
     perror("Failed to write");
-    cleanup(numSwitches, pfds);
+    cleanup(cont.numSwitches, cont.pfds);
     exit(errno);
   }
 
   // Log the successful packet transmission.
   string direction = "Transmitted";
   string type = "ADD";
-  pair<string, vector<int>> parsedPacket = parsePacketString(addString);
+  pair<string, vector<int64_t>> parsedPacket = parsePacketString(addString);
   printPacketMessage(direction, 0, destId, type, parsedPacket.second);
+
+  return sentNs;
 }
 
 /**
  * List the controller status information including switches known and packets seen.
  */
-void controllerList(vector<SwitchInfo> switchInfoTable, ControllerPacketCounts &counts) {
+void controllerList(Controller &cont) {
+  ControllerPacketCounts &counts = cont.counts;
+
   printf("Switch information:\n");
-  for (auto &info : switchInfoTable) {
-    printf("[sw%i]: port1= %i, port2= %i, port3= %i-%i\n", info.id, info.port1Id, info.port2Id,
-           info.ipLow, info.ipHigh);
+  for (auto &info : cont.switchInfoTable) {
+    printf("[sw%i]:", info.id);
+    for (size_t port = 1; port <= info.ports.size(); port++) {
+      printf(" port%zu= %i,", port, info.ports[port - 1]);
+    }
+    printf(" port%zu= %s\n", info.ports.size() + 1, formatIpRange(info.ipLow, info.ipHigh).c_str());
   }
   printf("\n");
   printf("Packet stats:\n");
   printf("\tReceived:    OPEN:%i, QUERY:%i\n", counts.open, counts.query);
   printf("\tTransmitted: ACK:%i, ADD:%i\n", counts.ack, counts.add);
+
+  uint64_t syscalls = cont.syscalls + cont.ring.enters;
+  int packets = counts.open + counts.query + counts.ack + counts.add;
+  printf("\tI/O:         backend= %s, syscalls= %lu (%.3f per packet)\n",
+         ioBackendName(cont.io).c_str(), (unsigned long) syscalls,
+         packets ? (double) syscalls / packets : 0.0);
 }
 
 /**
- * Main controller event loop. Communicates with switches via TCP sockets.
+ * Handles a command typed on stdin.
+ */
+void controllerCommand(Controller &cont) {
+  char buffer[MAX_BUFFER];
+  memset(buffer, 0, sizeof(buffer)); // Clear buffer
+
+  cont.syscalls++;
+  if (!read(STDIN_FILENO, buffer, MAX_BUFFER)) {
+    printf("Error: stdin closed.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  string cmd = string(buffer);
+  trim(cmd); // Trim whitespace
+
+  if (cmd == "list") {
+    controllerList(cont);
+  } else if (cmd == "exit") {
+    controllerList(cont);
+    dumpTraceBuffer(cont.trace);
+    cleanup(cont.numSwitches, cont.pfds);
+    exit(EXIT_SUCCESS);
+  } else {
+    printf("Error: Unrecognized command. Please use \"list\" or \"exit\".\n");
+  }
+}
+
+/**
+ * Handles a packet received from the switch on connection i, as described in the Packet Types
+ * section.
+ */
+void handleSwitchPacket(Controller &cont, int i, string &packetString, int64_t receivedNs) {
+  pair<string, vector<int64_t>> receivedPacket = parsePacketString(packetString);
+  string packetType = get<0>(receivedPacket);
+  vector<int64_t> packetMessage = get<1>(receivedPacket);
+  vector<int> &closed = cont.closed;
+
+  if (packetType == "OPEN" && (packetMessage.size() < 3 || packetMessage[1] < 0 ||
+                               packetMessage[1] > IP_MAX || packetMessage[2] < packetMessage[1] ||
+                               packetMessage[2] > IP_MAX)) {
+    printf("Error: Invalid OPEN. Dropping.\n");
+    return;
+  }
+
+  // Log the successful received packet
+  string direction = "Received";
+  printPacketMessage(direction, connSwitchId(cont, i), CONTROLLER_ID, packetType, packetMessage);
+
+  if (packetType == "OPEN") {
+    cont.counts.open++;
+    // The switch's range is followed by its neighbours, one per port
+    SwitchInfo info {(int) packetMessage[0], i, {}, (uint32_t) packetMessage[1],
+                     (uint32_t) packetMessage[2]};
+    for (size_t k = 3; k < packetMessage.size(); k++) info.ports.push_back((int) packetMessage[k]);
+    cont.switchInfoTable.push_back(info);
+    indexSwitchRange(cont.rangeIndex, info.ipLow, info.ipHigh, cont.switchInfoTable.size() - 1);
+    cont.idToInfo[info.id] = cont.switchInfoTable.size() - 1;
+    cont.connToInfo[i] = cont.switchInfoTable.size() - 1;
+    // Ensure switch is not closed before sending
+    if (find(closed.begin(), closed.end(), i) == closed.end()) {
+      sendAckPacket(cont, i, info.id);
+    }
+    cont.counts.ack++;
+  } else if (packetType == "QUERY") {
+    cont.counts.query++;
+
+    if (packetMessage.size() < 2 || packetMessage[0] < 0 || packetMessage[0] > IP_MAX ||
+        packetMessage[1] < 0 || packetMessage[1] > IP_MAX) {
+      printf("Error: Invalid IP for QUERY. Dropping.\n");
+      return;
+    }
+
+    auto srcIp = (uint32_t) packetMessage[0];
+    auto destIp = (uint32_t) packetMessage[1];
+
+    // Traced QUERY packets carry a trace ID and the switch's send time
+    int64_t traceId = packetMessage.size() >= 4 ? packetMessage[2] : 0;
+    int64_t querySentNs = packetMessage.size() >= 4 ? packetMessage[3] : 0;
+    int64_t addSentNs = 0;
+
+    // Check for information in the switch info table
+    int srcId = connSwitchId(cont, i);
+    int owner = findRangeOwner(cont.rangeIndex, cont.switchInfoTable, destIp);
+
+    // DROP rules are never withdrawn, so until every switch has opened, a switch that opens later
+    // may still own or reach the address and only the address itself is dropped
+    bool allOpen = (int) cont.idToInfo.size() >= cont.numSwitches;
+
+    if (owner >= 0) {
+      SwitchInfo &info = cont.switchInfoTable[owner];
+
+      // Forward out of the first port on the shortest path to the owner, or drop its range if
+      // no path reaches it
+      int relayPort = cont.connToInfo.count(i) ?
+                      findRelayPort(cont, cont.connToInfo[i], (size_t) owner) : 0;
+      uint32_t low = relayPort || allOpen ? info.ipLow : destIp;
+      uint32_t high = relayPort || allOpen ? info.ipHigh : destIp;
+
+      // Ensure switch is not closed before sending
+      if (find(closed.begin(), closed.end(), i) == closed.end()) {
+        // Send new rule
+        addSentNs = sendAddPacket(cont, i, srcId, relayPort ? 1 : 0, low, high, relayPort, srcIp,
+                                  traceId);
+      }
+    }
+
+    // If no switch owns the address, tell the switch to drop the unowned interval around it so
+    // that later packets to nearby addresses do not need a QUERY each
+    if (owner < 0) {
+      pair<uint32_t, uint32_t> gap = {destIp, destIp};
+      if (allOpen) gap = findRangeGap(cont.rangeIndex, destIp);
+
+      // Ensure switch is not closed before sending
+      if (find(closed.begin(), closed.end(), i) == closed.end()) {
+        addSentNs = sendAddPacket(cont, i, srcId, 0, gap.first, gap.second, 0, srcIp, traceId);
+      }
+    }
+
+    if (addSentNs) {
+      traceHop(cont.trace, traceId, querySentNs, receivedNs, addSentNs, TRACE_CONTROLLER);
+    }
+
+    cont.counts.add++;
+  } else {
+    printf("Received %s packet. Ignored.\n", packetType.c_str());
+  }
+}
+
+/**
+ * Handles the bytes received on connection i, which may hold several packets or part of one.
+ */
+void handleSwitchData(Controller &cont, int i, const char *data, size_t length) {
+  int64_t receivedNs = tracing(cont.trace) ? monotonicNs() : 0;
+  for (auto &packetString : extractPackets(cont.pending[i], data, length)) {
+    handleSwitchPacket(cont, i, packetString, receivedNs);
+  }
+}
+
+/**
+ * Marks connection i as closed by its switch. Replies not yet submitted are dropped, since the
+ * descriptor number may be reused by the next accepted connection.
+ */
+void closeSwitchConnection(Controller &cont, int i) {
+  if (find(cont.closed.begin(), cont.closed.end(), i) != cont.closed.end()) return;
+
+  printf("Warning: Connection to sw%d closed.\n", connSwitchId(cont, i));
+  close(cont.pfds[i].fd);
+  cont.closed.push_back(i);
+  cont.outgoing.erase(i);
+}
+
+/**
+ * Reads from connection i when poll() or epoll reports it readable.
+ */
+void readSwitchConnection(Controller &cont, int i) {
+  char buffer[MAX_BUFFER];
+
+  // Check if the connection has closed
+  cont.syscalls++;
+  ssize_t bytesRead = read(cont.pfds[i].fd, buffer, MAX_BUFFER);
+  if (!bytesRead) {
+    closeSwitchConnection(cont, i);
+    return;
+  } else if (bytesRead < 0) {
+    errno = 0; // Nothing to read yet
+    return;
+  }
+
+  handleSwitchData(cont, i, buffer, (size_t) bytesRead);
+}
+
+/**
+ * Accepts a switch connection. Returns its index, or -1 if every switch is already connected.
+ */
+int acceptSwitchConnection(Controller &cont, int fd) {
+  if (cont.socketIdx > cont.numSwitches) {
+    printf("Warning: Too many switches. Connection refused.\n");
+    close(fd);
+    return -1;
+  }
+
+  int i = cont.socketIdx++;
+  cont.pfds[i].fd = fd;
+  cont.pfds[i].events = POLLIN;
+  cont.pfds[i].revents = 0;
+  return i;
+}
+
+/**
+ * Accepts a switch connection on the managing socket and makes it non-blocking.
+ */
+int acceptNonBlocking(Controller &cont, int mainSocket) {
+  struct sockaddr_in from {};
+  socklen_t fromLength = sizeof(from);
+
+  cont.syscalls++;
+  int fd = accept(cont.pfds[mainSocket].fd, (struct sockaddr *) &from, &fromLength);
+  if (fd < 0) {
+    perror("accept() failure");
+    cleanup(cont.numSwitches, cont.pfds);
+    exit(errno);
+  }
+
+  // Set socket to non-blocking
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+    perror("fcntl() failure");
+    exit(errno);
+  }
+
+  return acceptSwitchConnection(cont, fd);
+}
+
+/**
+ * Event loop of the poll backend. Polls stdin, every switch connection and the managing socket.
  */
-void controllerLoop(int numSwitches, uint16_t portNumber) {
-  // Table containing info about opened switches
-  vector<SwitchInfo> switchInfoTable;
+void pollLoop(Controller &cont, int mainSocket) {
+  int pfdsSize = cont.numSwitches + 2;
+  pollfd *pfds = cont.pfds;
+
+  while (true) {
+    /*
+     * 1. Poll the keyboard for a user command. The user can issue one of the following commands.
+     * list: The program writes all entries in the flow table, and for each transmitted or received
+     * packet type, the program writes an aggregate count of handled packets of this type.
+     * exit: The program writes the above information and exits.
+     */
+    cont.syscalls++;
+    if (poll(pfds, (nfds_t) pfdsSize, 0) == -1) { // Poll from all file descriptors
+      perror("poll() failure");
+      cleanup(cont.numSwitches, pfds);
+      exit(errno);
+    }
 
-  // Mapping switch IDs to FDs
-  map<int, int> idToFd;
+    if (pfds[0].revents & POLLIN) controllerCommand(cont);
+
+    /*
+     * 2. Poll the incoming FDs from the attached switches. The controller handles each incoming
+     * packet, as described in the Packet Types section.
+     */
+    for (int i = 1; i <= cont.numSwitches; i++) {
+      if (pfds[i].revents & POLLIN) readSwitchConnection(cont, i);
+    }
 
-  // Counts of each type of packet seen
-  ControllerPacketCounts counts = {0, 0, 0, 0};
+    // Check the socket file descriptor for events
+    if (pfds[mainSocket].revents & POLLIN) acceptNonBlocking(cont, mainSocket);
+
+    publishControllerStats(cont);
+  }
+}
+
+/**
+ * Event loop of the epoll backend. Only descriptors with events are returned, so each wait costs
+ * the same however many switches are connected.
+ */
+void epollLoop(Controller &cont, int mainSocket) {
+  int epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    perror("epoll_create1() failure");
+    cleanup(cont.numSwitches, cont.pfds);
+    exit(errno);
+  }
+
+  struct epoll_event event {};
+  event.events = EPOLLIN;
+  event.data.u32 = 0;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+  event.data.u32 = (uint32_t) mainSocket;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, cont.pfds[mainSocket].fd, &event);
+
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  while (true) {
+    // Time out while idle, so that the latest counts get published
+    cont.syscalls++;
+    int ready = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, STAT_PUBLISH_MS);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        errno = 0;
+        continue;
+      }
+      perror("epoll_wait() failure");
+      cleanup(cont.numSwitches, cont.pfds);
+      exit(errno);
+    }
+
+    for (int n = 0; n < ready; n++) {
+      auto i = (int) events[n].data.u32;
+      if (i == 0) {
+        controllerCommand(cont);
+      } else if (i == mainSocket) {
+        int conn = acceptNonBlocking(cont, mainSocket);
+        if (conn < 0) continue;
+
+        event.data.u32 = (uint32_t) conn;
+        cont.syscalls++;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, cont.pfds[conn].fd, &event);
+      } else if (find(cont.closed.begin(), cont.closed.end(), i) == cont.closed.end()) {
+        readSwitchConnection(cont, i);  // Closing the descriptor removes it from epoll
+      }
+    }
+
+    publishControllerStats(cont);
+  }
+}
+
+/**
+ * Submits one send per connection for the packets queued since the previous batch. A connection
+ * with a send still in flight keeps its packets until that send completes, which keeps packets in
+ * order.
+ */
+void flushOutgoing(Controller &cont) {
+  for (auto it = cont.outgoing.begin(); it != cont.outgoing.end();) {
+    int conn = it->first;
+    if (find(cont.closed.begin(), cont.closed.end(), conn) != cont.closed.end()) {
+      it = cont.outgoing.erase(it);
+      continue;
+    } else if (cont.sending.count(conn)) {
+      it++;
+      continue;
+    }
+
+    string &data = cont.sending[conn];
+    data.swap(it->second);
+    uringPrepWrite(cont.ring, IORING_OP_SEND, cont.pfds[conn].fd, data.c_str(), data.length(),
+                   ((uint64_t) URING_SEND << 32) | (uint32_t) conn);
+    it = cont.outgoing.erase(it);
+  }
+}
+
+/**
+ * Event loop of the io_uring backend. Connections are accepted by one multishot accept and read by
+ * one multishot receive each, into a group of provided buffers, and the replies of a whole batch of
+ * completions go out with the same io_uring_enter() call that waits for the next batch.
+ */
+void uringLoop(Controller &cont, int mainSocket) {
+  Uring &ring = cont.ring;
+  uringPrepPollMultishot(ring, STDIN_FILENO, (uint64_t) URING_STDIN << 32);
+  uringPrepAcceptMultishot(ring, cont.pfds[mainSocket].fd, (uint64_t) URING_ACCEPT << 32);
+
+  // Wakes the loop up while it is idle, so that the latest counts get published
+  __kernel_timespec statsTimeout {0, STAT_PUBLISH_MS * 1000000};
+  uringPrepTimeout(ring, &statsTimeout, (uint64_t) URING_TIMEOUT << 32);
+
+  while (true) {
+    flushOutgoing(cont);
+    if (uringSubmit(ring, 1) < 0) {
+      perror("io_uring_enter() failure");
+      cleanup(cont.numSwitches, cont.pfds);
+      exit(errno);
+    }
+
+    io_uring_cqe *cqe;
+    while ((cqe = uringPeek(ring))) {
+      auto tag = (int) (cqe->user_data >> 32);
+      auto i = (int) (cqe->user_data & 0xFFFFFFFF);
+      int result = cqe->res;
+      bool more = cqe->flags & IORING_CQE_F_MORE;
+
+      if (tag == URING_STDIN) {
+        controllerCommand(cont);
+        if (!more) uringPrepPollMultishot(ring, STDIN_FILENO, (uint64_t) URING_STDIN << 32);
+      } else if (tag == URING_ACCEPT) {
+        int conn = result >= 0 ? acceptSwitchConnection(cont, result) : -1;
+        if (conn >= 0) {
+          uringPrepRecvMultishot(ring, cont.pfds[conn].fd, ((uint64_t) URING_RECV << 32) | conn);
+        }
+        if (!more) {
+          uringPrepAcceptMultishot(ring, cont.pfds[mainSocket].fd, (uint64_t) URING_ACCEPT << 32);
+        }
+      } else if (tag == URING_RECV) {
+        if (result > 0) {
+          handleSwitchData(cont, i, uringBuffer(ring, cqe), (size_t) result);
+          uringRecycleBuffer(ring, cqe);
+        }
+
+        if (result == 0 || (result < 0 && result != -ENOBUFS)) {
+          closeSwitchConnection(cont, i);
+        } else if (!more && find(cont.closed.begin(), cont.closed.end(), i) == cont.closed.end()) {
+          // Out of provided buffers; they are recycled as soon as packets are handled
+          uringPrepRecvMultishot(ring, cont.pfds[i].fd, ((uint64_t) URING_RECV << 32) | i);
+        }
+      } else if (tag == URING_SEND) {
+        // A failed send means the switch went away, which closes only its connection. The send
+        // buffer lives until the completion arrives, as the kernel reads from it until then.
+        string &data = cont.sending[i];
+        bool closed = find(cont.closed.begin(), cont.closed.end(), i) != cont.closed.end();
+        if (result < 0 || closed) {
+          closeSwitchConnection(cont, i);
+          cont.sending.erase(i);
+        } else if ((size_t) result < data.length()) {
+          // Send the rest of a partially sent batch
+          data.erase(0, (size_t) result);
+          uringPrepWrite(ring, IORING_OP_SEND, cont.pfds[i].fd, data.c_str(), data.length(),
+                         cqe->user_data);
+        } else {
+          cont.sending.erase(i);
+        }
+      } else if (tag == URING_TIMEOUT) {
+        uringPrepTimeout(ring, &statsTimeout, cqe->user_data);
+      }
+
+      uringAdvance(ring);
+    }
+
+    publishControllerStats(cont);
+  }
+}
+
+/**
+ * Main controller event loop. Communicates with switches via TCP sockets.
+ */
+void controllerLoop(int numSwitches, uint16_t portNumber, ControllerOptions &options) {
+  Controller cont {};
+  cont.numSwitches = numSwitches;
+  cont.io = options.io;
+  cont.ring.fd = -1;
+  initTraceBuffer(cont.trace, options.tracePrefix, TRACE_CONTROLLER_NODE, 1);
+  openStatSegment(cont.stats, "cont",
+                  {{"open", STAT_COUNTER}, {"query", STAT_COUNTER}, {"ack", STAT_COUNTER},
+                   {"add", STAT_COUNTER}, {"syscalls", STAT_COUNTER}, {"switches", STAT_GAUGE}});
 
   // Set up indices for easy reference
   int pfdsSize = numSwitches + 2;
   int mainSocket = pfdsSize - 1;
 
   struct pollfd pfds[pfdsSize];
-  char buffer[MAX_BUFFER];
+  cont.pfds = pfds;
+  cont.pending.resize((size_t) pfdsSize);
+  cont.socketIdx = 1;
+
+  // Switch connections are ignored by poll() until they are accepted
+  for (int i = 0; i < pfdsSize; i++) {
+    pfds[i].fd = -1;
+    pfds[i].events = 0;
+    pfds[i].revents = 0;
+  }
 
   // Set up STDIN for polling from
   pfds[0].fd = STDIN_FILENO;
   pfds[0].events = POLLIN;
   pfds[0].revents = 0;
 
-  int sockets[numSwitches + 1];
-  int socketIdx = 1;
-  struct sockaddr_in sin {}, from {};
-  socklen_t sinLength = sizeof(sin), fromLength = sizeof(from);
+  struct sockaddr_in sin {};
+  socklen_t sinLength = sizeof(sin);
 
   // Create a managing socket
   if ((pfds[mainSocket].fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -175,155 +791,17 @@ void controllerLoop(int numSwitches, uint16_t portNumber) {
     exit(errno);
   }
 
-  vector<int> closed; // Keeps track of closed switches
-
-  while (true) {
-    /*
-     * 1. Poll the keyboard for a user command. The user can issue one of the following commands.
-     * list: The program writes all entries in the flow table, and for each transmitted or received
-     * packet type, the program writes an aggregate count of handled packets of this type.
-     * exit: The program writes the above information and exits.
-     */
-    if (poll(pfds, (nfds_t) pfdsSize, 0) == -1) { // Poll from all file descriptors
-      perror("poll() failure");
-      cleanup(numSwitches, pfds);
-      exit(errno);
-    }
-
-    if (pfds[0].revents & POLLIN) {
-      if (!read(pfds[0].fd, buffer, MAX_BUFFER)) {
-        printf("Error: stdin closed.\n");
-        exit(EXIT_FAILURE);
-      }
-
-      string cmd = string(buffer);
-      trim(cmd); // Trim whitespace
-
-      if (cmd == "list") {
-        controllerList(switchInfoTable, counts);
-      } else if (cmd == "exit") {
-        controllerList(switchInfoTable, counts);
-        cleanup(numSwitches, pfds);
-        exit(EXIT_SUCCESS);
-      } else {
-        printf("Error: Unrecognized command. Please use \"list\" or \"exit\".\n");
-      }
-    }
-
-    memset(buffer, 0, sizeof(buffer)); // Clear buffer
-
-    /*
-     * 2. Poll the incoming FDs from the attached switches. The controller handles each incoming
-     * packet, as described in the Packet Types section.
-     */
-    for (int i = 1; i <= numSwitches; i++) {
-      if (pfds[i].revents & POLLIN) {
-        // Check if the connection has closed
-        if (!read(pfds[i].fd, buffer, MAX_BUFFER)) {
-          printf("Warning: Connection to sw%d closed.\n", i);
-          close(pfds[i].fd);
-          closed.push_back(i);
-          continue;
-        }
-
-        string packetString = string(buffer);
-        pair<string, vector<int>> receivedPacket = parsePacketString(packetString);
-        string packetType = get<0>(receivedPacket);
-        vector<int> packetMessage = get<1>(receivedPacket);
-
-        // Log the successful received packet
-        string direction = "Received";
-        printPacketMessage(direction, i, CONTROLLER_ID, packetType, packetMessage);
-
-        if (packetType == "OPEN") {
-          counts.open++;
-          switchInfoTable.push_back({packetMessage[0], packetMessage[1], packetMessage[2],
-                                     packetMessage[3], packetMessage[4]});
-          idToFd.insert({i, pfds[i].fd});
-          // Ensure switch is not closed before sending
-          if (find(closed.begin(), closed.end(), i) == closed.end()) {
-            sendAckPacket(numSwitches, pfds, pfds[i].fd, i);
-          }
-          counts.ack++;
-        } else if (packetType == "QUERY") {
-          counts.query++;
-
-          int srcIp = packetMessage[0];
-          if (srcIp > MAX_IP || srcIp < 0) {
-            printf("Error: Invalid IP for QUERY. Dropping.\n");
-            continue;
-          }
-
-          int destIp = packetMessage[1];
-          if (destIp > MAX_IP || destIp < 0) {
-            printf("Error: Invalid IP for QUERY. Dropping.\n");
-            continue;
-          }
-
-          // Check for information in the switch info table
-          bool found = false;
-          for (auto &info : switchInfoTable) {
-            if (destIp >= info.ipLow && destIp <= info.ipHigh) {
-              found = true;
-
-              int relayPort = 0;
-
-              // Determine relay port
-              if (info.id > i) {
-                relayPort = 2;
-              } else {
-                relayPort = 1;
-              }
-
-              // Ensure switch is not closed before sending
-              if (find(closed.begin(), closed.end(), i) == closed.end()) {
-                // Send new rule
-                sendAddPacket(numSwitches, pfds, idToFd[i], i, 1, info.ipLow, info.ipHigh,
-                              relayPort, srcIp);
-              }
-
-              break;
-            }
-          }
-
-          // If nothing is found in the info table, tell the switch to drop
-          if (!found) {
-            // Ensure switch is not closed before sending
-            if (find(closed.begin(), closed.end(), i) == closed.end()) {
-              sendAddPacket(numSwitches, pfds, idToFd[i], i, 0, destIp, destIp, 0, srcIp);
-            }
-          }
-
-          counts.add++;
-        } else {
-          printf("Received %s packet. Ignored.\n", packetType.c_str());
-        }
-      }
-    }
-
-    memset(buffer, 0, sizeof(buffer)); // Clear buffer
-
-    // Check the socket file descriptor for events
-    if (pfds[mainSocket].revents & POLLIN) {
-      if ((sockets[socketIdx] =
-               accept(pfds[mainSocket].fd, (struct sockaddr *) &from, &fromLength)) < 0) {
-        perror("accept() failure");
-        cleanup(numSwitches, pfds);
-        exit(errno);
-      }
-      pfds[socketIdx].fd = sockets[socketIdx];
-      pfds[socketIdx].events = POLLIN;
-      pfds[socketIdx].revents = 0;
-
-      // Set socket to non-blocking
-      if (fcntl(pfds[socketIdx].fd, F_SETFL, fcntl(pfds[socketIdx].fd, F_GETFL) | O_NONBLOCK) < 0) {
-        perror("fcntl() failure");
-        exit(errno);
-      }
-
-      socketIdx++;
-    }
+  if (cont.io == IO_BACKEND_URING && !uringInit(cont.ring, URING_ENTRIES, URING_BUFFERS,
+                                                MAX_BUFFER)) {
+    printf("Warning: io_uring is unavailable. Falling back to poll.\n");
+    cont.io = IO_BACKEND_POLL;
+  }
 
-    memset(buffer, 0, sizeof(buffer)); // Clear buffer
+  if (cont.io == IO_BACKEND_URING) {
+    uringLoop(cont, mainSocket);
+  } else if (cont.io == IO_BACKEND_EPOLL) {
+    epollLoop(cont, mainSocket);
+  } else {
+    pollLoop(cont, mainSocket);
   }
-}
\ No newline at end of file
+}
@@ -2,7 +2,19 @@
 #define CONTROLLER_H_
 
 #include <stdint.h>
+#include <string>
+#include "uring.h"
 
-void controllerLoop(int numSwitches, uint16_t portNumber);
+using namespace std;
+
+/**
+ * Tunable controller behaviour, set from optional key=value command line arguments
+ */
+typedef struct {
+    string tracePrefix;  // Prefix of the hop trace dump file, empty if QUERY hops are not traced
+    IoBackend io;
+} ControllerOptions;
+
+void controllerLoop(int numSwitches, uint16_t portNumber, ControllerOptions &options);
 
 #endif
\ No newline at end of file
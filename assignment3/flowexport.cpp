@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "flowexport.h"
+
+using namespace std;
+using namespace chrono;
+
+/**
+ * Returns the monotonic clock in milliseconds.
+ */
+long monotonicMs() {
+  return (long) duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Creates the non-blocking datagram socket used to send flow records to a collector listening on a
+ * Unix socket path. Returns false if the socket cannot be created.
+ */
+bool openFlowExporter(FlowExporter &exporter, const string &path, int switchId, long intervalMs,
+                      size_t maxRecords) {
+  exporter.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (exporter.fd < 0 || path.length() >= sizeof(exporter.collector.sun_path)) {
+    if (exporter.fd >= 0) close(exporter.fd);
+    exporter.fd = -1;
+    errno = 0;
+    return false;
+  }
+
+  memset(&exporter.collector, 0, sizeof(exporter.collector));
+  exporter.collector.sun_family = AF_UNIX;
+  strncpy(exporter.collector.sun_path, path.c_str(), sizeof(exporter.collector.sun_path) - 1);
+
+  exporter.switchId = switchId;
+  exporter.sequence = 0;
+  exporter.intervalMs = intervalMs;
+  exporter.lastExportMs = monotonicMs();
+  exporter.maxRecords = maxRecords;
+  exporter.cursor = 0;
+  exporter.lastCounts.clear();
+  exporter.datagrams = 0;
+  exporter.dropped = 0;
+  return true;
+}
+
+/**
+ * Returns whether the export interval has passed. Exports are rate limited to one per interval no
+ * matter how busy the switch is.
+ */
+bool flowExportDue(FlowExporter &exporter, long nowMs) {
+  return exporter.fd >= 0 && nowMs - exporter.lastExportMs >= exporter.intervalMs;
+}
+
+/**
+ * Sends records in datagrams of at most FLOW_EXPORT_MAX_RECORDS. The export is best effort: if the
+ * collector is not running or its queue is full the datagram is counted as dropped and the switch
+ * carries on.
+ */
+void sendFlowRecords(FlowExporter &exporter, vector<FlowExportRecord> &records, long nowMs) {
+  exporter.lastExportMs = nowMs;
+
+  char datagram[sizeof(FlowExportHeader) + FLOW_EXPORT_MAX_RECORDS * sizeof(FlowExportRecord)];
+  for (size_t first = 0; first < records.size(); first += FLOW_EXPORT_MAX_RECORDS) {
+    size_t count = min(records.size() - first, (size_t) FLOW_EXPORT_MAX_RECORDS);
+
+    FlowExportHeader header = {FLOW_EXPORT_VERSION, (uint16_t) count, exporter.switchId,
+                               exporter.sequence++, 0, (uint64_t) nowMs};
+    memcpy(datagram, &header, sizeof(header));
+    memcpy(datagram + sizeof(header), &records[first], count * sizeof(FlowExportRecord));
+
+    size_t length = sizeof(header) + count * sizeof(FlowExportRecord);
+    if (sendto(exporter.fd, datagram, length, 0, (struct sockaddr *) &exporter.collector,
+               sizeof(exporter.collector)) < 0) {
+      exporter.dropped++;
+      errno = 0;
+    } else {
+      exporter.datagrams++;
+    }
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef FLOWEXPORT_H_
+#define FLOWEXPORT_H_
+
+#include <stdint.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+
+#define FLOW_EXPORT_VERSION 1
+#define FLOW_EXPORT_MAX_RECORDS 64  // Records per datagram
+#define FLOW_EXPORT_DEFAULT_PATH "a3flows.sock"
+
+using namespace std;
+
+/**
+ * Header of a flow export datagram. Followed by count FlowExportRecords.
+ */
+typedef struct {
+    uint16_t version;
+    uint16_t count;
+    int32_t switchId;
+    uint32_t sequence;  // Per switch, lets the collector detect lost datagrams
+    uint32_t pad;
+    uint64_t exportTimeMs;  // Monotonic clock of the exporting switch
+} FlowExportHeader;
+
+/**
+ * Counters of a single flow rule
+ */
+typedef struct {
+    uint32_t ruleIndex;
+    uint32_t destIpLow;
+    uint32_t destIpHigh;
+    uint8_t action;  // 0 = DROP, 1 = FORWARD
+    uint8_t actionVal;
+    uint16_t pad;
+    uint64_t pktCount;
+    uint64_t pktDelta;  // Packets since the rule was last exported
+} FlowExportRecord;
+
+/**
+ * Exporter state kept by a switch
+ */
+typedef struct {
+    int fd;
+    struct sockaddr_un collector;
+    int switchId;
+    uint32_t sequence;
+    long intervalMs;  // Shortest time between two exports
+    long lastExportMs;
+    size_t maxRecords;  // Most records exported per interval
+    size_t cursor;  // Rule to resume from when the previous export was truncated
+    vector<uint64_t> lastCounts;  // pktCount of each rule when it was last exported
+    int datagrams;
+    int dropped;
+} FlowExporter;
+
+bool openFlowExporter(FlowExporter &exporter, const string &path, int switchId, long intervalMs,
+                      size_t maxRecords);
+
+bool flowExportDue(FlowExporter &exporter, long nowMs);
+
+void sendFlowRecords(FlowExporter &exporter, vector<FlowExportRecord> &records, long nowMs);
+
+long monotonicMs();
+
+#endif
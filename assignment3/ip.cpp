@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ip.h"
+
+using namespace std;
+
+/**
+ * Parses an unsigned decimal number of at most maxDigits digits. Returns false if the input is
+ * empty, contains anything else or is larger than maxValue.
+ */
+bool parseDecimal(const string &input, size_t maxDigits, uint64_t maxValue, uint64_t &value) {
+  if (input.empty() || input.length() > maxDigits) return false;
+
+  value = 0;
+  for (char c : input) {
+    if (c < '0' || c > '9') return false;
+    value = value * 10 + (uint64_t) (c - '0');
+  }
+
+  return value <= maxValue;
+}
+
+/**
+ * Parses an IPv4 address in dotted-quad form (10.0.0.1) or as a plain 32-bit integer (167772161).
+ * Returns false if the address is malformed.
+ */
+bool parseIp(const string &input, uint32_t &ip) {
+  uint64_t value = 0;
+
+  if (input.find('.') == string::npos) {
+    if (!parseDecimal(input, 10, IP_MAX, value)) return false;
+    ip = (uint32_t) value;
+    return true;
+  }
+
+  uint32_t address = 0;
+  size_t start = 0;
+  for (int octet = 0; octet < 4; octet++) {
+    size_t end = input.find('.', start);
+    if ((octet < 3) == (end == string::npos)) return false;
+
+    if (!parseDecimal(input.substr(start, end - start), 3, 255, value)) return false;
+    address = (address << 8) | (uint32_t) value;
+    start = end + 1;
+  }
+
+  ip = address;
+  return true;
+}
+
+/**
+ * Parses an address range given either as low-high (each end in any form accepted by parseIp) or
+ * in CIDR notation (10.0.0.0/24). A single address is a range of one. Returns false if the range is
+ * malformed or empty.
+ */
+bool parseIpRangeString(const string &input, uint32_t &ipLow, uint32_t &ipHigh) {
+  size_t slash = input.find('/');
+  if (slash != string::npos) {
+    uint32_t prefix = 0;
+    uint64_t length = 0;
+    if (!parseIp(input.substr(0, slash), prefix) ||
+        !parseDecimal(input.substr(slash + 1), 2, 32, length)) {
+      return false;
+    }
+
+    uint32_t hostMask = length == 0 ? IP_MAX : (uint32_t) ((1ull << (32 - length)) - 1);
+    ipLow = prefix & ~hostMask;
+    ipHigh = ipLow | hostMask;
+    return true;
+  }
+
+  size_t dash = input.find('-');
+  if (dash == string::npos) {
+    if (!parseIp(input, ipLow)) return false;
+    ipHigh = ipLow;
+    return true;
+  }
+
+  return parseIp(input.substr(0, dash), ipLow) && parseIp(input.substr(dash + 1), ipHigh) &&
+         ipLow <= ipHigh;
+}
+
+/**
+ * Formats an address in dotted-quad form.
+ */
+string formatIp(uint32_t ip) {
+  return to_string(ip >> 24) + "." + to_string((ip >> 16) & 0xFF) + "." +
+         to_string((ip >> 8) & 0xFF) + "." + to_string(ip & 0xFF);
+}
+
+/**
+ * Formats an address range as low-high.
+ */
+string formatIpRange(uint32_t ipLow, uint32_t ipHigh) {
+  return formatIp(ipLow) + "-" + formatIp(ipHigh);
+}
+
+/**
+ * Decomposes an address range into the smallest list of (prefix, length) pairs that exactly covers
+ * it, e.g. 10.0.0.1-10.0.0.6 becomes 10.0.0.1/32, 10.0.0.2/31, 10.0.0.4/31, 10.0.0.6/32.
+ */
+vector<pair<uint32_t, int>> rangeToPrefixes(uint32_t ipLow, uint32_t ipHigh) {
+  vector<pair<uint32_t, int>> prefixes;
+
+  uint64_t low = ipLow;
+  uint64_t high = ipHigh;
+  while (low <= high) {
+    // Grow the block while it stays aligned at low and ends inside the range
+    int hostBits = 0;
+    while (hostBits < 32 && !(low & (1ull << hostBits)) &&
+           low + (1ull << (hostBits + 1)) - 1 <= high) {
+      hostBits++;
+    }
+
+    prefixes.push_back(make_pair((uint32_t) low, 32 - hostBits));
+    low += 1ull << hostBits;
+  }
+
+  return prefixes;
+}
@@ -0,0 +1,23 @@
+#ifndef IP_H_
+#define IP_H_
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define IP_MAX 0xFFFFFFFFu
+
+using namespace std;
+
+bool parseIp(const string &input, uint32_t &ip);
+
+bool parseIpRangeString(const string &input, uint32_t &ipLow, uint32_t &ipHigh);
+
+string formatIp(uint32_t ip);
+
+string formatIpRange(uint32_t ipLow, uint32_t ipHigh);
+
+vector<pair<uint32_t, int>> rangeToPrefixes(uint32_t ipLow, uint32_t ipHigh);
+
+#endif
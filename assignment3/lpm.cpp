@@ -0,0 +1,187 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "ip.h"
+#include "lpm.h"
+
+#define TBL24_SIZE (1u << 24)
+#define TBL8_GROUP_SIZE 256
+#define TBL8_FLAG 0x80000000u  // tbl24 entry refers to a tbl8 group
+
+using namespace std;
+
+/**
+ * Allocates an empty table. tbl24 is allocated zeroed so that only the pages that routes are
+ * written into are ever backed by memory.
+ */
+void lpmInit(LpmTable &table) {
+  table.tbl24 = (uint32_t *) calloc(TBL24_SIZE, sizeof(uint32_t));
+  table.tbl24Depth = (uint8_t *) calloc(TBL24_SIZE, sizeof(uint8_t));
+  if (!table.tbl24 || !table.tbl24Depth) {
+    perror("calloc() failure");
+    exit(errno);
+  }
+
+  table.tbl8.clear();
+  table.tbl8Depth.clear();
+  table.numPrefixes = 0;
+}
+
+/**
+ * Releases the memory held by the table.
+ */
+void lpmFree(LpmTable &table) {
+  free(table.tbl24);
+  free(table.tbl24Depth);
+  table.tbl24 = nullptr;
+  table.tbl24Depth = nullptr;
+  table.tbl8.clear();
+  table.tbl8Depth.clear();
+  table.numPrefixes = 0;
+}
+
+/**
+ * Removes every route from the table.
+ */
+void lpmClear(LpmTable &table) {
+  lpmFree(table);
+  lpmInit(table);
+}
+
+/**
+ * Inserts a prefix. Entries already covered by a prefix of the same or greater length are left
+ * alone, so the more specific route wins and an identical prefix keeps its first value.
+ */
+void lpmInsert(LpmTable &table, uint32_t prefix, int length, uint32_t value) {
+  auto depth = (uint8_t) (length + 1);
+  uint32_t mask = length == 0 ? 0 : IP_MAX << (32 - length);
+  prefix &= mask;
+  table.numPrefixes++;
+
+  if (length <= 24) {
+    uint32_t first = prefix >> 8;
+    uint32_t count = 1u << (24 - length);
+
+    for (uint32_t i = first; i < first + count; i++) {
+      if (table.tbl24[i] & TBL8_FLAG) {
+        // Fill the parts of the group that are not covered by something more specific
+        uint32_t group = (table.tbl24[i] & ~TBL8_FLAG) * TBL8_GROUP_SIZE;
+        for (uint32_t j = group; j < group + TBL8_GROUP_SIZE; j++) {
+          if (table.tbl8Depth[j] < depth) {
+            table.tbl8[j] = value;
+            table.tbl8Depth[j] = depth;
+          }
+        }
+      } else if (table.tbl24Depth[i] < depth) {
+        table.tbl24[i] = value;
+        table.tbl24Depth[i] = depth;
+      }
+    }
+    return;
+  }
+
+  uint32_t index = prefix >> 8;
+  if (!(table.tbl24[index] & TBL8_FLAG)) {
+    // Expand the tbl24 entry into a group that inherits its current route
+    auto group = (uint32_t) (table.tbl8.size() / TBL8_GROUP_SIZE);
+    table.tbl8.resize(table.tbl8.size() + TBL8_GROUP_SIZE, table.tbl24[index]);
+    table.tbl8Depth.resize(table.tbl8Depth.size() + TBL8_GROUP_SIZE, table.tbl24Depth[index]);
+    table.tbl24[index] = group | TBL8_FLAG;
+    table.tbl24Depth[index] = 0;
+  }
+
+  uint32_t group = (table.tbl24[index] & ~TBL8_FLAG) * TBL8_GROUP_SIZE;
+  uint32_t first = group + (prefix & 0xFF);
+  uint32_t count = 1u << (32 - length);
+  for (uint32_t j = first; j < first + count; j++) {
+    if (table.tbl8Depth[j] < depth) {
+      table.tbl8[j] = value;
+      table.tbl8Depth[j] = depth;
+    }
+  }
+}
+
+/**
+ * Inserts an arbitrary address range by decomposing it into prefixes.
+ */
+void lpmInsertRange(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, uint32_t value) {
+  for (auto &prefix : rangeToPrefixes(ipLow, ipHigh)) {
+    lpmInsert(table, prefix.first, prefix.second, value);
+  }
+}
+
+/**
+ * Returns the value of the longest prefix containing the address, or 0 if there is none.
+ */
+uint32_t lpmLookup(const LpmTable &table, uint32_t ip) {
+  uint32_t entry = table.tbl24[ip >> 8];
+  if (entry & TBL8_FLAG) {
+    return table.tbl8[(entry & ~TBL8_FLAG) * TBL8_GROUP_SIZE + (ip & 0xFF)];
+  }
+  return entry;
+}
+
+/**
+ * Calls visit with every entry that holds the route of an address in the range, until it returns
+ * false. A tbl24 entry covers 256 addresses and is visited once.
+ */
+template <typename Visitor>
+void lpmWalkRange(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, Visitor visit) {
+  uint64_t ip = ipLow;
+  while (ip <= ipHigh) {
+    auto index = (uint32_t) (ip >> 8);
+    uint64_t blockEnd = min((uint64_t) ipHigh, ((uint64_t) index << 8) | 0xFF);
+
+    if (table.tbl24[index] & TBL8_FLAG) {
+      uint32_t group = (table.tbl24[index] & ~TBL8_FLAG) * TBL8_GROUP_SIZE;
+      for (uint64_t j = ip; j <= blockEnd; j++) {
+        if (!visit(table.tbl8[group + (j & 0xFF)])) return;
+      }
+    } else if (!visit(table.tbl24[index])) {
+      return;
+    }
+
+    ip = blockEnd + 1;
+  }
+}
+
+/**
+ * Collects the distinct values of the routes of the addresses in a range, in ascending order.
+ */
+void lpmCollectValues(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, vector<uint32_t> &values) {
+  values.clear();
+  lpmWalkRange(table, ipLow, ipHigh, [&](uint32_t &entry) {
+    if (entry && (values.empty() || values.back() != entry)) values.push_back(entry);
+    return true;
+  });
+
+  sort(values.begin(), values.end());
+  values.erase(unique(values.begin(), values.end()), values.end());
+}
+
+/**
+ * Returns whether the route of any address in a range has the given value.
+ */
+bool lpmContainsValue(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, uint32_t value) {
+  bool found = false;
+  lpmWalkRange(table, ipLow, ipHigh, [&](uint32_t &entry) {
+    found = entry == value;
+    return !found;
+  });
+  return found;
+}
+
+/**
+ * Gives the routes of a range that have the value from the value to instead. Prefix lengths are
+ * kept, so later inserts see the same table as before.
+ */
+void lpmReplaceValue(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, uint32_t from, uint32_t to) {
+  lpmWalkRange(table, ipLow, ipHigh, [&](uint32_t &entry) {
+    if (entry == from) entry = to;
+    return true;
+  });
+}
@@ -0,0 +1,40 @@
+#ifndef LPM_H_
+#define LPM_H_
+
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * DIR-24-8 longest prefix match table. The top 24 bits of an address index tbl24 directly; entries
+ * covered by a prefix longer than /24 point to a 256 entry tbl8 group indexed by the low 8 bits.
+ * A lookup is therefore one or two memory accesses. Values are 1-based; 0 means no match.
+ */
+typedef struct {
+    uint32_t *tbl24;
+    uint8_t *tbl24Depth;  // Prefix length + 1 of the route stored in each entry, 0 if empty
+    vector<uint32_t> tbl8;
+    vector<uint8_t> tbl8Depth;
+    uint32_t numPrefixes;
+} LpmTable;
+
+void lpmInit(LpmTable &table);
+
+void lpmFree(LpmTable &table);
+
+void lpmClear(LpmTable &table);
+
+void lpmInsert(LpmTable &table, uint32_t prefix, int length, uint32_t value);
+
+void lpmInsertRange(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, uint32_t value);
+
+uint32_t lpmLookup(const LpmTable &table, uint32_t ip);
+
+void lpmCollectValues(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, vector<uint32_t> &values);
+
+bool lpmContainsValue(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, uint32_t value);
+
+void lpmReplaceValue(LpmTable &table, uint32_t ipLow, uint32_t ipHigh, uint32_t from, uint32_t to);
+
+#endif
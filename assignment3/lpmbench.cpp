@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include <utility>
+#include <vector>
+#include "ip.h"
+#include "lpm.h"
+
+#define DEFAULT_PREFIXES 1000000
+#define DEFAULT_LOOKUPS 10000000
+#define VERIFY_PREFIXES 2000
+#define VERIFY_LOOKUPS 100000
+#define LINEAR_RULES 1000
+
+using namespace std;
+using namespace chrono;
+
+/**
+ * A prefix and the value stored for it
+ */
+typedef struct {
+    uint32_t prefix;
+    int length;
+    uint32_t value;
+} Route;
+
+/**
+ * Generates random routes with a prefix length mix similar to a public routing table: mostly /24s,
+ * a large share of /16-/23, a few short prefixes and a few host routes.
+ */
+vector<Route> makeRoutes(mt19937 &rng, int numRoutes) {
+  vector<Route> routes;
+  uniform_int_distribution<uint32_t> address;
+  uniform_int_distribution<int> percent(0, 99);
+
+  for (int i = 0; i < numRoutes; i++) {
+    int bucket = percent(rng);
+    int length;
+    if (bucket < 55) {
+      length = 24;
+    } else if (bucket < 90) {
+      length = 16 + percent(rng) % 8;
+    } else if (bucket < 97) {
+      length = 8 + percent(rng) % 8;
+    } else {
+      length = 25 + percent(rng) % 8;
+    }
+
+    uint32_t mask = IP_MAX << (32 - length);
+    routes.push_back({address(rng) & mask, length, (uint32_t) i + 1});
+  }
+
+  return routes;
+}
+
+/**
+ * Reference longest prefix match. The first route wins between identical prefixes.
+ */
+uint32_t linearLookup(vector<Route> &routes, uint32_t ip) {
+  uint32_t value = 0;
+  int bestLength = -1;
+  for (auto &route : routes) {
+    uint32_t mask = route.length == 0 ? 0 : IP_MAX << (32 - route.length);
+    if ((ip & mask) == route.prefix && route.length > bestLength) {
+      value = route.value;
+      bestLength = route.length;
+    }
+  }
+  return value;
+}
+
+/**
+ * Returns nanoseconds elapsed since start.
+ */
+double elapsedNs(steady_clock::time_point start) {
+  return (double) duration_cast<nanoseconds>(steady_clock::now() - start).count();
+}
+
+/**
+ * Checks the DIR-24-8 table against the reference lookup on a small random table.
+ */
+bool verify(mt19937 &rng) {
+  vector<Route> routes = makeRoutes(rng, VERIFY_PREFIXES);
+  LpmTable table {};
+  lpmInit(table);
+  for (auto &route : routes) lpmInsert(table, route.prefix, route.length, route.value);
+
+  uniform_int_distribution<uint32_t> address;
+  bool ok = true;
+  for (int i = 0; i < VERIFY_LOOKUPS && ok; i++) {
+    // Half of the probes land inside a known prefix so that matches are exercised
+    uint32_t ip = address(rng);
+    if (i % 2) ip = routes[ip % routes.size()].prefix | (address(rng) & 0xFF);
+
+    if (lpmLookup(table, ip) != linearLookup(routes, ip)) {
+      printf("Error: Mismatch for %s\n", formatIp(ip).c_str());
+      ok = false;
+    }
+  }
+
+  lpmFree(table);
+  return ok;
+}
+
+/**
+ * Benchmarks insertion and lookup on a large random table, and compares lookups against a linear
+ * scan of a small flow table (the switch's previous lookup strategy).
+ * Usage: lpmbench [numPrefixes] [numLookups]
+ */
+int main(int argc, char **argv) {
+  char *end = nullptr;
+  errno = 0;
+  long prefixes = argc > 1 ? strtol(argv[1], &end, 10) : DEFAULT_PREFIXES;
+  bool valid = argc <= 1 || *end == '\0';
+  long lookups = argc > 2 ? strtol(argv[2], &end, 10) : DEFAULT_LOOKUPS;
+  valid = valid && (argc <= 2 || *end == '\0') && !errno;
+  if (!valid || prefixes < 1 || prefixes > INT_MAX || lookups < 1 || lookups > INT_MAX) {
+    printf("Error: Invalid arguments. Expected 'lpmbench [numPrefixes] [numLookups]'\n");
+    return EXIT_FAILURE;
+  }
+  int numPrefixes = (int) prefixes;
+  int numLookups = (int) lookups;
+
+  mt19937 rng(379);
+
+  if (!verify(rng)) return EXIT_FAILURE;
+  printf("Verified %i lookups against a linear scan of %i prefixes\n", VERIFY_LOOKUPS,
+         VERIFY_PREFIXES);
+
+  vector<Route> routes = makeRoutes(rng, numPrefixes);
+
+  LpmTable table {};
+  lpmInit(table);
+  steady_clock::time_point start = steady_clock::now();
+  for (auto &route : routes) lpmInsert(table, route.prefix, route.length, route.value);
+  double insertNs = elapsedNs(start);
+
+  printf("Inserted %i prefixes in %.1f ms (%.0f ns/prefix, %zu tbl8 groups)\n", numPrefixes,
+         insertNs / 1e6, insertNs / numPrefixes, table.tbl8.size() / 256);
+
+  // Generate probe addresses up front so that only the lookups are timed
+  uniform_int_distribution<uint32_t> address;
+  vector<uint32_t> probes((size_t) numLookups);
+  for (auto &probe : probes) probe = address(rng);
+
+  uint64_t matched = 0;
+  start = steady_clock::now();
+  for (auto &probe : probes) matched += lpmLookup(table, probe) != 0;
+  double lookupNs = elapsedNs(start);
+
+  printf("DIR-24-8: %i lookups in %.1f ms (%.1f ns/lookup, %.1f Mlookups/s, %.1f%% matched)\n",
+         numLookups, lookupNs / 1e6, lookupNs / numLookups, numLookups / (lookupNs / 1e3),
+         100.0 * matched / numLookups);
+
+  // The old flow table scanned every rule in order
+  vector<Route> linearRoutes(routes.begin(), routes.begin() + min(numPrefixes, LINEAR_RULES));
+  int linearLookups = min(numLookups, 100000);
+  matched = 0;
+  start = steady_clock::now();
+  for (int i = 0; i < linearLookups; i++) matched += linearLookup(linearRoutes, probes[i]) != 0;
+  double linearNs = elapsedNs(start);
+
+  printf("Linear scan of %zu rules: %.1f ns/lookup (%.1f%% matched)\n", linearRoutes.size(),
+         linearNs / linearLookups, 100.0 * matched / linearLookups);
+
+  lpmFree(table);
+  return EXIT_SUCCESS;
+}
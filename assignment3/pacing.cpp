@@ -0,0 +1,99 @@
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include "pacing.h"
+
+using namespace std;
+
+/**
+ * Sets up a pacer. Lines without a timestamp are released at ratePps times speed, with up to
+ * burst of them at once after the replay fell behind. The bucket starts with a single token so
+ * that a replay does not open with a burst.
+ */
+void initPacer(Pacer &pacer, double ratePps, double speed, int burst) {
+  pacer.speed = speed > 0.0 ? speed : 1.0;
+  pacer.ratePps = max(ratePps, 0.0);
+  pacer.burst = max((double) burst, 1.0);
+  pacer.tokens = 1.0;
+  pacer.refilledNs = 0;
+  pacer.startNs = 0;
+  pacer.lastTimestampNs = NO_TIMESTAMP;
+  pacer.packets = 0;
+  pacer.scheduledNs = 0;
+  pacer.firstNs = 0;
+  pacer.lastNs = 0;
+  pacer.maxLagNs = 0;
+}
+
+/**
+ * Adds the tokens earned since the bucket was last topped up.
+ */
+void refillPacer(Pacer &pacer, int64_t nowNs) {
+  if (pacer.refilledNs && nowNs > pacer.refilledNs) {
+    double earned = (double) (nowNs - pacer.refilledNs) * pacer.ratePps * pacer.speed / 1e9;
+    pacer.tokens = min(pacer.tokens + earned, pacer.burst);
+  }
+  pacer.refilledNs = nowNs;
+}
+
+/**
+ * Changes the target rate of lines without a timestamp. Tokens earned at the old rate are kept.
+ */
+void setPacerRate(Pacer &pacer, double ratePps, int64_t nowNs) {
+  refillPacer(pacer, nowNs);
+  pacer.ratePps = max(ratePps, 0.0);
+}
+
+/**
+ * Counts a paced line released now, which the schedule allowed scheduledNs after the previous.
+ */
+void recordPacedLine(Pacer &pacer, int64_t scheduledNs, int64_t nowNs) {
+  if (pacer.packets) {
+    pacer.scheduledNs += scheduledNs;
+  } else {
+    pacer.firstNs = nowNs;
+  }
+  pacer.lastNs = nowNs;
+  pacer.packets++;
+}
+
+/**
+ * Returns how many nanoseconds a line must wait before it is released, or 0 if it may go now, in
+ * which case it is counted as released. timestampNs is the time of the line since the start of
+ * the replay, or NO_TIMESTAMP. Lines that are not paced always go at once.
+ */
+int64_t pacerDelayNs(Pacer &pacer, int64_t timestampNs, int64_t nowNs) {
+  if (!pacer.startNs) pacer.startNs = nowNs;
+
+  if (timestampNs != NO_TIMESTAMP) {
+    int64_t dueNs = pacer.startNs + (int64_t) ((double) timestampNs / pacer.speed);
+    if (nowNs < dueNs) return dueNs - nowNs;
+
+    int64_t gapNs = pacer.lastTimestampNs == NO_TIMESTAMP ? 0 :
+                    (int64_t) ((double) max(timestampNs - pacer.lastTimestampNs, (int64_t) 0) /
+                               pacer.speed);
+    pacer.lastTimestampNs = timestampNs;
+    pacer.maxLagNs = max(pacer.maxLagNs, nowNs - dueNs);
+    recordPacedLine(pacer, gapNs, nowNs);
+    return 0;
+  }
+
+  if (pacer.ratePps <= 0.0) return 0;
+
+  refillPacer(pacer, nowNs);
+  double ratePerNs = pacer.ratePps * pacer.speed / 1e9;
+  if (pacer.tokens < 1.0) return max((int64_t) ceil((1.0 - pacer.tokens) / ratePerNs), (int64_t) 1);
+
+  pacer.tokens -= 1.0;
+  recordPacedLine(pacer, (int64_t) (1.0 / ratePerNs), nowNs);
+  return 0;
+}
+
+/**
+ * Returns the packets per second of packets lines spread over elapsedNs, counting the gaps
+ * between them. Returns 0 if there is no gap to measure.
+ */
+double pacedRate(uint64_t packets, int64_t elapsedNs) {
+  if (packets < 2 || elapsedNs <= 0) return 0.0;
+  return (double) (packets - 1) * 1e9 / (double) elapsedNs;
+}
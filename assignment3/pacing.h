@@ -0,0 +1,38 @@
+#ifndef PACING_H_
+#define PACING_H_
+
+#include <stdint.h>
+
+#define NO_TIMESTAMP -1
+
+using namespace std;
+
+/**
+ * Paces the replay of a switch's traffic. A line with a timestamp is released once the replay
+ * reaches it; other lines are released at a target rate through a token bucket. The speed
+ * multiplier scales both. Times are CLOCK_MONOTONIC nanoseconds supplied by the caller.
+ */
+typedef struct {
+    double speed;  // Replay speed multiplier, 1 for real time
+    double ratePps;  // Target rate of lines without a timestamp, 0 if they are not paced
+    double burst;  // Most tokens the bucket holds
+    double tokens;
+    int64_t refilledNs;  // Time the bucket was last topped up
+    int64_t startNs;  // Start of the replay, which timestamps count from. 0 until it starts.
+    int64_t lastTimestampNs;  // Timestamp of the previous released line, NO_TIMESTAMP if none
+    uint64_t packets;  // Paced lines released so far
+    int64_t scheduledNs;  // Time the schedule allows between the first and last paced line
+    int64_t firstNs;  // Times at which the first and last paced lines were released
+    int64_t lastNs;
+    int64_t maxLagNs;  // Longest a timestamped line was released after its time
+} Pacer;
+
+void initPacer(Pacer &pacer, double ratePps, double speed, int burst);
+
+void setPacerRate(Pacer &pacer, double ratePps, int64_t nowNs);
+
+int64_t pacerDelayNs(Pacer &pacer, int64_t timestampNs, int64_t nowNs);
+
+double pacedRate(uint64_t packets, int64_t elapsedNs);
+
+#endif
@@ -0,0 +1,234 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "statseg.h"
+
+#define MAX_READ_RETRIES 1000
+
+using namespace std;
+
+string exitSegmentPath;  // Segment of this process, removed when it exits
+
+/**
+ * Removes the stats segment of this process when it exits, whichever exit() call ends it.
+ */
+void removeStatSegmentAtExit() {
+  if (!exitSegmentPath.empty()) unlink(exitSegmentPath.c_str());
+}
+
+/**
+ * Returns CLOCK_MONOTONIC in nanoseconds. Served by the vDSO, so it does not enter the kernel.
+ */
+int64_t statClockNs() {
+  timespec now {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Removes segments left behind under the same name by processes that were killed before they
+ * could remove their own, such as an earlier run of a switch that crashed.
+ */
+void removeStaleSegments(const string &name) {
+  string prefix = string(STAT_SEGMENT_DIR) + "/" + STAT_SEGMENT_PREFIX + name + ".";
+  for (auto &path : listStatSegments()) {
+    if (path.compare(0, prefix.size(), prefix) != 0) continue;
+    char *end = nullptr;
+    long pid = strtol(path.c_str() + prefix.size(), &end, 10);
+    if (*end == '\0' && pid > 0 && kill((pid_t) pid, 0) < 0 && errno == ESRCH) {
+      unlink(path.c_str());
+    }
+  }
+  errno = 0;
+}
+
+/**
+ * Creates the stats segment of this process under /dev/shm and writes the definitions of its
+ * stats. Returns false if the segment cannot be created, in which case publishing does nothing.
+ */
+bool openStatSegment(StatPublisher &publisher, const string &name,
+                     const vector<StatDefinition> &definitions) {
+  publisher.segment = nullptr;
+  publisher.lastPublishMs = 0;
+  removeStaleSegments(name);
+  publisher.path = string(STAT_SEGMENT_DIR) + "/" + STAT_SEGMENT_PREFIX + name + "." +
+                   to_string(getpid());
+
+  int fd = open(publisher.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(StatSegment)) < 0) {
+    if (fd >= 0) close(fd);
+    errno = 0;
+    return false;
+  }
+
+  void *memory = mmap(nullptr, sizeof(StatSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    unlink(publisher.path.c_str());
+    errno = 0;
+    return false;
+  }
+
+  // The file starts zeroed, so readers skip it until the magic number is in place
+  auto *segment = (StatSegment *) memory;
+  segment->version = STAT_SEGMENT_VERSION;
+  segment->size = sizeof(StatSegment);
+  segment->pid = getpid();
+  strncpy(segment->name, name.c_str(), MAX_STAT_NAME - 1);
+  segment->numStats = (uint32_t) min(definitions.size(), (size_t) MAX_STATS);
+  for (uint32_t i = 0; i < segment->numStats; i++) {
+    strncpy(segment->stats[i].name, definitions[i].name.c_str(), MAX_STAT_NAME - 1);
+    segment->stats[i].kind = definitions[i].kind;
+  }
+  segment->publishedNs = statClockNs();
+  __atomic_store_n(&segment->magic, (uint32_t) STAT_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+
+  publisher.segment = segment;
+  if (exitSegmentPath.empty()) atexit(removeStatSegmentAtExit);
+  exitSegmentPath = publisher.path;
+  return true;
+}
+
+/**
+ * Returns whether STAT_PUBLISH_MS passed since the previous publish.
+ */
+bool statsDue(StatPublisher &publisher) {
+  if (!publisher.segment) return false;
+  return statClockNs() / 1000000 - publisher.lastPublishMs >= STAT_PUBLISH_MS;
+}
+
+/**
+ * Writes the values of the stats, in the order of their definitions. Only touches shared memory,
+ * so publishing never costs a system call.
+ */
+void publishStats(StatPublisher &publisher, const vector<uint64_t> &values) {
+  StatSegment *segment = publisher.segment;
+  if (!segment) return;
+
+  uint64_t sequence = segment->sequence;
+  __atomic_store_n(&segment->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  size_t count = min(values.size(), (size_t) segment->numStats);
+  for (size_t i = 0; i < count; i++) {
+    __atomic_store_n(&segment->stats[i].value, values[i], __ATOMIC_RELAXED);
+  }
+  int64_t nowNs = statClockNs();
+  __atomic_store_n(&segment->publishedNs, nowNs, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+  publisher.lastPublishMs = nowNs / 1000000;
+}
+
+/**
+ * Removes the stats segment of this process.
+ */
+void closeStatSegment(StatPublisher &publisher) {
+  if (!publisher.segment) return;
+  munmap(publisher.segment, sizeof(StatSegment));
+  unlink(publisher.path.c_str());
+  publisher.segment = nullptr;
+  if (exitSegmentPath == publisher.path) exitSegmentPath.clear();
+}
+
+/**
+ * Maps a stats segment for reading. Returns nullptr if it cannot be mapped or is not a stats
+ * segment of a known version.
+ */
+StatSegment *mapStatSegment(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat info {};
+  if (fd < 0 || fstat(fd, &info) < 0 || info.st_size < (off_t) sizeof(StatSegment)) {
+    if (fd >= 0) close(fd);
+    errno = 0;
+    return nullptr;
+  }
+
+  void *memory = mmap(nullptr, sizeof(StatSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    errno = 0;
+    return nullptr;
+  }
+
+  auto *segment = (StatSegment *) memory;
+  if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != STAT_SEGMENT_MAGIC ||
+      segment->version != STAT_SEGMENT_VERSION) {
+    munmap(memory, sizeof(StatSegment));
+    return nullptr;
+  }
+
+  return segment;
+}
+
+/**
+ * Releases a segment mapped by mapStatSegment().
+ */
+void unmapStatSegment(StatSegment *segment) {
+  munmap(segment, sizeof(StatSegment));
+}
+
+/**
+ * Copies a stats segment without locking out its publisher. Returns false if the publisher kept
+ * writing during every attempt.
+ */
+bool readStatSegment(StatSegment *segment, StatSnapshot &snapshot) {
+  for (int attempt = 0; attempt < MAX_READ_RETRIES; attempt++) {
+    uint64_t before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) continue;
+
+    uint32_t numStats = min(segment->numStats, (uint32_t) MAX_STATS);
+    snapshot.stats.resize(numStats);
+    for (uint32_t i = 0; i < numStats; i++) {
+      StatEntry &entry = snapshot.stats[i];
+      memcpy(entry.name, segment->stats[i].name, MAX_STAT_NAME);
+      entry.name[MAX_STAT_NAME - 1] = '\0';
+      entry.kind = segment->stats[i].kind;
+      entry.value = __atomic_load_n(&segment->stats[i].value, __ATOMIC_RELAXED);
+    }
+    snapshot.publishedNs = __atomic_load_n(&segment->publishedNs, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) != before) continue;
+
+    snapshot.name = string(segment->name, strnlen(segment->name, MAX_STAT_NAME));
+    snapshot.pid = segment->pid;
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * Returns the paths of every stats segment under /dev/shm, sorted by name.
+ */
+vector<string> listStatSegments() {
+  vector<string> paths;
+  DIR *dir = opendir(STAT_SEGMENT_DIR);
+  if (!dir) {
+    errno = 0;
+    return paths;
+  }
+
+  size_t prefixLength = strlen(STAT_SEGMENT_PREFIX);
+  while (dirent *entry = readdir(dir)) {
+    if (strncmp(entry->d_name, STAT_SEGMENT_PREFIX, prefixLength) == 0) {
+      paths.push_back(string(STAT_SEGMENT_DIR) + "/" + entry->d_name);
+    }
+  }
+  closedir(dir);
+  errno = 0;
+
+  sort(paths.begin(), paths.end());
+  return paths;
+}
@@ -0,0 +1,98 @@
+#ifndef STATSEG_H_
+#define STATSEG_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define STAT_SEGMENT_DIR "/dev/shm"
+#define STAT_SEGMENT_PREFIX "statseg."  // Segments are named statseg.<process name>.<pid>
+#define STAT_SEGMENT_MAGIC 0x47455354  // "TSEG"
+#define STAT_SEGMENT_VERSION 1
+#define STAT_PUBLISH_MS 100  // Shortest time between two publishes of a process
+#define MAX_STATS 64
+#define MAX_STAT_NAME 32
+
+using namespace std;
+
+/**
+ * How a reader should show a stat
+ */
+typedef enum {
+    STAT_COUNTER,  // Only grows; shown as a rate
+    STAT_GAUGE  // Current level, shown as is
+} StatKind;
+
+/**
+ * One named value of a stats segment
+ */
+typedef struct {
+    char name[MAX_STAT_NAME];
+    uint32_t kind;  // StatKind
+    uint32_t reserved;
+    uint64_t value;
+} StatEntry;
+
+/**
+ * Layout of a stats segment, shared between one publishing process and any number of readers.
+ * The publisher makes sequence odd while it writes and even again once it is done, so a reader
+ * retries any read that saw an odd sequence or a sequence that changed under it.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;  // Readers skip segments of versions they do not know
+    uint32_t size;  // Bytes of the segment
+    int32_t pid;
+    char name[MAX_STAT_NAME];
+    uint64_t sequence;
+    int64_t publishedNs;  // CLOCK_MONOTONIC time of the latest publish
+    uint32_t numStats;
+    uint32_t reserved;
+    StatEntry stats[MAX_STATS];
+} StatSegment;
+
+/**
+ * The definition of a stat published by a process
+ */
+typedef struct {
+    string name;
+    StatKind kind;
+} StatDefinition;
+
+/**
+ * The writing end of a stats segment
+ */
+typedef struct {
+    StatSegment *segment;  // nullptr if the segment could not be created
+    string path;
+    long lastPublishMs;
+} StatPublisher;
+
+/**
+ * A consistent copy of a stats segment
+ */
+typedef struct {
+    string name;
+    int pid;
+    int64_t publishedNs;
+    vector<StatEntry> stats;
+} StatSnapshot;
+
+bool openStatSegment(StatPublisher &publisher, const string &name,
+                     const vector<StatDefinition> &definitions);
+
+bool statsDue(StatPublisher &publisher);
+
+void publishStats(StatPublisher &publisher, const vector<uint64_t> &values);
+
+void closeStatSegment(StatPublisher &publisher);
+
+StatSegment *mapStatSegment(const string &path);
+
+void unmapStatSegment(StatSegment *segment);
+
+bool readStatSegment(StatSegment *segment, StatSnapshot &snapshot);
+
+vector<string> listStatSegments();
+
+#endif
@@ -1,60 +1,270 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <fstream>
+#include <deque>
 #include <iterator>
 #include <map>
 #include <sstream>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <vector>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include "flowexport.h"
+#include "ip.h"
+#include "lpm.h"
+#include "pacing.h"
+#include "statseg.h"
+#include "switch.h"
+#include "trace.h"
+#include "traffic.h"
 #include "util.h"
 
-#define PFDS_SIZE 5
+#define CONTROL_PFDS_SIZE 2  // stdin and the controller socket
+#define TRAFFIC_PFD 0  // The data plane waits for live traffic in the slot of port 0
+#define CONTROL_POLL_MS 10
+#define GRACE_POLL_US 20
+#define RULE_COUNTER_CHUNK 4096
+#define MAX_RULE_COUNTER_CHUNKS 4096
+#define NO_RULE_COUNTER UINT32_MAX
 #define CONTROLLER_ID 0
-#define MAX_IP 1000
 #define MIN_PRI 4
 #define MAX_BUFFER 1024
+#define URING_ENTRIES 64
+#define URING_BUFFERS 64
+#define URING_POLL 1  // Tags in the upper half of io_uring user data
+#define URING_READ 2
+#define URING_WRITE 3
+#define URING_TRAFFIC 4
+#define URING_WAKE 5
+#define URING_TIMER 6
 
 using namespace std;
 using namespace chrono;
 
 /**
- * A struct for storing the switch's packet counts
+ * A counter written by a single thread and read by the others for display
+ */
+typedef atomic<uint64_t> StatCounter;
+
+/**
+ * A struct for storing the switch's packet counts. The control thread counts ACK, ADD and OPEN
+ * packets and the data-plane thread counts the rest.
  */
 typedef struct {
-    int admit;
-    int ack;
-    int add;
-    int relayIn;
-    int open;
-    int query;
-    int relayOut;
+    StatCounter admit;
+    StatCounter ack;
+    StatCounter add;
+    StatCounter relayIn;
+    StatCounter open;
+    StatCounter query;
+    StatCounter relayOut;
+    StatCounter admitIterations;  // Loop iterations that admitted at least one packet
+    StatCounter maxBatch;  // Most packets admitted in a single iteration
+    StatCounter syscalls;  // I/O system calls of the data-plane thread
+    StatCounter rulesMerged;  // Rules merged into a rule of the same action by the compactor
+    StatCounter rulesShadowed;  // Rules removed by the compactor because they can never match
+    StatCounter trafficBytes;  // Bytes read from a live traffic source
+    StatCounter trafficDropped;  // Live traffic lines too long for the ring buffer
+    StatCounter sleeps;  // Times the data-plane thread waited for an event with nothing to do
+    StatCounter pacedPackets;  // Traffic packets admitted on the pacer's schedule
+    StatCounter pacedScheduledNs;  // Time the schedule allows between the first and last of them
+    StatCounter pacedElapsedNs;  // Time taken between the first and last of them
+    StatCounter maxPacingLagNs;  // Longest a timestamped packet was admitted after its time
 } SwitchPacketCounts;
 
+/**
+ * Relay packets waiting to be written, indexed by outgoing port, and the ports that have any
+ */
+typedef struct {
+    vector<string> data;
+    vector<int> ports;
+} RelayBatch;
+
+/**
+ * A packet relayed by a neighbour that missed the flow table, waiting for the controller's rule
+ */
+typedef struct {
+    uint32_t srcIp;
+    uint32_t destIp;
+    int64_t traceId;
+    int64_t sentNs;
+    int64_t ingressNs;
+    uint64_t answeredBy;  // ADD packets received once the controller answered its QUERY
+} WaitingRelay;
+
+/**
+ * A packet read from a port and waiting to be handled
+ */
+typedef struct {
+    int port;
+    string packet;
+    int64_t queuedNs;
+} IngressPacket;
+
+/**
+ * Packets of one traffic class waiting to be handled, with the statistics shown by list
+ */
+typedef struct {
+    deque<IngressPacket> packets;
+    StatCounter depth;
+    StatCounter maxDepth;
+    StatCounter handled;
+    StatCounter totalWaitNs;
+    StatCounter maxWaitNs;
+} IngressQueue;
+
 /**
  * A struct representing a rule in the flow table
  */
 typedef struct {
-    int srcIpLow;
-    int srcIpHigh;
-    int destIpLow;
-    int destIpHigh;
+    uint32_t srcIpLow;
+    uint32_t srcIpHigh;
+    uint32_t destIpLow;
+    uint32_t destIpHigh;
     string actionType;  // FORWARD, DROP
     int actionVal;
     int pri;  // 0, 1, 2, 3, 4 (highest - lowest)
-    int pktCount;
+    uint32_t counter;  // Slot of the rule's packet counter
 } FlowRule;
 
+/**
+ * Packet counters of the rules in the flow table. A rule keeps its counter slot while compaction
+ * moves it around the table. Chunks are allocated by the control thread before it publishes the
+ * rules that use them and are never moved, so the data-plane thread counts without locks while
+ * list and the flow exporter read the counters. The rest is only used by the control thread.
+ */
+typedef struct {
+    StatCounter *chunks[MAX_RULE_COUNTER_CHUNKS];
+    vector<uint64_t> carried;  // Packets of removed rules carried over to each slot
+    vector<uint32_t> freeSlots;  // Slots of removed rules that no flow table uses any more
+    uint32_t used;  // Slots handed out so far
+} RuleCounters;
+
+/**
+ * A rule removed by the compactor. Its packet count is carried over to the rule that took over its
+ * addresses once the data plane has left the last flow table that contained it.
+ */
+typedef struct {
+    uint32_t from;
+    uint32_t to;  // NO_RULE_COUNTER if the rule never owned an address
+} CounterMove;
+
+/**
+ * An immutable version of the flow table, published by the control thread to the data-plane
+ * thread. Also carries the controller replies the data plane waits for.
+ */
+typedef struct {
+    uint64_t epoch;
+    vector<FlowRule> rules;
+    LpmTable *destIndex;  // Longest prefix match over rules, maps an address to its position + 1
+    bool acknowledged;  // Whether the controller sent the ACK
+    uint64_t adds;  // ADD packets received so far
+    int64_t addTraceId;  // Trace fields of the latest ADD
+    int64_t addSentNs;
+    int64_t addReceivedNs;
+} FlowSnapshot;
+
+/**
+ * A destination range inserted into the destination index, or relabelled if from is not 0
+ */
+typedef struct {
+    uint32_t low;
+    uint32_t high;
+    uint32_t value;
+    uint32_t from;
+} IndexUpdate;
+
+/**
+ * State shared by the control thread and the data-plane thread
+ */
+typedef struct {
+    atomic<FlowSnapshot *> published;  // Current flow table, only replaced by the control thread
+    atomic<uint64_t> quiescentEpoch;  // Newest epoch the data plane switched to
+    atomic<bool> stop;
+    atomic<bool> sleeping;  // The data plane waits for an event and must be woken to see changes
+    atomic<bool> trafficDone;  // The data plane consumed all of the traffic
+    int wakeFd;  // eventfd that wakes the data plane
+    string trafficSource;
+    LpmTable replicas[2];  // The destination index of the published table and its standby copy
+    RuleCounters ruleCounts;
+    SwitchPacketCounts counts;
+    IngressQueue dataQueue;
+} SwitchShared;
+
+/**
+ * State owned by the data-plane thread
+ */
+typedef struct {
+    int id;
+    int controllerFd;
+    int numPorts;  // Ports leading to neighbours, numbered from 1. The local port follows them.
+    vector<int> portToFd;  // Relay FIFO of each port, -1 until it is opened
+    vector<int> portToId;  // Switch on each port, -1 for ports without a neighbour
+    vector<bool> closed;  // Ports whose neighbour closed its FIFO
+    int nextPort;  // Port read first by the next poll, so that a full data queue favours none
+    uint64_t queries;  // QUERY packets sent, which the controller answers in order with an ADD each
+    deque<WaitingRelay> waitingRelays;
+    RelayBatch relays;
+    vector<bool> relayBlocked;  // Ports whose FIFO was full, written again once a poll finds room
+    TraceBuffer trace;
+    IoBackend io;
+    Uring ring;  // Reads neighbours and writes relays if io is IO_BACKEND_URING
+    bool readMultishot;  // Whether the kernel reads a FIFO into buffers until it is closed
+    vector<string> sending;  // Relays being written by io_uring per port, empty if none is
+    uint64_t countedEnters;  // io_uring_enter() calls already added to the syscall count
+    bool trafficArmed;  // io_uring: a poll of the live traffic source is in flight
+    bool timerArmed;  // io_uring: a timeout that ends a delay or a pacing wait is in flight
+    int64_t timerDueNs;  // When the latest of them expires
+    __kernel_timespec timer;
+} DataPlane;
+
+/**
+ * Adds to a counter. Only the thread that owns the counter may call this.
+ */
+void bump(StatCounter &counter, uint64_t amount = 1) {
+  counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+/**
+ * Raises a counter to value if it is lower. Only the thread that owns the counter may call this.
+ */
+void raiseTo(StatCounter &counter, uint64_t value) {
+  if (value > counter.load(memory_order_relaxed)) counter.store(value, memory_order_relaxed);
+}
+
+/**
+ * Reads a counter for display.
+ */
+unsigned long stat(StatCounter &counter) {
+  return (unsigned long) counter.load(memory_order_relaxed);
+}
+
+/**
+ * Returns the packet counter in a slot.
+ */
+StatCounter &ruleCounter(RuleCounters &counters, size_t slot) {
+  return counters.chunks[slot / RULE_COUNTER_CHUNK][slot % RULE_COUNTER_CHUNK];
+}
+
+/**
+ * Returns the packets matched by a rule, including those of the rules merged into it.
+ */
+uint64_t rulePackets(RuleCounters &counters, const FlowRule &rule) {
+  return stat(ruleCounter(counters, rule.counter)) + counters.carried[rule.counter];
+}
+
 /**
  * Determines whether the switch is still delayed
  * Attribution:
@@ -71,11 +281,21 @@ bool isDelayed(long startTime, int duration) {
 }
 
 /**
- * Sends an OPEN packet to the controller.
+ * Returns the milliseconds left of a delay period, or 0 if it is over.
+ */
+long delayRemainingMs(long startTime, int duration) {
+  milliseconds currentTime = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
+  return max(startTime + duration - currentTime.count(), 0L);
+}
+
+/**
+ * Sends an OPEN packet to the controller. The switch's range is followed by the neighbour on each
+ * of its ports, -1 for a port without one.
  */
-void sendOpenPacket(int fd, int id, int port1Id, int port2Id, int ipLow, int ipHigh) {
-  string openString = "OPEN:" + to_string(id) + "," + to_string(port1Id) + "," + to_string(port2Id)
-                      + "," + to_string(ipLow) + "," + to_string(ipHigh);
+void sendOpenPacket(int fd, int id, vector<int> &neighbours, uint32_t ipLow, uint32_t ipHigh) {
+  string openString = "OPEN:" + to_string(id) + "," + to_string(ipLow) + "," + to_string(ipHigh);
+  for (int neighbour : neighbours) openString += "," + to_string(neighbour);
+  openString += PACKET_DELIMITER;
   write(fd, openString.c_str(), strlen(openString.c_str()));
   if (errno) {
     perror("write() failure");
@@ -85,15 +305,30 @@ void sendOpenPacket(int fd, int id, int port1Id, int port2Id, int ipLow, int ipH
   // Log the successful transmission
   string direction = "Transmitted";
   string type = "OPEN";
-  pair<string, vector<int>> parsedPacket = parsePacketString(openString);
+  pair<string, vector<int64_t>> parsedPacket = parsePacketString(openString);
   printPacketMessage(direction, id, 0, type, parsedPacket.second);
 }
 
 /**
- * Send a QUERY packet to the controller.
+ * Appends the trace ID and send time of a traced packet to its message. Returns the send time, or 0
+ * if the packet is not traced.
  */
-void sendQueryPacket(int fd, int srcId, int destId, int srcIp, int destIp) {
+int64_t appendTraceFields(string &packetString, int64_t traceId) {
+  if (!traceId) return 0;
+
+  int64_t sentNs = monotonicNs();
+  packetString += "," + to_string(traceId) + "," + to_string(sentNs);
+  return sentNs;
+}
+
+/**
+ * Send a QUERY packet to the controller. Returns the send time of a traced packet.
+ */
+int64_t sendQueryPacket(int fd, int srcId, int destId, uint32_t srcIp, uint32_t destIp,
+                        int64_t traceId) {
   string queryString = "QUERY:" + to_string(srcIp) + "," + to_string(destIp);
+  int64_t sentNs = appendTraceFields(queryString, traceId);
+  queryString += PACKET_DELIMITER;
   write(fd, queryString.c_str(), strlen(queryString.c_str()));
   if (errno) {
     perror("write() failure");
@@ -103,26 +338,86 @@ void sendQueryPacket(int fd, int srcId, int destId, int srcIp, int destIp) {
   // Log the successful transmission
   string direction = "Transmitted";
   string type = "QUERY";
-  pair<string, vector<int>> parsedPacket = parsePacketString(queryString);
+  pair<string, vector<int64_t>> parsedPacket = parsePacketString(queryString);
   printPacketMessage(direction, srcId, destId, type, parsedPacket.second);
+
+  return sentNs;
 }
 
 /**
- * Send a relay packet to another switch.
+ * Queue a relay packet to another switch. Relays are grouped by outgoing port and written out
+ * together by flushRelayPackets(). A traced packet is stamped when it is queued, so the wait for
+ * the rest of the batch counts towards the next hop's link time.
  */
-void sendRelayPacket(int fd, int srcId, int destId, int srcIp, int destIp) {
+int64_t queueRelayPacket(RelayBatch &batch, int port, int srcId, int destId, uint32_t srcIp,
+                         uint32_t destIp, int64_t traceId) {
   string relayString = "RELAY:" + to_string(srcIp) + "," + to_string(destIp);
-  write(fd, relayString.c_str(), strlen(relayString.c_str()));
-  if (errno) {
-    perror("write() failure");
-    exit(errno);
-  }
+  int64_t sentNs = appendTraceFields(relayString, traceId);
+  relayString += PACKET_DELIMITER;
+  if (batch.data[port].empty()) batch.ports.push_back(port);
+  batch.data[port] += relayString;
 
-  // Log the successful transmission
+  // Log the queued transmission
   string direction = "Transmitted";
   string type = "RELAY";
-  pair<string, vector<int>> parsedPacket = parsePacketString(relayString);
+  pair<string, vector<int64_t>> parsedPacket = parsePacketString(relayString);
   printPacketMessage(direction, srcId, destId, type, parsedPacket.second);
+
+  return sentNs;
+}
+
+/**
+ * Write all queued relay packets with a single write per outgoing port. A batch can be larger than
+ * PIPE_BUF, so the FIFO may take only part of it: the rest stays queued, and the port is blocked
+ * until a poll finds room for it, so that no packet is cut short. With io_uring the writes are
+ * only prepared, and a port whose previous write is still in flight keeps its relays queued so
+ * that they are written in order.
+ */
+void flushRelayPackets(DataPlane &plane, SwitchPacketCounts &counts) {
+  size_t kept = 0;
+  for (int port : plane.relays.ports) {
+    string &data = plane.relays.data[port];
+    if (plane.io != IO_BACKEND_URING) {
+      if (plane.relayBlocked[port]) {
+        plane.relays.ports[kept++] = port;
+        continue;
+      }
+      ssize_t written = write(plane.portToFd[port], data.c_str(), data.length());
+      bump(counts.syscalls);
+      if (written < 0 && errno != EAGAIN) {
+        perror("write() failure");
+        exit(errno);
+      }
+      errno = 0;
+      if (written < (ssize_t) data.length()) {
+        data.erase(0, written < 0 ? 0 : (size_t) written);
+        plane.relayBlocked[port] = true;
+        plane.relays.ports[kept++] = port;
+        continue;
+      }
+    } else if (plane.sending[port].empty()) {
+      string &sending = plane.sending[port];
+      sending.swap(data);
+      uringPrepWrite(plane.ring, IORING_OP_WRITE, plane.portToFd[port], sending.c_str(),
+                     sending.length(), ((uint64_t) URING_WRITE << 32) | (uint32_t) port);
+    } else {
+      plane.relays.ports[kept++] = port;
+      continue;
+    }
+    data.clear();
+  }
+  plane.relays.ports.resize(kept);
+}
+
+/**
+ * Returns whether relays are queued for a port that can take them, in which case the data plane
+ * must not sleep.
+ */
+bool relaysReady(DataPlane &plane) {
+  for (int port : plane.relays.ports) {
+    if (!plane.relayBlocked[port]) return true;
+  }
+  return false;
 }
 
 /**
@@ -155,23 +450,48 @@ int createFifo(int src, int dest, int flag) {
 }
 
 /**
- * Parses a line in the traffic file.
+ * Clears O_NONBLOCK on a FIFO, so that io_uring waits for it instead of failing with EAGAIN.
+ */
+void clearNonBlocking(int fd) {
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+    perror("fnctl() failure");
+    exit(errno);
+  }
+}
+
+/**
+ * Opens the FIFO used to relay packets out of a port if it is not open already.
+ */
+void openRelayFifo(DataPlane &plane, int port) {
+  if (plane.portToFd[port] < 0) {
+    string relayFifo = makeFifoName(plane.id, plane.portToId[port]);
+    int portFd = openFifo(relayFifo, O_WRONLY | O_NONBLOCK);
+    if (plane.io == IO_BACKEND_URING) clearNonBlocking(portFd);
+    plane.portToFd[port] = portFd;
+  }
+}
+
+/**
+ * Parses a line in the traffic file. Besides packet and delay lines, a switch may be given a
+ * target rate for the lines that follow ("swN rate <packets per second>", 0 for no pacing), and a
+ * packet line may end with the time at which it is admitted ("@<milliseconds>", counted from the
+ * first packet line of the switch). The timestamp is returned in nanoseconds.
  * Attribution:
  * https://stackoverflow.com/a/237280
  * By: https://stackoverflow.com/users/30767/zunino
  */
-pair<string, vector<int>> parseTrafficFileLine(string &line) {
+pair<string, vector<int64_t>> parseTrafficFileLine(string &line) {
   string type;
-  vector<int> content;
+  vector<int64_t> content;
 
   int id = 0;
-  int srcIp = 0;
-  int destIp = 0;
+  uint32_t srcIp = 0;
+  uint32_t destIp = 0;
 
   istringstream iss(line);
   vector<string> tokens{istream_iterator<string>{iss}, istream_iterator<string>{}};
 
-  if (line.length() < 1) {
+  if (tokens.empty()) {
     type = "empty";
   } else if (line.substr(0, 1) == "#") {
     type = "comment";
@@ -179,36 +499,59 @@ pair<string, vector<int>> parseTrafficFileLine(string &line) {
     id = parseSwitchId(tokens[0]);
     content.push_back(id);
 
-    if (tokens[1] == "delay") {
+    // Live sources feed arbitrary lines, so every token is checked before it is read
+    if (tokens.size() > 1 && tokens[1] == "delay") {
       type = "delay";
-      int ms = (int) strtol(tokens[2].c_str(), (char **) nullptr, 10);
-      if (ms < 0 || errno) {
+      char *end = nullptr;
+      errno = 0;
+      long ms = tokens.size() < 3 ? -1 : strtol(tokens[2].c_str(), &end, 10);
+      if (ms < 0 || ms > INT_MAX || *end != '\0' || errno) {
         type = "error";
         printf("Error: Invalid delay. Skipping line.\n");
         errno = 0;
       } else {
         content.push_back(ms);
       }
+    } else if (tokens.size() > 1 && tokens[1] == "rate") {
+      type = "rate";
+      char *end = nullptr;
+      errno = 0;
+      long pps = tokens.size() < 3 ? -1 : strtol(tokens[2].c_str(), &end, 10);
+      if (pps < 0 || *end != '\0' || errno) {
+        type = "error";
+        printf("Error: Invalid rate. Skipping line.\n");
+        errno = 0;
+      } else {
+        content.push_back(pps);
+      }
     } else {
       type = "action";
 
-      srcIp = (int) strtol(tokens[1].c_str(), (char **) nullptr, 10);
-      if (srcIp < 0 || srcIp > MAX_IP || errno) {
+      if (tokens.size() < 3 || !parseIp(tokens[1], srcIp)) {
         type = "error";
-        printf("Error: Invalid IP lower bound.\n");
-        errno = 0;
+        printf("Error: Invalid source IP. Skipping line.\n");
       } else {
         content.push_back(srcIp);
       }
 
-      destIp = (int) strtol(tokens[2].c_str(), (char **) nullptr, 10);
-      if (destIp < 0 || destIp > MAX_IP || errno) {
+      if (tokens.size() < 3 || !parseIp(tokens[2], destIp)) {
         type = "error";
-        printf("Error: Invalid IP lower bound.\n");
-        errno = 0;
+        printf("Error: Invalid destination IP. Skipping line.\n");
       } else {
         content.push_back(destIp);
       }
+
+      if (tokens.size() > 3 && tokens[3][0] == '@') {
+        char *end = nullptr;
+        double ms = strtod(tokens[3].c_str() + 1, &end);
+        if (*end != '\0' || end == tokens[3].c_str() + 1 || ms < 0 || errno) {
+          type = "error";
+          printf("Error: Invalid timestamp. Skipping line.\n");
+          errno = 0;
+        } else {
+          content.push_back((int64_t) (ms * 1e6));
+        }
+      }
     }
   }
 
@@ -216,48 +559,986 @@ pair<string, vector<int>> parseTrafficFileLine(string &line) {
 }
 
 /**
- * List the status information of the switch.
+ * Export the counters of rules that matched packets since they were last exported. At most
+ * maxRecords rules are exported per interval; a truncated export resumes where it stopped on the
+ * next interval so that every rule is eventually reported.
+ */
+void exportFlowTable(FlowExporter &exporter, vector<FlowRule> &flowTable, RuleCounters &counters,
+                     long nowMs) {
+  exporter.lastCounts.resize(counters.used, 0);
+
+  vector<FlowExportRecord> records;
+  size_t scanned = 0;
+  size_t i = exporter.cursor < flowTable.size() ? exporter.cursor : 0;
+  while (scanned < flowTable.size() && records.size() < exporter.maxRecords) {
+    FlowRule &rule = flowTable[i];
+    uint64_t pktCount = rulePackets(counters, rule);
+    uint64_t &lastCount = exporter.lastCounts[rule.counter];
+    if (pktCount != lastCount) {
+      records.push_back({(uint32_t) i, rule.destIpLow, rule.destIpHigh,
+                         (uint8_t) (rule.actionType == "FORWARD"), (uint8_t) rule.actionVal, 0,
+                         pktCount, pktCount - lastCount});
+      lastCount = pktCount;
+    }
+
+    scanned++;
+    i = (i + 1) % flowTable.size();
+  }
+  exporter.cursor = i;
+
+  sendFlowRecords(exporter, records, nowMs);
+}
+
+/**
+ * Queue packets read from a port.
+ */
+void enqueueIngress(IngressQueue &queue, int port, vector<string> packets) {
+  int64_t nowNs = monotonicNs();
+  for (auto &packet : packets) queue.packets.push_back({port, packet, nowNs});
+  queue.depth.store(queue.packets.size(), memory_order_relaxed);
+  raiseTo(queue.maxDepth, queue.packets.size());
+}
+
+/**
+ * Move up to weight packets from the front of a queue to the list of packets to handle.
+ */
+void dequeueIngress(IngressQueue &queue, int weight, vector<IngressPacket> &scheduled) {
+  int64_t nowNs = monotonicNs();
+  for (int n = 0; n < weight && !queue.packets.empty(); n++) {
+    auto waitNs = (uint64_t) (nowNs - queue.packets.front().queuedNs);
+    bump(queue.totalWaitNs, waitNs);
+    raiseTo(queue.maxWaitNs, waitNs);
+    bump(queue.handled);
+
+    scheduled.push_back(queue.packets.front());
+    queue.packets.pop_front();
+  }
+  queue.depth.store(queue.packets.size(), memory_order_relaxed);
+}
+
+/**
+ * Print the depth and waiting time statistics of an ingress queue.
  */
-void switchList(vector<FlowRule> &flowTable, SwitchPacketCounts &counts) {
+void printIngressQueue(const char *name, IngressQueue &queue, int weight) {
+  unsigned long handled = stat(queue.handled);
+  printf("\t%-12s weight= %i, depth= %lu (max %lu), handled= %lu, wait= %.1f us (max %.1f us)\n",
+         name, weight, stat(queue.depth), stat(queue.maxDepth), handled,
+         handled ? (double) stat(queue.totalWaitNs) / (double) handled / 1e3 : 0.0,
+         (double) stat(queue.maxWaitNs) / 1e3);
+}
+
+/**
+ * List the status information of the switch. Runs on the control thread, which owns the published
+ * flow table, so the data plane keeps forwarding while a large table is printed.
+ */
+void switchList(SwitchShared &shared, SwitchOptions &options, FlowExporter &exporter,
+                IngressQueue &controlQueue) {
+  FlowSnapshot *table = shared.published.load(memory_order_relaxed);
+  SwitchPacketCounts &counts = shared.counts;
+
   printf("Flow table:\n");
   int i = 0;
-  for (auto &rule : flowTable) {
-    printf("[%i] (srcIp= %i-%i, destIp= %i-%i, ", i, rule.srcIpLow,
-           rule.srcIpHigh, rule.destIpLow, rule.destIpHigh);
-    printf("action= %s:%i, pri= %i, pktCount= %i)\n", rule.actionType.c_str(),
-           rule.actionVal, rule.pri, rule.pktCount);
+  for (auto &rule : table->rules) {
+    printf("[%i] (srcIp= %s, destIp= %s, ", i,
+           formatIpRange(rule.srcIpLow, rule.srcIpHigh).c_str(),
+           formatIpRange(rule.destIpLow, rule.destIpHigh).c_str());
+    printf("action= %s:%i, pri= %i, pktCount= %lu)\n", rule.actionType.c_str(),
+           rule.actionVal, rule.pri, (unsigned long) rulePackets(shared.ruleCounts, rule));
     i++;
   }
   printf("\n");
   printf("Packet Stats:\n");
-  printf("\tReceived:    ADMIT:%i, ACK:%i, ADDRULE:%i, RELAYIN:%i\n", counts.admit, counts.ack,
-         counts.add, counts.relayIn);
-  printf("\tTransmitted: OPEN:%i, QUERY:%i, RELAYOUT:%i\n", counts.open, counts.query,
-         counts.relayOut);
+  printf("\tReceived:    ADMIT:%lu, ACK:%lu, ADDRULE:%lu, RELAYIN:%lu\n", stat(counts.admit),
+         stat(counts.ack), stat(counts.add), stat(counts.relayIn));
+  printf("\tTransmitted: OPEN:%lu, QUERY:%lu, RELAYOUT:%lu\n", stat(counts.open),
+         stat(counts.query), stat(counts.relayOut));
+  printf("\tAdmission:   batch= %i, budget= %li us, pkts/iter= %.2f (max %lu)\n",
+         options.batchSize, options.batchBudgetUs,
+         stat(counts.admitIterations) ?
+         (double) stat(counts.admit) / (double) stat(counts.admitIterations) : 0.0,
+         stat(counts.maxBatch));
+  printIngressQueue("Control:", controlQueue, options.controlWeight);
+  printIngressQueue("Data:", shared.dataQueue, options.dataWeight);
+  printf("\tFlow table:  epoch= %lu\n", (unsigned long) table->epoch);
+  unsigned long compacted = stat(counts.rulesMerged) + stat(counts.rulesShadowed);
+  printf("\tCompaction:  rules= %zu (%lu before compaction, merged= %lu, shadowed= %lu)\n",
+         table->rules.size(), (unsigned long) table->rules.size() + compacted,
+         stat(counts.rulesMerged), stat(counts.rulesShadowed));
+  uint64_t packets = stat(counts.admit) + stat(counts.relayIn);
+  printf("\tI/O:         backend= %s, data-plane syscalls= %lu (%.3f per packet), sleeps= %lu\n",
+         ioBackendName(options.io).c_str(), stat(counts.syscalls),
+         packets ? (double) stat(counts.syscalls) / packets : 0.0, stat(counts.sleeps));
+  printf("\tTraffic:     source= %s, bytes read= %lu, lines too long= %lu\n",
+         shared.trafficSource.c_str(), stat(counts.trafficBytes), stat(counts.trafficDropped));
+  uint64_t paced = stat(counts.pacedPackets);
+  printf("\tPacing:      speed= %.2fx, paced= %lu, requested= %.1f pkt/s, achieved= %.1f pkt/s, "
+         "max lag= %.1f us\n", options.speed, (unsigned long) paced,
+         pacedRate(paced, (int64_t) stat(counts.pacedScheduledNs)),
+         pacedRate(paced, (int64_t) stat(counts.pacedElapsedNs)),
+         (double) stat(counts.maxPacingLagNs) / 1000.0);
+  if (exporter.fd >= 0) {
+    printf("\tFlow export: %s every %li ms, datagrams= %i, dropped= %i\n",
+           options.exportPath.c_str(), options.exportIntervalMs, exporter.datagrams,
+           exporter.dropped);
+  }
+}
+
+/**
+ * Stats published to the switch's shared-memory segment, in the order of switchStatValues()
+ */
+vector<StatDefinition> switchStatDefinitions() {
+  return {{"admit", STAT_COUNTER}, {"relay_in", STAT_COUNTER}, {"relay_out", STAT_COUNTER},
+          {"query", STAT_COUNTER}, {"ack", STAT_COUNTER}, {"add", STAT_COUNTER},
+          {"syscalls", STAT_COUNTER}, {"rules", STAT_GAUGE}, {"data_queue", STAT_GAUGE},
+          {"control_queue", STAT_GAUGE}};
+}
+
+/**
+ * Current values of the switch's published stats.
+ */
+vector<uint64_t> switchStatValues(SwitchShared &shared, IngressQueue &controlQueue) {
+  SwitchPacketCounts &counts = shared.counts;
+  return {stat(counts.admit), stat(counts.relayIn), stat(counts.relayOut), stat(counts.query),
+          stat(counts.ack), stat(counts.add), stat(counts.syscalls),
+          shared.published.load(memory_order_relaxed)->rules.size(),
+          stat(shared.dataQueue.depth), stat(controlQueue.depth)};
+}
+
+/**
+ * Wakes the data-plane thread if it sleeps, so that it sees a new flow table or the request to
+ * stop. Costs nothing while the data plane is busy.
+ */
+void wakeDataPlane(SwitchShared &shared) {
+  if (!shared.sleeping.load(memory_order_seq_cst)) return;
+
+  uint64_t one = 1;
+  if (write(shared.wakeFd, &one, sizeof(one)) < 0) errno = 0;  // A wake-up is pending already
+}
+
+/**
+ * Announces that the data plane is about to sleep. Returns false if the control thread published
+ * a flow table or asked it to stop since the data plane last looked, in which case it must not
+ * sleep: the control thread may have checked before the announcement and not woken it.
+ */
+bool prepareSleep(SwitchShared &shared, FlowSnapshot *table) {
+  shared.sleeping.store(true, memory_order_seq_cst);
+  if (shared.published.load(memory_order_seq_cst) == table &&
+      !shared.stop.load(memory_order_seq_cst)) {
+    bump(shared.counts.sleeps);
+    return true;
+  }
+
+  shared.sleeping.store(false, memory_order_relaxed);
+  return false;
+}
+
+/**
+ * Returns the replica of the destination index that the published flow table does not use.
+ */
+LpmTable *standbyIndex(SwitchShared &shared, FlowSnapshot *table) {
+  return table->destIndex == &shared.replicas[0] ? &shared.replicas[1] : &shared.replicas[0];
+}
+
+/**
+ * Inserts a destination range into the standby index and records it for the other replica.
+ */
+void updateIndex(FlowSnapshot &next, vector<IndexUpdate> &updates, uint32_t low, uint32_t high,
+                 uint32_t value) {
+  lpmInsertRange(*next.destIndex, low, high, value);
+  updates.push_back({low, high, value, 0});
+}
+
+/**
+ * Gives the addresses of a range that the standby index maps to one rule to another rule, and
+ * records it for the other replica.
+ */
+void relabelIndex(FlowSnapshot &next, vector<IndexUpdate> &updates, uint32_t low, uint32_t high,
+                  uint32_t from, uint32_t to) {
+  lpmReplaceValue(*next.destIndex, low, high, from, to);
+  updates.push_back({low, high, to, from});
+}
+
+/**
+ * Publishes a new flow table to the data plane. Once the data plane has moved to it, nothing reads
+ * the previous table any more: it is freed and its index replica catches up on the updates so
+ * that it can serve as the standby for the next table.
+ */
+void publishFlowTable(SwitchShared &shared, FlowSnapshot *next, vector<IndexUpdate> &updates) {
+  FlowSnapshot *previous = shared.published.load(memory_order_relaxed);
+  next->epoch = previous->epoch + 1;
+
+  for (size_t chunk = 0; chunk * RULE_COUNTER_CHUNK < shared.ruleCounts.used; chunk++) {
+    if (!shared.ruleCounts.chunks[chunk]) {
+      shared.ruleCounts.chunks[chunk] = new StatCounter[RULE_COUNTER_CHUNK]();
+    }
+  }
+
+  shared.published.store(next, memory_order_seq_cst);
+  wakeDataPlane(shared);
+
+  // Wait for the data plane to finish its current loop iteration
+  while (shared.quiescentEpoch.load(memory_order_acquire) < next->epoch) {
+    this_thread::sleep_for(microseconds(GRACE_POLL_US));
+  }
+
+  for (auto &update : updates) {
+    if (update.from) {
+      lpmReplaceValue(*previous->destIndex, update.low, update.high, update.from, update.value);
+    } else {
+      lpmInsertRange(*previous->destIndex, update.low, update.high, update.value);
+    }
+  }
+  delete previous;
+}
+
+/**
+ * Carries the packet counts of the rules removed from the previous flow table over to the rules
+ * that took over their addresses, and frees their counter slots. Must only be called once the
+ * data plane uses the table published after the removal, as the data plane may count packets of
+ * a removed rule until then.
+ */
+void carryRuleCounters(RuleCounters &counters, FlowExporter &exporter,
+                       vector<CounterMove> &moves) {
+  exporter.lastCounts.resize(counters.used, 0);
+
+  for (auto &move : moves) {
+    StatCounter &from = ruleCounter(counters, move.from);
+    if (move.to != NO_RULE_COUNTER) {
+      counters.carried[move.to] += stat(from) + counters.carried[move.from];
+      exporter.lastCounts[move.to] += exporter.lastCounts[move.from];
+    }
+
+    from.store(0, memory_order_relaxed);
+    counters.carried[move.from] = 0;
+    exporter.lastCounts[move.from] = 0;
+    counters.freeSlots.push_back(move.from);
+  }
+}
+
+/**
+ * Hands out a free counter slot. Returns NO_RULE_COUNTER if every slot is in use.
+ */
+uint32_t allocRuleCounter(RuleCounters &counters) {
+  if (!counters.freeSlots.empty()) {
+    uint32_t slot = counters.freeSlots.back();
+    counters.freeSlots.pop_back();
+    return slot;
+  }
+
+  if (counters.used >= (uint32_t) RULE_COUNTER_CHUNK * MAX_RULE_COUNTER_CHUNKS) {
+    return NO_RULE_COUNTER;
+  }
+  counters.carried.push_back(0);
+  return counters.used++;
+}
+
+/**
+ * Removes rules from a flow table that is not published yet. The last rule takes the place of
+ * each removed rule, so only the index entries of that one rule have to be relabelled.
+ */
+void removeFlowRules(FlowSnapshot &next, vector<IndexUpdate> &updates,
+                     vector<uint32_t> &removed) {
+  sort(removed.rbegin(), removed.rend());
+  for (uint32_t position : removed) {
+    auto last = (uint32_t) next.rules.size() - 1;
+    if (position != last) {
+      FlowRule &moved = next.rules[last];
+      relabelIndex(next, updates, moved.destIpLow, moved.destIpHigh, last + 1, position + 1);
+      next.rules[position] = moved;
+    }
+    next.rules.pop_back();
+  }
+}
+
+/**
+ * Installs the rule carried by an ADD packet into a flow table that is not published yet, and
+ * compacts the rules around it. A rule that overlaps or touches a rule with the same action grows
+ * that rule instead, which then absorbs the other rules of the same action next to it. Rules left
+ * without a single address in the destination index can never match and are removed. The index
+ * decides every match, so relabelling its entries keeps the behaviour of the table unchanged.
+ */
+void installFlowRule(SwitchShared &shared, FlowSnapshot &next, vector<IndexUpdate> &updates,
+                     vector<CounterMove> &moves, vector<int64_t> &msg) {
+  FlowRule newRule;
+
+  if (msg[0] == 0) {
+    newRule = {0, IP_MAX, (uint32_t) msg[1], (uint32_t) msg[2], "DROP", (int) msg[3], MIN_PRI,
+               NO_RULE_COUNTER};
+  } else if (msg[0] == 1) {
+    newRule = {0, IP_MAX, (uint32_t) msg[1], (uint32_t) msg[2], "FORWARD", (int) msg[3], MIN_PRI,
+               NO_RULE_COUNTER};
+  } else {
+    printf("Error: Invalid rule to add.\n");
+    return;
+  }
+
+  // Rules that own addresses in or right next to the new range, and so overlap or touch it
+  uint32_t low = newRule.destIpLow;
+  uint32_t high = newRule.destIpHigh;
+  vector<uint32_t> around;
+  lpmCollectValues(*next.destIndex, low > 0 ? low - 1 : low, high < IP_MAX ? high + 1 : high,
+                   around);
+
+  int target = -1;
+  for (uint32_t value : around) {
+    FlowRule &rule = next.rules[value - 1];
+    if (rule.actionType == newRule.actionType && rule.actionVal == newRule.actionVal) {
+      target = (int) value - 1;
+      break;
+    }
+  }
+
+  bool added = target < 0;
+  if (added) {
+    newRule.counter = allocRuleCounter(shared.ruleCounts);
+    if (newRule.counter == NO_RULE_COUNTER) {
+      printf("Error: Flow table full. Rule not added.\n");
+      return;
+    }
+    next.rules.push_back(newRule);
+    target = (int) next.rules.size() - 1;
+  } else {
+    bump(shared.counts.rulesMerged);
+  }
+
+  FlowRule &grown = next.rules[target];
+  grown.destIpLow = min(grown.destIpLow, low);
+  grown.destIpHigh = max(grown.destIpHigh, high);
+  updateIndex(next, updates, low, high, (uint32_t) target + 1);
+
+  vector<uint32_t> removed;
+  for (uint32_t value : around) {
+    FlowRule &rule = next.rules[value - 1];
+    if ((int) value - 1 == target) continue;
+
+    if (rule.actionType == grown.actionType && rule.actionVal == grown.actionVal) {
+      // The union of two ranges that touch is a range
+      relabelIndex(next, updates, rule.destIpLow, rule.destIpHigh, value, (uint32_t) target + 1);
+      grown.destIpLow = min(grown.destIpLow, rule.destIpLow);
+      grown.destIpHigh = max(grown.destIpHigh, rule.destIpHigh);
+      bump(shared.counts.rulesMerged);
+    } else if (!lpmContainsValue(*next.destIndex, rule.destIpLow, rule.destIpHigh, value)) {
+      // Every address of the rule went to the more specific new rule
+      bump(shared.counts.rulesShadowed);
+    } else {
+      continue;
+    }
+
+    moves.push_back({rule.counter, grown.counter});
+    removed.push_back(value - 1);
+  }
+
+  // More specific rules may already own every address of the new rule
+  if (added && !lpmContainsValue(*next.destIndex, low, high, (uint32_t) target + 1)) {
+    moves.push_back({grown.counter, NO_RULE_COUNTER});
+    removed.push_back((uint32_t) target);
+    bump(shared.counts.rulesShadowed);
+  }
+
+  removeFlowRules(next, updates, removed);
 }
 
 /**
- * Main event loop for the switch. Polls all FDs. Sends and receives packets of varying types to
- * communicate within the SDN.
+ * Applies the matching rule of the flow table to a packet of this switch. Returns false if no
+ * rule matches.
  */
-void switchLoop(int id, int port1Id, int port2Id, int ipLow, int ipHigh, ifstream &in,
-                string &ipAdress, uint16_t portNumber) {
-  vector<FlowRule> flowTable; // Flow rule table
-  flowTable.push_back({0, MAX_IP, ipLow, ipHigh, "FORWARD", 3, MIN_PRI, 0}); // Add initial rule
+bool applyFlowRule(DataPlane &plane, SwitchShared &shared, FlowSnapshot &table, uint32_t srcIp,
+                   uint32_t destIp, int64_t traceId, int64_t sentNs, int64_t ingressNs,
+                   TraceKind forwardKind) {
+  uint32_t match = lpmLookup(*table.destIndex, destIp);
+  if (!match) return false;
+
+  const FlowRule &rule = table.rules[match - 1];
+  bump(ruleCounter(shared.ruleCounts, rule.counter));
+  int port = rule.actionVal;
+  if (rule.actionType == "FORWARD" && port != plane.numPorts + 1) {
+    // Ensure the port leads to a switch that is not closed before sending
+    if (port >= 1 && port <= plane.numPorts && plane.portToId[port] != -1 && !plane.closed[port]) {
+      // Open the FIFO for writing if not done already
+      openRelayFifo(plane, port);
+
+      int64_t relaySentNs = queueRelayPacket(plane.relays, port, plane.id, plane.portToId[port],
+                                             srcIp, destIp, traceId);
+      traceHop(plane.trace, traceId, sentNs, ingressNs, relaySentNs, forwardKind);
+    }
+
+    bump(shared.counts.relayOut);
+  } else {
+    traceHop(plane.trace, traceId, sentNs, ingressNs, monotonicNs(),
+             rule.actionType == "FORWARD" ? TRACE_DELIVER : TRACE_DROP);
+  }
+
+  return true;
+}
+
+/**
+ * Forwards a packet relayed by a neighbour by the flow table, as packets admitted from traffic
+ * are. A packet that misses the table waits for the controller's rule while the data plane carries
+ * on. Only one QUERY for relays is outstanding at a time: the controller answers with a rule for a
+ * whole range, which the relays that missed meanwhile are likely to fall in.
+ */
+void forwardRelay(DataPlane &plane, SwitchShared &shared, FlowSnapshot &table, WaitingRelay relay) {
+  if (applyFlowRule(plane, shared, table, relay.srcIp, relay.destIp, relay.traceId, relay.sentNs,
+                    relay.ingressNs, TRACE_RELAY)) {
+    return;
+  }
+
+  if (!plane.waitingRelays.empty()) {
+    relay.answeredBy = plane.waitingRelays.back().answeredBy;
+  } else {
+    sendQueryPacket(plane.controllerFd, plane.id, 0, relay.srcIp, relay.destIp, 0);
+    bump(shared.counts.syscalls);
+    bump(shared.counts.query);
+    relay.answeredBy = ++plane.queries;
+  }
+  plane.waitingRelays.push_back(relay);
+}
 
-  map<int, int> portToFd; // Map port number to FD
-  map<int, int> portToId; // Map port number to switch ID
+/**
+ * Forwards the waiting relays once the controller answered their QUERY. Those that the new rule
+ * does not cover wait for another one.
+ */
+void forwardAnsweredRelays(DataPlane &plane, SwitchShared &shared, FlowSnapshot &table) {
+  deque<WaitingRelay> answered;
+  while (!plane.waitingRelays.empty() && table.adds >= plane.waitingRelays.front().answeredBy) {
+    answered.push_back(plane.waitingRelays.front());
+    plane.waitingRelays.pop_front();
+  }
 
-  // Counts the number of each type of packet seen
-  SwitchPacketCounts counts = {0, 0, 0, 0, 0, 0, 0};
+  for (auto &relay : answered) forwardRelay(plane, shared, table, relay);
+}
 
-  int socketIdx = PFDS_SIZE - 1;
+/**
+ * Reads the live traffic that is ready into the ring buffer of the traffic stream.
+ */
+void readTraffic(TrafficStream &in, SwitchPacketCounts &counts) {
+  bump(counts.trafficBytes, (uint64_t) fillTrafficStream(in));
+  bump(counts.syscalls);
+}
 
+/**
+ * Reads the incoming FIFOs and the live traffic source that poll() reports readable, and queues
+ * the neighbours' packets. Waits up to timeoutNs for one of them, or for the control thread to
+ * wake the data plane. ppoll() is used as pacing needs waits shorter than a millisecond.
+ */
+void pollDataPath(DataPlane &plane, SwitchShared &shared, SwitchOptions &options,
+                  vector<pollfd> &pfds, vector<string> &pending, TrafficStream &in,
+                  int64_t timeoutNs) {
   char buffer[MAX_BUFFER];
-  struct pollfd pfds[PFDS_SIZE];
 
-  // Set up STDIN for polling from
-  pfds[0].fd = STDIN_FILENO;
+  pfds[TRAFFIC_PFD].fd = trafficStreamFd(in);
+  pfds[TRAFFIC_PFD].events = POLLIN;
+
+  // The relay FIFOs that were full are watched for room after the neighbour ports
+  for (int port = 1; port <= plane.numPorts; port++) {
+    pfds[plane.numPorts + port].fd = plane.relayBlocked[port] ? plane.portToFd[port] : -1;
+    pfds[plane.numPorts + port].events = POLLOUT;
+  }
+
+  timespec timeout {(time_t) (timeoutNs / 1000000000), (long) (timeoutNs % 1000000000)};
+  bump(shared.counts.syscalls);
+  if (ppoll(pfds.data(), (nfds_t) pfds.size(), timeoutNs < 0 ? nullptr : &timeout, nullptr) == -1) {
+    perror("ppoll() failure");
+    exit(errno);
+  }
+  shared.sleeping.store(false, memory_order_relaxed);
+
+  pollfd &wake = pfds.back();
+  if (wake.revents & POLLIN) {
+    uint64_t wakeUps;
+    if (read(wake.fd, &wakeUps, sizeof(wakeUps)) < 0) errno = 0;
+    bump(shared.counts.syscalls);
+  }
+
+  if (pfds[TRAFFIC_PFD].revents & (POLLIN | POLLHUP | POLLERR)) readTraffic(in, shared.counts);
+
+  // A FIFO whose reader went away reports POLLERR, and the next write reports the error
+  for (int port = 1; port <= plane.numPorts; port++) {
+    if (pfds[plane.numPorts + port].revents & (POLLOUT | POLLERR)) plane.relayBlocked[port] = false;
+  }
+
+  // Start from a different port each time, so that none is left waiting whenever the queue fills
+  for (int n = 0; n < plane.numPorts; n++) {
+    if (shared.dataQueue.packets.size() >= (size_t) options.dataQueueMax) break;
+    int i = (plane.nextPort + n - 1) % plane.numPorts + 1;
+
+    // A neighbour that closed its end only reports POLLHUP, and reads as closed
+    if (pfds[i].revents & (POLLIN | POLLHUP)) {
+      ssize_t bytesRead = read(pfds[i].fd, buffer, MAX_BUFFER);
+      bump(shared.counts.syscalls);
+      if (!bytesRead) {
+        printf("Warning: Connection to sw%i closed.\n", plane.portToId[i]);
+        close(pfds[i].fd);
+        pfds[i].fd = -1;
+        plane.closed[i] = true;
+        continue;
+      } else if (bytesRead < 0) {
+        errno = 0; // Nothing to read yet
+        continue;
+      }
+
+      enqueueIngress(shared.dataQueue, i, extractPackets(pending[i], buffer, (size_t) bytesRead));
+    }
+  }
+  if (plane.numPorts) plane.nextPort = plane.nextPort % plane.numPorts + 1;
+}
+
+/**
+ * Starts reading an incoming FIFO into the provided buffers of the data plane's io_uring.
+ */
+void uringReadPort(DataPlane &plane, int port, int fd) {
+  uint64_t userData = ((uint64_t) URING_READ << 32) | (uint32_t) port;
+  if (plane.readMultishot) {
+    uringPrepReadMultishot(plane.ring, fd, userData);
+  } else {
+    uringPrepRead(plane.ring, fd, userData);
+  }
+}
+
+/**
+ * Submits the reads and relay writes prepared by the io_uring data path, if there are any.
+ * Completions are picked up without entering the kernel.
+ */
+void submitDataPath(DataPlane &plane, SwitchPacketCounts &counts) {
+  if (uringPending(plane.ring) && uringSubmit(plane.ring, 0) < 0) {
+    perror("io_uring_enter() failure");
+    exit(errno);
+  }
+  bump(counts.syscalls, plane.ring.enters - plane.countedEnters);
+  plane.countedEnters = plane.ring.enters;
+}
+
+/**
+ * Polls the live traffic source once more if no poll of it is in flight and its ring buffer has
+ * room. The source is read with a plain read() once it is ready.
+ */
+void armTrafficPoll(DataPlane &plane, TrafficStream &in) {
+  int fd = trafficStreamFd(in);
+  if (plane.trafficArmed || fd < 0) return;
+
+  uringPrepPoll(plane.ring, fd, (uint64_t) URING_TRAFFIC << 32);
+  plane.trafficArmed = true;
+}
+
+/**
+ * Handles the completions of the io_uring data path and queues the packets of the neighbours.
+ * Completions stay in the ring while the data queue is full, so once the provided buffers run out
+ * the neighbours' packets stay in their FIFOs. Waits up to timeoutNs for a completion if none is
+ * ready.
+ */
+void uringDataPath(DataPlane &plane, SwitchShared &shared, SwitchOptions &options,
+                   vector<pollfd> &pfds, vector<string> &pending, TrafficStream &in,
+                   int64_t timeoutNs) {
+  Uring &ring = plane.ring;
+
+  armTrafficPoll(plane, in);
+  if (timeoutNs && !uringPeek(ring)) {
+    // A timer in flight that expires later than needed is left to complete on its own
+    int64_t nowNs = monotonicNs();
+    if (timeoutNs > 0 && (!plane.timerArmed || nowNs + timeoutNs < plane.timerDueNs)) {
+      plane.timer = {timeoutNs / 1000000000, timeoutNs % 1000000000};
+      uringPrepTimeout(ring, &plane.timer, (uint64_t) URING_TIMER << 32);
+      plane.timerArmed = true;
+      plane.timerDueNs = nowNs + timeoutNs;
+    }
+
+    if (uringSubmit(ring, 1) < 0) {
+      perror("io_uring_enter() failure");
+      exit(errno);
+    }
+    bump(shared.counts.syscalls, ring.enters - plane.countedEnters);
+    plane.countedEnters = ring.enters;
+  }
+  shared.sleeping.store(false, memory_order_relaxed);
+
+  io_uring_cqe *cqe;
+  while (shared.dataQueue.packets.size() < (size_t) options.dataQueueMax &&
+         (cqe = uringPeek(ring))) {
+    auto tag = (int) (cqe->user_data >> 32);
+    auto port = (int) (cqe->user_data & 0xFFFFFFFF);
+    int result = cqe->res;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (tag == URING_POLL) {
+      // The neighbour opened the FIFO, so from now on an empty read means it closed it again
+      uringReadPort(plane, port, pfds[port].fd);
+    } else if (tag == URING_READ) {
+      if (result > 0) {
+        enqueueIngress(shared.dataQueue, port,
+                       extractPackets(pending[port], uringBuffer(ring, cqe), (size_t) result));
+        uringRecycleBuffer(ring, cqe);
+      }
+
+      if (result == 0 || (result < 0 && result != -ENOBUFS)) {
+        printf("Warning: Connection to sw%i closed.\n", plane.portToId[port]);
+        close(pfds[port].fd);
+        pfds[port].fd = -1;
+        plane.closed[port] = true;
+      } else if (!more) {
+        // A single read finished, or the provided buffers ran out
+        uringReadPort(plane, port, pfds[port].fd);
+      }
+    } else if (tag == URING_WRITE) {
+      string &data = plane.sending[port];
+      if (result < 0) {
+        errno = -result;
+        perror("write() failure");
+        exit(errno);
+      } else if ((size_t) result < data.length()) {
+        // Write the rest of a partially written batch
+        data.erase(0, (size_t) result);
+        uringPrepWrite(ring, IORING_OP_WRITE, plane.portToFd[port], data.c_str(), data.length(),
+                       cqe->user_data);
+      } else {
+        data.clear();
+      }
+    } else if (tag == URING_TRAFFIC) {
+      plane.trafficArmed = false;
+      readTraffic(in, shared.counts);
+    } else if (tag == URING_WAKE) {
+      // The wake-up is left in the eventfd, as the multishot poll fires on every signal anyway
+      if (!more) uringPrepPollMultishot(ring, shared.wakeFd, cqe->user_data);
+    } else if (tag == URING_TIMER) {
+      if (monotonicNs() >= plane.timerDueNs) plane.timerArmed = false;
+    }
+
+    uringAdvance(ring);
+  }
+
+  armTrafficPoll(plane, in);
+
+  // Relays that waited for a write of their port to complete
+  flushRelayPackets(plane, shared.counts);
+  submitDataPath(plane, shared.counts);
+}
+
+/**
+ * Data-plane thread of the switch. Admits traffic, relays packets between neighbours and applies
+ * the flow table published by the control thread. Runs until the control thread sets stop.
+ */
+void dataPlaneLoop(DataPlane &plane, SwitchShared &shared, TrafficStream &in,
+                   SwitchOptions &options, vector<pollfd> &pfds) {
+  vector<string> pending(pfds.size()); // Partially received packets of each port
+  SwitchPacketCounts &counts = shared.counts;
+
+  // Used to keep track of the delay interval of the switch
+  long delayStartTime = 0;
+  int delayDuration = 0;
+
+  // Timestamps and rates of the traffic, and the packet line held back until the pacer lets it go
+  Pacer pacer;
+  initPacer(pacer, (double) options.ratePps, options.speed, options.batchSize);
+  bool holding = false;
+  pair<string, vector<int64_t>> held;
+  int64_t pacingWaitNs = 0;
+
+  // The packet that missed the flow table, waiting for the ADD that answers its QUERY
+  bool waiting = false;
+  uint64_t waitingAdds = 0;
+  uint32_t waitingSrcIp = 0;
+  uint32_t waitingDestIp = 0;
+  int64_t waitingTraceId = 0;
+
+  while (!shared.stop.load(memory_order_relaxed)) {
+    // Move to the newest flow table. The previous one may be freed once this is announced.
+    FlowSnapshot *table = shared.published.load(memory_order_acquire);
+    shared.quiescentEpoch.store(table->epoch, memory_order_release);
+
+    // Apply the new rules to the packets that waited for them
+    if (!plane.waitingRelays.empty()) forwardAnsweredRelays(plane, shared, *table);
+    if (waiting && table->adds >= waitingAdds) {
+      waiting = false;
+      int64_t traceId = table->addTraceId == waitingTraceId ? waitingTraceId : 0;
+      if (!applyFlowRule(plane, shared, *table, waitingSrcIp, waitingDestIp, traceId,
+                         table->addSentNs, table->addReceivedNs, TRACE_ADD)) {
+        printf("Warning: No rule for %s after ADD. Dropping.\n", formatIp(waitingDestIp).c_str());
+      }
+    }
+
+    /*
+     * 1. Read and process a batch of lines from the traffic (if its end has not been reached yet).
+     * The traffic stream only yields lines that name this switch; empty lines, comment lines and
+     * lines for other switches are skipped by the index, or as they are read from a live source. A
+     * packet header is considered admitted if the line specifies the current switch. Up to
+     * batchSize packets are admitted before polling again, unless the batch runs over its time
+     * budget, a QUERY has to wait for the controller, a delay starts or no line of a live source
+     * is buffered. A packet line is held back while the pacer says it is early. Relays produced by
+     * the batch are written together.
+     */
+    bool moreTraffic = false;  // The batch stopped early, so lines may be left to admit
+    pacingWaitNs = 0;
+    if (table->acknowledged && !waiting && !isDelayed(delayStartTime, delayDuration)) {
+      // Reset delay variables
+      delayStartTime = 0;
+      delayDuration = 0;
+
+      steady_clock::time_point batchStart = steady_clock::now();
+      int admitted = 0;
+
+      pair<string, vector<int64_t>> trafficInfo;
+      string line;
+      bool drained = false;
+      while (trafficStreamOpen(in) && admitted < options.batchSize && !waiting && !delayDuration) {
+        if (holding) {
+          trafficInfo = held;
+          holding = false;
+        } else if (nextTrafficLine(in, line)) {
+          trafficInfo = parseTrafficFileLine(line);
+        } else {
+          // A live source has no complete line buffered yet
+          drained = true;
+          if (!trafficStreamEnded(in)) break;
+
+          closeTrafficStream(in);
+          shared.trafficDone.store(true, memory_order_relaxed);
+          break;
+        }
+
+        string type = trafficInfo.first;
+        vector<int64_t> content = trafficInfo.second;
+
+        if (type == "action") {
+          int trafficId = content[0];
+          auto srcIp = (uint32_t) content[1];
+          auto destIp = (uint32_t) content[2];
+
+          if (plane.id == trafficId) {
+            int64_t timestampNs = content.size() > 3 ? content[3] : NO_TIMESTAMP;
+            pacingWaitNs = pacerDelayNs(pacer, timestampNs, monotonicNs());
+            if (pacingWaitNs) {
+              held = trafficInfo;
+              holding = true;
+              break;
+            }
+
+            bump(counts.admit);
+            admitted++;
+
+            int64_t traceId = newTraceId(plane.trace);
+            int64_t admitNs = traceId ? monotonicNs() : 0;
+
+            // Handle the packet using the flow table, or ask the controller for a rule
+            if (!applyFlowRule(plane, shared, *table, srcIp, destIp, traceId, 0, admitNs,
+                               TRACE_ADMIT)) {
+              int64_t sentNs = sendQueryPacket(plane.controllerFd, plane.id, 0, srcIp, destIp,
+                                               traceId);
+              traceHop(plane.trace, traceId, 0, admitNs, sentNs, TRACE_QUERY);
+              bump(counts.syscalls);
+              waiting = true;
+              waitingAdds = ++plane.queries;
+              waitingSrcIp = srcIp;
+              waitingDestIp = destIp;
+              waitingTraceId = traceId;
+              bump(counts.query);
+            }
+          }
+        } else if (type == "delay") {
+          int trafficId = content[0];
+          if (plane.id == trafficId) {
+          /*
+           * Attribution:
+           * https://stackoverflow.com/a/19555298
+           * By: https://stackoverflow.com/users/321937/oz
+           */
+            milliseconds ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
+            delayStartTime = ms.count();
+            delayDuration = content[1];
+            printf("Entering a delay period of %i milliseconds.\n", delayDuration);
+          }
+        } else if (type == "rate") {
+          if (plane.id == content[0]) setPacerRate(pacer, (double) content[1], monotonicNs());
+        } else {
+          // Ignore comments, empty lines, or errors.
+        }
+
+        // Leave the rest of the batch for later so neighbour packets are not starved
+        if (duration_cast<microseconds>(steady_clock::now() - batchStart).count() >=
+            options.batchBudgetUs) {
+          break;
+        }
+      }
+
+      moreTraffic = trafficStreamOpen(in) && !drained && !waiting && !delayDuration &&
+                    !pacingWaitNs;
+      flushRelayPackets(plane, counts);
+      raiseTo(counts.trafficDropped, in.droppedLines);
+      raiseTo(counts.pacedPackets, pacer.packets);
+      raiseTo(counts.pacedScheduledNs, (uint64_t) pacer.scheduledNs);
+      raiseTo(counts.pacedElapsedNs, (uint64_t) (pacer.lastNs - pacer.firstNs));
+      raiseTo(counts.maxPacingLagNs, (uint64_t) pacer.maxLagNs);
+
+      if (admitted) {
+        bump(counts.admitIterations);
+        raiseTo(counts.maxBatch, (uint64_t) admitted);
+      }
+    }
+
+    /*
+     * 2. Poll the incoming FIFOs from the attached switches and queue their packets, and read
+     * what a live traffic source has ready. Neighbours are not read while the data queue is full,
+     * which leaves their packets in the FIFOs. With nothing left to do, the data plane sleeps
+     * until one of them is ready, a delay or pacing wait ends or the control thread wakes it.
+     */
+    int64_t timeoutNs = 0;
+    if (!moreTraffic && shared.dataQueue.packets.empty() && !relaysReady(plane)) {
+      // A delay that just ended lets admission continue, unless a QUERY still waits for its ADD
+      long delayMs = delayDuration ? delayRemainingMs(delayStartTime, delayDuration) : -1;
+      if (delayMs > 0) {
+        timeoutNs = delayMs * 1000000;
+      } else if (pacingWaitNs) {
+        timeoutNs = pacingWaitNs;
+      } else {
+        timeoutNs = delayMs == 0 && !waiting ? 0 : -1;
+      }
+      if (timeoutNs && !prepareSleep(shared, table)) timeoutNs = 0;
+    }
+
+    if (plane.io == IO_BACKEND_URING) {
+      uringDataPath(plane, shared, options, pfds, pending, in, timeoutNs);
+    } else {
+      pollDataPath(plane, shared, options, pfds, pending, in, timeoutNs);
+    }
+
+    /*
+     * 3. Handle up to dataWeight queued packets, as described in the Packet Types section, before
+     * admitting traffic again.
+     */
+    vector<IngressPacket> scheduled;
+    dequeueIngress(shared.dataQueue, options.dataWeight, scheduled);
+
+    for (auto &ingress : scheduled) {
+      int i = ingress.port;
+      pair<string, vector<int64_t>> receivedPacket = parsePacketString(ingress.packet);
+      string packetType = receivedPacket.first;
+      vector<int64_t> msg = receivedPacket.second;
+
+      // Log the successful received packet
+      string direction = "Received";
+      printPacketMessage(direction, plane.portToId[i], plane.id, packetType, msg);
+
+      if (packetType == "RELAY") {
+        bump(counts.relayIn);
+
+        int64_t traceId = msg.size() >= 4 ? msg[2] : 0;
+        int64_t relaySentNs = msg.size() >= 4 ? msg[3] : 0;
+        int64_t relayNs = traceId ? monotonicNs() : 0;
+
+        // Deliver the packet locally if the destIp is meant for this switch, otherwise relay it
+        // along the controller's route. The rules of a transit switch lead towards the owner.
+        forwardRelay(plane, shared, *table,
+                     {(uint32_t) msg[0], (uint32_t) msg[1], traceId, relaySentNs, relayNs, 0});
+      } else {
+        // Unknown packet. Used for debugging.
+        printf("Received %s packet. Ignored.\n", packetType.c_str());
+      }
+    }
+
+    flushRelayPackets(plane, counts);
+    if (plane.io == IO_BACKEND_URING) submitDataPath(plane, counts);
+  }
+}
+
+/**
+ * Stops the data-plane thread, lists the switch status and exits.
+ */
+void stopSwitch(thread &dataPlane, DataPlane &plane, SwitchShared &shared, SwitchOptions &options,
+                FlowExporter &exporter, IngressQueue &controlQueue, int status) {
+  shared.stop.store(true, memory_order_seq_cst);
+  wakeDataPlane(shared);
+  dataPlane.join();
+
+  switchList(shared, options, exporter, controlQueue);
+  dumpTraceBuffer(plane.trace);
+  exit(status);
+}
+
+/**
+ * Main loop for the switch. Sets up the connections, starts the data-plane thread and then runs
+ * the control thread: it polls stdin and the controller socket, installs rules and publishes the
+ * flow table to the data plane.
+ */
+void switchLoop(int id, vector<int> &neighbours, uint32_t ipLow, uint32_t ipHigh,
+                TrafficStream &in, string &ipAdress, uint16_t portNumber, SwitchOptions &options) {
+  SwitchShared shared {};
+
+  // The initial flow table forwards this switch's own range locally
+  lpmInit(shared.replicas[0]);
+  lpmInit(shared.replicas[1]);
+  auto *initial = new FlowSnapshot();
+  // Add initial rule, counted in the first counter slot
+  int localPort = (int) neighbours.size() + 1;
+  initial->rules.push_back({0, IP_MAX, ipLow, ipHigh, "FORWARD", localPort, MIN_PRI, 0});
+  initial->destIndex = &shared.replicas[0];
+  for (auto &replica : shared.replicas) lpmInsertRange(replica, ipLow, ipHigh, 1);
+  shared.ruleCounts.chunks[0] = new StatCounter[RULE_COUNTER_CHUNK]();
+  shared.ruleCounts.carried.push_back(0);
+  shared.ruleCounts.used = 1;
+  shared.published.store(initial, memory_order_release);
+
+  // Periodic export of per-rule counters to a flow collector
+  FlowExporter exporter {};
+  exporter.fd = -1;
+  if (!options.exportPath.empty() &&
+      !openFlowExporter(exporter, options.exportPath, id, options.exportIntervalMs,
+                        (size_t) options.exportMaxRecords)) {
+    printf("Warning: Cannot export flows to %s.\n", options.exportPath.c_str());
+  }
+
+  DataPlane plane;
+  plane.id = id;
+  plane.numPorts = (int) neighbours.size();
+  plane.nextPort = 1;
+  plane.queries = 0;
+
+  // Ports are numbered from 0, the controller, to the neighbours' ports
+  plane.portToId.push_back(CONTROLLER_ID);
+  plane.portToId.insert(plane.portToId.end(), neighbours.begin(), neighbours.end());
+  plane.portToFd.assign(neighbours.size() + 1, -1);
+  plane.closed.assign(neighbours.size() + 1, false);
+  plane.relays.data.resize(neighbours.size() + 1);
+  plane.relayBlocked.assign(neighbours.size() + 1, false);
+  plane.sending.resize(neighbours.size() + 1);
+
+  // Hops of traced packets, dumped when the switch exits
+  initTraceBuffer(plane.trace, options.tracePrefix, id, options.traceSample);
+
+  int socketIdx = CONTROL_PFDS_SIZE - 1;
+
+  char buffer[MAX_BUFFER];
+  struct pollfd pfds[CONTROL_PFDS_SIZE];
+
+  // The data plane polls the slot of each neighbour port, live traffic in the slot of port 0, the
+  // relay FIFO of each port after them when it is full, and last the eventfd that wakes it
+  vector<pollfd> dataPfds(2 * neighbours.size() + 2);
+  string pending; // Partially received packets from the controller
+
+  // Controller packets are queued and handled up to controlWeight at a time
+  IngressQueue controlQueue {};
+
+  // Counters shared with external readers such as a3top
+  StatPublisher stats {};
+  openStatSegment(stats, "sw" + to_string(id), switchStatDefinitions());
+
+  // Unused ports are ignored by poll()
+  for (auto &pfd : dataPfds) {
+    pfd.fd = -1;
+    pfd.events = 0;
+    pfd.revents = 0;
+  }
+
+  // Wakes the data plane when the control thread has something for it
+  shared.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (shared.wakeFd < 0) {
+    perror("eventfd() failure");
+    exit(errno);
+  }
+  dataPfds.back().fd = shared.wakeFd;
+  dataPfds.back().events = POLLIN;
+  shared.trafficSource = trafficSourceName(in);
+
+  // Set up STDIN for polling from, unless it carries the traffic
+  bool commandsOnStdin = in.source != TRAFFIC_STDIN;
+  pfds[0].fd = commandsOnStdin ? STDIN_FILENO : -1;
   pfds[0].events = POLLIN;
   pfds[0].revents = 0;
 
@@ -284,14 +1565,15 @@ void switchLoop(int id, int port1Id, int port2Id, int ipLow, int ipHigh, ifstrea
     exit(errno);
   }
 
-  pair<int, int> controllerToFd = make_pair(0, pfds[socketIdx].fd);
-  portToFd.insert(controllerToFd);
-  pair<int, int> controllerToId = make_pair(0, CONTROLLER_ID);
-  portToId.insert(controllerToId);
+  pfds[socketIdx].events = POLLIN;
+  pfds[socketIdx].revents = 0;
+  plane.controllerFd = pfds[socketIdx].fd;
+
+  plane.portToFd[0] = pfds[socketIdx].fd;
 
   // Send an OPEN packet to the controller
-  sendOpenPacket(pfds[socketIdx].fd, id, port1Id, port2Id, ipLow, ipHigh);
-  counts.open++;
+  sendOpenPacket(pfds[socketIdx].fd, id, neighbours, ipLow, ipHigh);
+  bump(shared.counts.open);
 
   // Set socket to non-blocking
   if (fcntl(pfds[socketIdx].fd, F_SETFL, fcntl(pfds[socketIdx].fd, F_GETFL) | O_NONBLOCK) < 0) {
@@ -299,135 +1581,58 @@ void switchLoop(int id, int port1Id, int port2Id, int ipLow, int ipHigh, ifstrea
     exit(errno);
   }
 
-  // Create and open a reading FIFO for port 1 if not null
-  if (port1Id != -1) {
-    pair<int, int> port1Connection = make_pair(1, port1Id);
-    portToId.insert(port1Connection);
-    int port1Fd = createFifo(port1Id, id, O_RDONLY | O_NONBLOCK);
-    pfds[1].fd = port1Fd;
-    pfds[1].events = POLLIN;
-    pfds[1].revents = 0;
+  // Create and open a reading FIFO for each port that leads to a neighbour
+  for (int port = 1; port <= plane.numPorts; port++) {
+    if (plane.portToId[port] == -1) continue;
+    dataPfds[port].fd = createFifo(plane.portToId[port], id, O_RDONLY | O_NONBLOCK);
+    dataPfds[port].events = POLLIN;
+    dataPfds[port].revents = 0;
   }
 
-  // Create and open a reading FIFO for port 2 if not null
-  if (port2Id != -1) {
-    pair<int, int> port2Connection = make_pair(2, port2Id);
-    portToId.insert(port2Connection);
-    int port2Fd = createFifo(port2Id, id, O_RDONLY | O_NONBLOCK);
-    pfds[2].fd = port2Fd;
-    pfds[2].events = POLLIN;
-    pfds[2].revents = 0;
+  // The data plane reads neighbours and writes relays through io_uring if asked to. A switch has
+  // a few neighbours at most, which gain nothing from epoll, so it polls them otherwise.
+  plane.io = options.io == IO_BACKEND_URING ? IO_BACKEND_URING : IO_BACKEND_POLL;
+  plane.ring.fd = -1;
+  plane.countedEnters = 0;
+  plane.trafficArmed = false;
+  plane.timerArmed = false;
+  plane.timerDueNs = 0;
+  if (plane.io == IO_BACKEND_URING &&
+      !uringInit(plane.ring, URING_ENTRIES, URING_BUFFERS, MAX_BUFFER)) {
+    printf("Warning: io_uring is unavailable. Falling back to poll.\n");
+    plane.io = IO_BACKEND_POLL;
+  }
+  options.io = plane.io;
+
+  // An empty read of a FIFO that no neighbour has opened yet is not a close, so each FIFO is only
+  // read once a poll reports that its neighbour wrote to it
+  if (plane.io == IO_BACKEND_URING) {
+    plane.readMultishot = uringSupports(plane.ring, URING_OP_READ_MULTISHOT);
+    uringPrepPollMultishot(plane.ring, shared.wakeFd, (uint64_t) URING_WAKE << 32);
+    for (int i = 1; i <= plane.numPorts; i++) {
+      if (dataPfds[i].fd < 0) continue;
+      clearNonBlocking(dataPfds[i].fd);
+      uringPrepPoll(plane.ring, dataPfds[i].fd, ((uint64_t) URING_POLL << 32) | (uint32_t) i);
+    }
   }
 
-  // Used to keep track of the delay interval of the switch
-  long delayStartTime = 0;
-  int delayDuration = 0;
-
-  bool ackReceived = false, addReceived = true; // Used to wait for controller responses.
-
-  vector<int> closed; // Keep track of which ports are closed
+  thread dataPlane([&]() { dataPlaneLoop(plane, shared, in, options, dataPfds); });
 
   while (true) {
-    /*
-     * 1. Read and process a single line from the traffic line (if the EOF has not been reached
-     * yet). The switch ignores empty lines, comment lines, and lines specifying other handling
-     * switches. A packet header is considered admitted if the line specifies the current switch.
-     */
-    if (ackReceived && addReceived && !isDelayed(delayStartTime, delayDuration)) {
-      // Reset delay variables
-      delayStartTime = 0;
-      delayDuration = 0;
-
-      pair<string, vector<int>> trafficInfo;
-      string line;
-      if (in.is_open()) {
-        if (getline(in, line)) {
-          trafficInfo = parseTrafficFileLine(line);
-
-          string type = trafficInfo.first;
-          vector<int> content = trafficInfo.second;
-
-          if (type == "action") {
-            int trafficId = content[0];
-            int srcIp = content[1];
-            int destIp = content[2];
-
-            if (id == trafficId) {
-              counts.admit++;
-
-              // Handle the packet using the flow table
-              bool found = false;
-              for (auto &rule : flowTable) {
-                if (destIp >= rule.destIpLow && destIp <= rule.destIpHigh) {
-                  found = true;
-                  rule.pktCount++;
-                  if (rule.actionType == "DROP") {
-                    break;
-                  } else if (rule.actionType == "FORWARD") {
-                    if (rule.actionVal != 3) {
-                      // Open the FIFO for writing if not done already
-                      if (!portToFd.count(rule.actionVal)) {
-                        string relayFifo = makeFifoName(id, portToId[rule.actionVal]);
-                        int portFd = openFifo(relayFifo, O_WRONLY | O_NONBLOCK);
-                        pair<int, int> portConn = make_pair(rule.actionVal, portFd);
-                        portToFd.insert(portConn);
-                      }
-
-                      // Ensure switch is not closed before sending
-                      if (find(closed.begin(), closed.end(), rule.actionVal) == closed.end()) {
-                        sendRelayPacket(portToFd[rule.actionVal], id, portToId[rule.actionVal],
-                                        srcIp, destIp);
-                      }
-
-                      counts.relayOut++;
-                    }
-                  }
-
-                  break;
-                }
-              }
-
-              if (!found) {
-                sendQueryPacket(portToFd[0], id, 0, srcIp, destIp);
-                addReceived = false;
-                counts.query++;
-              }
-            }
-          } else if (type == "delay") {
-            int trafficId = content[0];
-            if (id == trafficId) {
-            /*
-             * Attribution:
-             * https://stackoverflow.com/a/19555298
-             * By: https://stackoverflow.com/users/321937/oz
-             */
-              milliseconds ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
-              delayStartTime = ms.count();
-              delayDuration = content[1];
-              printf("Entering a delay period of %i milliseconds.\n", delayDuration);
-            }
-          } else {
-            // Ignore comments, empty lines, or errors.
-          }
-        } else {
-          in.close();
-        }
-      }
-    }
-
-    // Poll from all file descriptors
-    if (poll(pfds, (nfds_t) PFDS_SIZE, 0) == -1) {
+    // Poll stdin and the controller socket
+    if (poll(pfds, (nfds_t) CONTROL_PFDS_SIZE, CONTROL_POLL_MS) == -1) {
       perror("poll() failure");
       exit(errno);
     }
 
     /*
-     * 2. Poll the keyboard for a user command. The user can issue one of the following commands.
+     * 1. Poll the keyboard for a user command. The user can issue one of the following commands.
      * list: The program writes all entries in the flow table, and for each transmitted or received
      * packet type, the program writes an aggregate count of handled packets of this type. exit: The
      * program writes the above information and exits.
      */
     if (pfds[0].revents & POLLIN) {
+      memset(buffer, 0, sizeof(buffer)); // Clear buffer
       if (!read(pfds[0].fd, buffer, MAX_BUFFER)) {
         printf("Error: stdin closed.\n");
         exit(EXIT_FAILURE);
@@ -437,102 +1642,94 @@ void switchLoop(int id, int port1Id, int port2Id, int ipLow, int ipHigh, ifstrea
       trim(cmd);  // trim whitespace
 
       if (cmd == "list") {
-        switchList(flowTable, counts);
+        switchList(shared, options, exporter, controlQueue);
       } else if (cmd == "exit") {
-        switchList(flowTable, counts);
-        exit(EXIT_SUCCESS);
+        stopSwitch(dataPlane, plane, shared, options, exporter, controlQueue, EXIT_SUCCESS);
       } else {
         printf("Error: Unrecognized command. Please use \"list\" or \"exit\".\n");
       }
     }
 
-    memset(buffer, 0, sizeof(buffer)); // Clear buffer
+    // 2. Poll the controller socket and queue its packets
+    if (pfds[socketIdx].revents & POLLIN) {
+      ssize_t bytesRead = read(pfds[socketIdx].fd, buffer, MAX_BUFFER);
+      if (!bytesRead) {
+        printf("Controller closed. Exiting.\n");
+        stopSwitch(dataPlane, plane, shared, options, exporter, controlQueue, errno);
+      } else if (bytesRead < 0) {
+        errno = 0; // Nothing to read yet
+      } else {
+        enqueueIngress(controlQueue, socketIdx,
+                       extractPackets(pending, buffer, (size_t) bytesRead));
+      }
+    }
 
     /*
-     * 3. Poll the incoming FDs from the controller and the attached switches. The switch handles
-     * each incoming packet, as described in the Packet Types section.
+     * 3. Handle up to controlWeight queued controller packets. Rule installs are applied to a copy
+     * of the flow table, which is published to the data plane once the whole round is applied.
      */
-    for (int i = 1; i < PFDS_SIZE; i++) {
-      if (pfds[i].revents & POLLIN) {
-        if (!read(pfds[i].fd, buffer, MAX_BUFFER)) {
-          if (i == socketIdx) {
-            printf("Controller closed. Exiting.\n");
-            switchList(flowTable, counts);
-            exit(errno);
-          } else {
-            printf("Warning: Connection to sw%i closed.\n", portToId[i]);
-            close(pfds[i].fd);
-            closed.push_back(i);
-            continue;
-          }
-        }
+    vector<IngressPacket> scheduled;
+    dequeueIngress(controlQueue, options.controlWeight, scheduled);
+
+    FlowSnapshot *current = shared.published.load(memory_order_relaxed);
+    FlowSnapshot *next = nullptr;
+    vector<IndexUpdate> updates;
+    vector<CounterMove> moves;
+
+    for (auto &ingress : scheduled) {
+      pair<string, vector<int64_t>> receivedPacket = parsePacketString(ingress.packet);
+      string packetType = receivedPacket.first;
+      vector<int64_t> msg = receivedPacket.second;
+
+      // Log the successful received packet
+      string direction = "Received";
+      printPacketMessage(direction, CONTROLLER_ID, id, packetType, msg);
+
+      if (packetType != "ACK" && packetType != "ADD") {
+        // Unknown packet. Used for debugging.
+        printf("Received %s packet. Ignored.\n", packetType.c_str());
+        continue;
+      }
 
-        string packetString = string(buffer);
-        pair<string, vector<int>> receivedPacket = parsePacketString(packetString);
-        string packetType = receivedPacket.first;
-        vector<int> msg = receivedPacket.second;
-
-        // Log the successful received packet
-        string direction = "Received";
-        printPacketMessage(direction, portToId[i], id, packetType, msg);
-
-        if (packetType == "ACK") {
-          ackReceived = true;
-          counts.ack++;
-        } else if (packetType == "ADD") {
-          addReceived = true;
-
-          FlowRule newRule;
-
-          if (msg[0] == 0) {
-            newRule = {0, MAX_IP, msg[1], msg[2], "DROP", msg[3], MIN_PRI, 1};
-          } else if (msg[0] == 1) {
-            newRule = {0, MAX_IP, msg[1], msg[2], "FORWARD", msg[3], MIN_PRI, 1};
-
-            // Open FIFO for writing if not done so already
-            if (!portToFd.count(msg[3])) {
-              string relayFifo = makeFifoName(id, portToId[msg[3]]);
-              int portFd = openFifo(relayFifo, O_WRONLY | O_NONBLOCK);
-              pair<int, int> portConnection = make_pair(msg[3], portFd);
-              portToFd.insert(portConnection);
-            }
+      if (!next) {
+        next = new FlowSnapshot(*current);
+        next->destIndex = standbyIndex(shared, current);
+      }
 
-            // Ensure switch is not closed before sending
-            if (find(closed.begin(), closed.end(), i) == closed.end()) {
-              sendRelayPacket(portToFd[msg[3]], id, portToId[msg[3]], msg[4], msg[1]);
-            }
+      if (packetType == "ACK") {
+        next->acknowledged = true;
+        bump(shared.counts.ack);
+      } else {
+        installFlowRule(shared, *next, updates, moves, msg);
+
+        // A traced QUERY is answered with its trace ID and the controller's send time
+        next->adds++;
+        next->addTraceId = msg.size() >= 7 ? msg[5] : 0;
+        next->addSentNs = msg.size() >= 7 ? msg[6] : 0;
+        next->addReceivedNs = next->addTraceId ? ingress.queuedNs : 0;
+        bump(shared.counts.add);
+      }
+    }
 
-            counts.relayOut++;
-          } else {
-            printf("Error: Invalid rule to add.\n");
-            continue;
-          }
+    if (next) {
+      publishFlowTable(shared, next, updates);
+      carryRuleCounters(shared.ruleCounts, exporter, moves);
+    }
 
-          flowTable.push_back(newRule);
-          counts.add++;
-        } else if (packetType == "RELAY") {
-          counts.relayIn++;
-
-          // Relay the packet to an adjacent controller if the destIp is not meant for this switch
-          if (msg[1] < ipLow || msg[1] > ipHigh) {
-            // Ensure switch is not closed before sending
-            if (find(closed.begin(), closed.end(), i) == closed.end()) {
-              if (id > i) {
-                sendRelayPacket(portToFd[1], id, portToId[1], msg[0], msg[1]);
-                counts.relayOut++;
-              } else if (id < i) {
-                sendRelayPacket(portToFd[2], id, portToId[2], msg[0], msg[1]);
-                counts.relayOut++;
-              }
-            }
-          }
-        } else {
-          // Unknown packet. Used for debugging.
-          printf("Received %s packet. Ignored.\n", packetType.c_str());
-        }
-      }
+    // 4. Export flow counters if the export interval has passed
+    long nowMs = monotonicMs();
+    if (flowExportDue(exporter, nowMs)) {
+      exportFlowTable(exporter, shared.published.load(memory_order_relaxed)->rules,
+                      shared.ruleCounts, nowMs);
     }
 
-    memset(buffer, 0, sizeof(buffer)); // Clear buffer
+    // 5. Publish the counters to the stats segment
+    if (statsDue(stats)) publishStats(stats, switchStatValues(shared, controlQueue));
+
+    // 6. Piped traffic replaces the user's exit command once all of it has been handled
+    if (!commandsOnStdin && shared.trafficDone.load(memory_order_relaxed)) {
+      printf("Traffic ended. Exiting.\n");
+      stopSwitch(dataPlane, plane, shared, options, exporter, controlQueue, EXIT_SUCCESS);
+    }
   }
-}
\ No newline at end of file
+}
@@ -1,12 +1,35 @@
 #ifndef SWITCH_H_
 #define SWITCH_H_
 
-#include <fstream>
+#include <stdint.h>
+#include <string>
 #include <tuple>
+#include <vector>
+#include "traffic.h"
+#include "uring.h"
 
 using namespace std;
 
-void switchLoop(int id, int port1Id, int port2Id, int ipLow, int ipHigh, ifstream &in,
-                string &ipAddress, uint16_t portNumber);
+/**
+ * Tunable switch behaviour, set from optional key=value command line arguments
+ */
+typedef struct {
+    int batchSize;  // Most traffic packets admitted between two polls
+    long batchBudgetUs;  // Longest time spent admitting packets between two polls
+    string exportPath;  // Unix socket of the flow collector, empty if flows are not exported
+    long exportIntervalMs;  // Shortest time between two flow exports
+    int exportMaxRecords;  // Most flow records exported per interval
+    string tracePrefix;  // Prefix of the hop trace dump file, empty if packets are not traced
+    int traceSample;  // Trace one in traceSample admitted packets
+    int controlWeight;  // Most controller packets handled per round of the control thread
+    int dataWeight;  // Most neighbour packets handled per round of the data-plane thread
+    int dataQueueMax;  // Queued neighbour packets at which the switch stops reading neighbours
+    IoBackend io;  // How the data-plane thread reads neighbours and writes relays
+    long ratePps;  // Packets per second admitted from untimestamped traffic, 0 for no pacing
+    double speed;  // Multiplier of traffic rates and timestamps
+} SwitchOptions;
+
+void switchLoop(int id, vector<int> &neighbours, uint32_t ipLow, uint32_t ipHigh,
+                TrafficStream &in, string &ipAddress, uint16_t portNumber, SwitchOptions &options);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "trace.h"
+
+#define TRACE_MAGIC 0x43525441  // "ATRC"
+#define TRACE_VERSION 1
+#define TRACE_ID_SHIFT 40  // Trace IDs are the admitting switch ID followed by a sequence number
+
+using namespace std;
+
+/**
+ * Header of a trace dump file. Followed by count TraceRecords, oldest first.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t node;
+    uint32_t count;
+    uint64_t total;
+} TraceFileHeader;
+
+/**
+ * Returns CLOCK_MONOTONIC in nanoseconds.
+ */
+int64_t monotonicNs() {
+  struct timespec now {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Enables tracing if prefix is not empty. Hops are dumped to <prefix>-sw<node>.trace, or
+ * <prefix>-cont.trace for the controller.
+ */
+void initTraceBuffer(TraceBuffer &buffer, const string &prefix, int node, int sampleEvery) {
+  buffer.node = node;
+  buffer.sampleEvery = sampleEvery > 0 ? sampleEvery : 1;
+  buffer.nextSequence = 0;
+  buffer.next = 0;
+  buffer.total = 0;
+  buffer.records.clear();
+  buffer.path.clear();
+
+  if (!prefix.empty()) {
+    buffer.path = prefix + (node == TRACE_CONTROLLER_NODE ? "-cont" : "-sw" + to_string(node)) +
+                  ".trace";
+    buffer.records.resize(TRACE_BUFFER_SIZE);
+  }
+}
+
+/**
+ * Returns whether this process records hops.
+ */
+bool tracing(TraceBuffer &buffer) {
+  return !buffer.path.empty();
+}
+
+/**
+ * Returns a trace ID for the next admitted packet, or 0 if the packet is not sampled.
+ */
+int64_t newTraceId(TraceBuffer &buffer) {
+  if (!tracing(buffer)) return 0;
+
+  int64_t sequence = buffer.nextSequence++;
+  if (sequence % buffer.sampleEvery) return 0;
+  return ((int64_t) buffer.node << TRACE_ID_SHIFT) | (sequence + 1);
+}
+
+/**
+ * Records one hop of a traced packet.
+ */
+void traceHop(TraceBuffer &buffer, int64_t traceId, int64_t sentNs, int64_t ingressNs,
+              int64_t egressNs, TraceKind kind) {
+  if (!traceId || !tracing(buffer)) return;
+
+  buffer.records[buffer.next] = {traceId, sentNs, ingressNs, egressNs, buffer.node, (int32_t) kind};
+  buffer.next = (buffer.next + 1) % buffer.records.size();
+  buffer.total++;
+}
+
+/**
+ * Writes the recorded hops, oldest first, to the dump file.
+ */
+void dumpTraceBuffer(TraceBuffer &buffer) {
+  if (!tracing(buffer)) return;
+
+  FILE *file = fopen(buffer.path.c_str(), "wb");
+  if (!file) {
+    perror("fopen() failure");
+    errno = 0;
+    return;
+  }
+
+  bool wrapped = buffer.total > buffer.records.size();
+  size_t count = wrapped ? buffer.records.size() : (size_t) buffer.total;
+  size_t first = wrapped ? buffer.next : 0;
+
+  TraceFileHeader header = {TRACE_MAGIC, TRACE_VERSION, buffer.node, (uint32_t) count,
+                            buffer.total};
+  fwrite(&header, sizeof(header), 1, file);
+  for (size_t i = 0; i < count; i++) {
+    fwrite(&buffer.records[(first + i) % buffer.records.size()], sizeof(TraceRecord), 1, file);
+  }
+  fclose(file);
+
+  printf("Trace: %zu hops written to %s\n", count, buffer.path.c_str());
+}
+
+/**
+ * Appends the records of a dump file. Returns false if the file cannot be read.
+ */
+bool readTraceFile(const string &path, vector<TraceRecord> &records) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) return false;
+
+  TraceFileHeader header {};
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == TRACE_MAGIC &&
+            header.version == TRACE_VERSION;
+  if (ok) {
+    size_t first = records.size();
+    records.resize(first + header.count);
+    ok = fread(&records[first], sizeof(TraceRecord), header.count, file) == header.count;
+  }
+  fclose(file);
+
+  return ok;
+}
+
+/**
+ * Returns the printable name of a hop kind.
+ */
+string traceKindName(int kind) {
+  switch (kind) {
+    case TRACE_ADMIT:
+      return "ADMIT";
+    case TRACE_QUERY:
+      return "QUERY";
+    case TRACE_CONTROLLER:
+      return "CONTROLLER";
+    case TRACE_ADD:
+      return "ADD";
+    case TRACE_RELAY:
+      return "RELAY";
+    case TRACE_DELIVER:
+      return "DELIVER";
+    case TRACE_DROP:
+      return "DROP";
+    default:
+      return "UNKNOWN";
+  }
+}
@@ -0,0 +1,69 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define TRACE_BUFFER_SIZE 65536  // Records kept per process; older records are overwritten
+#define TRACE_CONTROLLER_NODE 0
+
+using namespace std;
+
+/**
+ * What a node did with a traced packet
+ */
+typedef enum {
+    TRACE_ADMIT,  // Admitted from the traffic file and forwarded to a neighbour
+    TRACE_QUERY,  // Admitted, missed the flow table and sent to the controller
+    TRACE_CONTROLLER,  // QUERY answered by the controller
+    TRACE_ADD,  // Rule received and the waiting packet forwarded
+    TRACE_RELAY,  // Received from a neighbour and forwarded
+    TRACE_DELIVER,  // Reached the switch that owns the destination
+    TRACE_DROP  // Dropped by a rule
+} TraceKind;
+
+/**
+ * One hop of a traced packet. All times are CLOCK_MONOTONIC nanoseconds, which every process on
+ * the host shares, so hops recorded by different processes can be compared directly.
+ */
+typedef struct {
+    int64_t traceId;
+    int64_t sentNs;  // When the previous hop sent the packet, 0 at the first hop
+    int64_t ingressNs;  // When this node received (or admitted) the packet
+    int64_t egressNs;  // When this node sent the packet on, or finished with it
+    int32_t node;  // Switch ID, or TRACE_CONTROLLER_NODE
+    int32_t kind;  // TraceKind
+} TraceRecord;
+
+/**
+ * Ring buffer of the hops recorded by one process
+ */
+typedef struct {
+    string path;  // Dump file, empty if tracing is disabled
+    int node;
+    int sampleEvery;  // Trace one in sampleEvery admitted packets
+    int64_t nextSequence;
+    vector<TraceRecord> records;
+    size_t next;
+    uint64_t total;  // Records ever written, including overwritten ones
+} TraceBuffer;
+
+int64_t monotonicNs();
+
+void initTraceBuffer(TraceBuffer &buffer, const string &prefix, int node, int sampleEvery);
+
+bool tracing(TraceBuffer &buffer);
+
+int64_t newTraceId(TraceBuffer &buffer);
+
+void traceHop(TraceBuffer &buffer, int64_t traceId, int64_t sentNs, int64_t ingressNs,
+              int64_t egressNs, TraceKind kind);
+
+void dumpTraceBuffer(TraceBuffer &buffer);
+
+bool readTraceFile(const string &path, vector<TraceRecord> &records);
+
+string traceKindName(int kind);
+
+#endif
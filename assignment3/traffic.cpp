@@ -0,0 +1,450 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "traffic.h"
+
+#define INDEX_MAGIC 0x58493341  // "A3IX"
+#define INDEX_VERSION 1
+#define TRAFFIC_RING_SIZE 65536
+#define SOCKET_PREFIX "unix:"
+
+using namespace std;
+
+/**
+ * Header of the traffic index file. The index is written next to the traffic file the first time
+ * any switch opens it, so the remaining switches never have to scan the file themselves.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint32_t numSections;
+    uint32_t pad;
+} TrafficIndexHeader;
+
+/**
+ * One section per switch ID. Entries of a section are stored contiguously.
+ */
+typedef struct {
+    int32_t switchId;
+    uint32_t count;
+    uint64_t firstEntry;
+} TrafficIndexSection;
+
+/**
+ * Returns the switch ID named by the first token of a line, or -1 if the line is empty, a comment
+ * or does not start with a switch token. Only the leading token is looked at so foreign lines are
+ * skipped without being parsed.
+ */
+int leadingSwitchId(const char *line, size_t length) {
+  size_t i = 0;
+  while (i < length && (line[i] == ' ' || line[i] == '\t')) i++;
+  if (i + 2 >= length || line[i] == '#' || line[i] != 's' || line[i + 1] != 'w') return -1;
+  i += 2;
+
+  int id = 0;
+  size_t digits = 0;
+  while (i < length && line[i] >= '0' && line[i] <= '9') {
+    id = id * 10 + (line[i] - '0');
+    i++;
+    digits++;
+  }
+
+  if (!digits || (i < length && line[i] != ' ' && line[i] != '\t' && line[i] != '\r')) return -1;
+  return id;
+}
+
+/**
+ * Scans the whole traffic file once and splits its lines by switch ID.
+ */
+map<int, vector<TrafficLineRef>> buildTrafficIndex(const char *data, size_t size) {
+  map<int, vector<TrafficLineRef>> index;
+
+  size_t start = 0;
+  while (start < size) {
+    const char *newline = (const char *) memchr(data + start, '\n', size - start);
+    size_t end = newline ? (size_t) (newline - data) : size;
+
+    int id = leadingSwitchId(data + start, end - start);
+    if (id != -1) index[id].push_back({start, (uint32_t) (end - start), 0});
+
+    start = end + 1;
+  }
+
+  return index;
+}
+
+/**
+ * Writes the index next to the traffic file. The file is written under a temporary name and then
+ * renamed, so concurrently starting switches never observe a partial index.
+ */
+void writeTrafficIndex(const string &indexPath, const struct stat &fileStat,
+                       map<int, vector<TrafficLineRef>> &index) {
+  TrafficIndexHeader header = {INDEX_MAGIC, INDEX_VERSION, (uint64_t) fileStat.st_size,
+                               (int64_t) fileStat.st_mtim.tv_sec, (int64_t) fileStat.st_mtim.tv_nsec,
+                               (uint32_t) index.size(), 0};
+
+  vector<TrafficIndexSection> sections;
+  uint64_t firstEntry = 0;
+  for (auto &section : index) {
+    sections.push_back({section.first, (uint32_t) section.second.size(), firstEntry});
+    firstEntry += section.second.size();
+  }
+
+  string tmpPath = indexPath + "." + to_string(getpid());
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0) return;
+
+  bool ok = write(fd, &header, sizeof(header)) == sizeof(header);
+  size_t sectionsSize = sections.size() * sizeof(TrafficIndexSection);
+  if (ok && sectionsSize) ok = write(fd, sections.data(), sectionsSize) == (ssize_t) sectionsSize;
+  for (auto &section : index) {
+    size_t entriesSize = section.second.size() * sizeof(TrafficLineRef);
+    if (ok) ok = write(fd, section.second.data(), entriesSize) == (ssize_t) entriesSize;
+  }
+  close(fd);
+
+  if (!ok || rename(tmpPath.c_str(), indexPath.c_str()) < 0) unlink(tmpPath.c_str());
+}
+
+/**
+ * Loads only this switch's section of an existing index. Returns false if there is no index or it
+ * does not describe the current contents of the traffic file.
+ */
+bool readTrafficIndex(const string &indexPath, const struct stat &fileStat, int switchId,
+                      vector<TrafficLineRef> &lines) {
+  int fd = open(indexPath.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  TrafficIndexHeader header {};
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != INDEX_MAGIC ||
+      header.version != INDEX_VERSION || header.fileSize != (uint64_t) fileStat.st_size ||
+      header.mtimeSec != (int64_t) fileStat.st_mtim.tv_sec ||
+      header.mtimeNsec != (int64_t) fileStat.st_mtim.tv_nsec) {
+    close(fd);
+    return false;
+  }
+
+  vector<TrafficIndexSection> sections(header.numSections);
+  size_t sectionsSize = sections.size() * sizeof(TrafficIndexSection);
+  if (sectionsSize &&
+      pread(fd, sections.data(), sectionsSize, sizeof(header)) != (ssize_t) sectionsSize) {
+    close(fd);
+    return false;
+  }
+
+  bool ok = true;
+  for (auto &section : sections) {
+    if (section.switchId != switchId) continue;
+
+    lines.resize(section.count);
+    size_t entriesSize = section.count * sizeof(TrafficLineRef);
+    off_t entriesOffset = sizeof(header) + sectionsSize +
+                          section.firstEntry * sizeof(TrafficLineRef);
+    ok = pread(fd, lines.data(), entriesSize, entriesOffset) == (ssize_t) entriesSize;
+    break;
+  }
+  close(fd);
+
+  // Reject entries that point outside of the traffic file
+  for (auto &line : lines) {
+    if (line.offset + line.length > (uint64_t) fileStat.st_size) ok = false;
+  }
+  if (!ok) lines.clear();
+
+  return ok;
+}
+
+/**
+ * Maps the traffic file into memory and locates the switch's own lines through the shared index,
+ * building it if needed, so each switch only touches the lines that name it.
+ */
+bool openTrafficFile(const string &path, int switchId, TrafficStream &stream) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat fileStat {};
+  if (fstat(fd, &fileStat) < 0) {
+    close(fd);
+    return false;
+  }
+
+  stream.size = (size_t) fileStat.st_size;
+  if (stream.size) {
+    void *data = mmap(nullptr, stream.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    stream.data = (const char *) data;
+  }
+  close(fd);
+
+  string indexPath = path + ".idx";
+  if (!readTrafficIndex(indexPath, fileStat, switchId, stream.lines)) {
+    map<int, vector<TrafficLineRef>> index = buildTrafficIndex(stream.data, stream.size);
+    writeTrafficIndex(indexPath, fileStat, index);
+    stream.lines = index[switchId];
+  }
+
+  return true;
+}
+
+/**
+ * Listens on a Unix stream socket for traffic generators. A socket file left behind by an earlier
+ * run is replaced.
+ */
+bool listenTrafficSocket(TrafficStream &stream) {
+  sockaddr_un address {};
+  if (stream.path.empty() || stream.path.length() >= sizeof(address.sun_path)) return false;
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, stream.path.c_str(), sizeof(address.sun_path) - 1);
+
+  stream.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (stream.listenFd < 0) return false;
+
+  unlink(stream.path.c_str());
+  if (bind(stream.listenFd, (sockaddr *) &address, sizeof(address)) < 0 ||
+      listen(stream.listenFd, 1) < 0) {
+    close(stream.listenFd);
+    stream.listenFd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Opens the traffic source of a switch: "-" for stdin, "unix:<path>" for a Unix socket, the path
+ * of a named pipe, or the path of a traffic file. Returns false if the source cannot be opened.
+ */
+bool openTrafficStream(const string &path, int switchId, TrafficStream &stream) {
+  stream.source = TRAFFIC_FILE;
+  stream.data = nullptr;
+  stream.size = 0;
+  stream.lines.clear();
+  stream.next = 0;
+  stream.open = false;
+  stream.switchId = switchId;
+  stream.fd = -1;
+  stream.listenFd = -1;
+  stream.stdinFlags = -1;
+  stream.path.clear();
+  stream.ring.clear();
+  stream.ringStart = 0;
+  stream.ringFill = 0;
+  stream.ended = false;
+  stream.droppedLines = 0;
+
+  struct stat pathStat {};
+  bool ok;
+  if (path == "-") {
+    stream.source = TRAFFIC_STDIN;
+    stream.fd = STDIN_FILENO;
+    stream.stdinFlags = fcntl(STDIN_FILENO, F_GETFL);
+    ok = stream.stdinFlags >= 0 &&
+         fcntl(STDIN_FILENO, F_SETFL, stream.stdinFlags | O_NONBLOCK) >= 0;
+  } else if (path.compare(0, strlen(SOCKET_PREFIX), SOCKET_PREFIX) == 0) {
+    stream.source = TRAFFIC_SOCKET;
+    stream.path = path.substr(strlen(SOCKET_PREFIX));
+    ok = listenTrafficSocket(stream);
+  } else if (stat(path.c_str(), &pathStat) == 0 && S_ISFIFO(pathStat.st_mode)) {
+    // Opening the read end without blocking does not wait for a writer
+    stream.source = TRAFFIC_FIFO;
+    stream.path = path;
+    stream.fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    ok = stream.fd >= 0;
+  } else {
+    ok = openTrafficFile(path, switchId, stream);
+  }
+  if (!ok) return false;
+
+  if (stream.source != TRAFFIC_FILE) stream.ring.resize(TRAFFIC_RING_SIZE);
+
+  errno = 0;  // A missing or stale index is not an error
+  stream.open = true;
+  return true;
+}
+
+/**
+ * Describes the traffic source for list.
+ */
+string trafficSourceName(TrafficStream &stream) {
+  switch (stream.source) {
+    case TRAFFIC_STDIN:
+      return "stdin";
+    case TRAFFIC_FIFO:
+      return "pipe " + stream.path;
+    case TRAFFIC_SOCKET:
+      return SOCKET_PREFIX + stream.path;
+    default:
+      return "file";
+  }
+}
+
+/**
+ * Returns the descriptor to wait on for more traffic: the live source, or the Unix socket while
+ * no generator is connected. Returns -1 for a traffic file, and while the ring buffer is full so
+ * that a fast generator blocks instead of being dropped.
+ */
+int trafficStreamFd(TrafficStream &stream) {
+  if (!stream.open || stream.source == TRAFFIC_FILE || stream.ended) return -1;
+  if (stream.ringFill == stream.ring.size()) return -1;
+  return stream.fd >= 0 ? stream.fd : stream.listenFd;
+}
+
+/**
+ * Reads what a live source has ready into the free space of the ring buffer, or accepts the next
+ * generator on a Unix socket. Never blocks. Returns the number of bytes read.
+ */
+ssize_t fillTrafficStream(TrafficStream &stream) {
+  if (trafficStreamFd(stream) < 0) return 0;
+
+  if (stream.fd < 0) {
+    stream.fd = accept4(stream.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    errno = 0;  // The generator gave up before it was accepted
+    return 0;
+  }
+
+  size_t capacity = stream.ring.size();
+  size_t end = (stream.ringStart + stream.ringFill) % capacity;
+  size_t space = min(capacity - stream.ringFill, capacity - end);
+
+  ssize_t bytesRead = read(stream.fd, stream.ring.data() + end, space);
+  if (bytesRead > 0) {
+    stream.ringFill += (size_t) bytesRead;
+    return bytesRead;
+  } else if (bytesRead < 0) {
+    errno = 0;  // Nothing to read yet
+    return 0;
+  }
+
+  // The generator finished. Sockets and named pipes wait for the next one.
+  if (stream.source == TRAFFIC_STDIN) {
+    stream.ended = true;
+  } else if (stream.source == TRAFFIC_SOCKET) {
+    close(stream.fd);
+    stream.fd = -1;
+  } else {
+    close(stream.fd);
+    stream.fd = open(stream.path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (stream.fd < 0) stream.ended = true;
+  }
+  errno = 0;
+  return 0;
+}
+
+/**
+ * Takes the oldest complete line out of the ring buffer. The last line of piped input may lack
+ * its newline. Returns false if no complete line is buffered.
+ */
+bool takeRingLine(TrafficStream &stream, string &line) {
+  size_t capacity = stream.ring.size();
+  const char *ring = stream.ring.data();
+
+  // The unread bytes are at most two runs: up to the end of the buffer, then from its start
+  size_t firstRun = min(stream.ringFill, capacity - stream.ringStart);
+  size_t length = stream.ringFill;
+  bool complete = false;
+  auto *newline = (const char *) memchr(ring + stream.ringStart, '\n', firstRun);
+  if (newline) {
+    length = (size_t) (newline - (ring + stream.ringStart));
+    complete = true;
+  } else if ((newline = (const char *) memchr(ring, '\n', stream.ringFill - firstRun))) {
+    length = firstRun + (size_t) (newline - ring);
+    complete = true;
+  }
+
+  if (!complete && !(stream.ended && stream.ringFill)) {
+    if (stream.ringFill < capacity) return false;
+
+    // No line fits into the buffer: skip what was read of it
+    stream.ringStart = (stream.ringStart + stream.ringFill) % capacity;
+    stream.ringFill = 0;
+    stream.droppedLines++;
+    return false;
+  }
+
+  line.assign(ring + stream.ringStart, min(length, firstRun));
+  if (length > firstRun) line.append(ring, length - firstRun);
+
+  size_t consumed = min(length + (complete ? 1 : 0), stream.ringFill);
+  stream.ringStart = (stream.ringStart + consumed) % capacity;
+  stream.ringFill -= consumed;
+  if (!stream.ringFill) stream.ringStart = 0;
+  return true;
+}
+
+/**
+ * Reads the next line for this switch. Lines of a live source that do not name this switch are
+ * skipped here, as the index does for a traffic file. Returns false if no line is available,
+ * which for a traffic file means that all lines have been consumed.
+ */
+bool nextTrafficLine(TrafficStream &stream, string &line) {
+  if (stream.source != TRAFFIC_FILE) {
+    while (takeRingLine(stream, line)) {
+      if (leadingSwitchId(line.c_str(), line.length()) == stream.switchId) return true;
+    }
+    return false;
+  }
+
+  if (stream.next >= stream.lines.size()) return false;
+
+  TrafficLineRef &ref = stream.lines[stream.next++];
+  line.assign(stream.data + ref.offset, ref.length);
+  return true;
+}
+
+/**
+ * Returns whether every line of the traffic has been consumed. Only a traffic file and piped
+ * input end; sockets and named pipes wait for more generators.
+ */
+bool trafficStreamEnded(TrafficStream &stream) {
+  if (stream.source == TRAFFIC_FILE) return stream.next >= stream.lines.size();
+  return stream.ended && !stream.ringFill;
+}
+
+/**
+ * Returns whether the traffic stream is still open.
+ */
+bool trafficStreamOpen(TrafficStream &stream) {
+  return stream.open;
+}
+
+/**
+ * Unmaps the traffic file, or closes the live source.
+ */
+void closeTrafficStream(TrafficStream &stream) {
+  if (stream.data) munmap((void *) stream.data, stream.size);
+  if (stream.source == TRAFFIC_STDIN && stream.stdinFlags >= 0) {
+    fcntl(STDIN_FILENO, F_SETFL, stream.stdinFlags);
+  } else if (stream.fd >= 0) {
+    close(stream.fd);
+  }
+  if (stream.listenFd >= 0) {
+    close(stream.listenFd);
+    unlink(stream.path.c_str());
+  }
+  stream.fd = -1;
+  stream.listenFd = -1;
+  stream.ring.clear();
+  stream.ringFill = 0;
+  stream.data = nullptr;
+  stream.size = 0;
+  stream.lines.clear();
+  stream.next = 0;
+  stream.open = false;
+}
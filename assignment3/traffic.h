@@ -0,0 +1,69 @@
+#ifndef TRAFFIC_H_
+#define TRAFFIC_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Location of a single traffic file line (excluding the newline)
+ */
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t pad;
+} TrafficLineRef;
+
+/**
+ * Where a switch reads its traffic from
+ */
+typedef enum {
+    TRAFFIC_FILE,  // A traffic file, read through the shared index
+    TRAFFIC_STDIN,  // Lines piped into the switch; the switch exits once they end
+    TRAFFIC_FIFO,  // A named pipe, reopened for the next generator whenever one closes it
+    TRAFFIC_SOCKET  // A Unix stream socket that generators connect to, one at a time
+} TrafficSource;
+
+/**
+ * A switch's view of its traffic: only the lines that name this switch, in order. A live source
+ * is read without blocking into a ring buffer, from which complete lines are taken.
+ */
+typedef struct {
+    TrafficSource source;
+    const char *data;  // Memory mapped traffic file
+    size_t size;
+    vector<TrafficLineRef> lines;
+    size_t next;  // Index of the next unread line
+    bool open;
+    int switchId;
+    int fd;  // Live source being read, -1 while a socket waits for a generator
+    int listenFd;  // Unix socket that generators connect to, -1 for other sources
+    int stdinFlags;  // File status flags of stdin, restored when the stream closes
+    string path;  // Named pipe or Unix socket
+    vector<char> ring;
+    size_t ringStart;  // Offset of the oldest unread byte
+    size_t ringFill;  // Unread bytes
+    bool ended;  // Piped input reached its end
+    uint64_t droppedLines;  // Lines longer than the ring buffer, which are skipped
+} TrafficStream;
+
+bool openTrafficStream(const string &path, int switchId, TrafficStream &stream);
+
+string trafficSourceName(TrafficStream &stream);
+
+int trafficStreamFd(TrafficStream &stream);
+
+ssize_t fillTrafficStream(TrafficStream &stream);
+
+bool nextTrafficLine(TrafficStream &stream, string &line);
+
+bool trafficStreamEnded(TrafficStream &stream);
+
+bool trafficStreamOpen(TrafficStream &stream);
+
+void closeTrafficStream(TrafficStream &stream);
+
+#endif
@@ -0,0 +1,364 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include "uring.h"
+
+using namespace std;
+
+/**
+ * Returns the name of an I/O backend.
+ */
+string ioBackendName(IoBackend backend) {
+  switch (backend) {
+    case IO_BACKEND_EPOLL:
+      return "epoll";
+    case IO_BACKEND_URING:
+      return "uring";
+    default:
+      return "poll";
+  }
+}
+
+/**
+ * Parses an I/O backend name. Returns false if the name is unknown.
+ */
+bool parseIoBackend(const string &text, IoBackend &backend) {
+  if (text == "poll") {
+    backend = IO_BACKEND_POLL;
+  } else if (text == "epoll") {
+    backend = IO_BACKEND_EPOLL;
+  } else if (text == "uring") {
+    backend = IO_BACKEND_URING;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Loads a ring index written by the kernel.
+ */
+unsigned loadAcquire(unsigned *index) {
+  return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Publishes a ring index to the kernel.
+ */
+void storeRelease(unsigned *index, unsigned value) {
+  __atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sets up an io_uring instance with its submission and completion rings mapped, and provides
+ * bufferCount buffers of bufferSize bytes for multishot receives. Returns false, leaving ring.fd at
+ * -1, if the kernel does not support io_uring.
+ */
+bool uringInit(Uring &ring, unsigned entries, unsigned bufferCount, unsigned bufferSize) {
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+
+  io_uring_params params {};
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;  // Multishot receives produce several completions per SQE
+
+  int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    errno = 0;
+    return false;
+  }
+  ring.fd = fd;
+
+  ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring.sqRingSize = ring.cqRingSize = max(ring.sqRingSize, ring.cqRingSize);
+  }
+
+  ring.sqRing = mmap(nullptr, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+  ring.cqRing = ring.sqRing;
+  if (ring.sqRing != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring.cqRing = mmap(nullptr, ring.cqRingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  ring.sqes = (io_uring_sqe *) mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQES);
+  if (ring.sqRing == MAP_FAILED || ring.cqRing == MAP_FAILED || ring.sqes == MAP_FAILED) {
+    close(fd);
+    ring.fd = -1;
+    errno = 0;
+    return false;
+  }
+
+  auto *sq = (char *) ring.sqRing;
+  auto *cq = (char *) ring.cqRing;
+  ring.sqEntries = params.sq_entries;
+  ring.sqHead = (unsigned *) (sq + params.sq_off.head);
+  ring.sqTail = (unsigned *) (sq + params.sq_off.tail);
+  ring.sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  ring.cqHead = (unsigned *) (cq + params.cq_off.head);
+  ring.cqTail = (unsigned *) (cq + params.cq_off.tail);
+  ring.cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  ring.cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+  ring.sqeTail = *ring.sqTail;
+
+  // SQE slots are always submitted in order, so the indirection array maps every slot to itself
+  auto *array = (unsigned *) (sq + params.sq_off.array);
+  for (unsigned i = 0; i < ring.sqEntries; i++) array[i] = i;
+
+  // Hand every receive buffer to the kernel up front, as one group it picks from. The group is
+  // provided with IORING_OP_PROVIDE_BUFFERS rather than a registered buffer ring, which some
+  // kernels accept but never select from.
+  ring.bufCount = bufferCount;
+  ring.bufSize = bufferSize;
+  ring.buffers = (char *) malloc((size_t) bufferCount * bufferSize);
+  if (!ring.buffers) {
+    uringFree(ring);
+    errno = 0;
+    return false;
+  }
+
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = (int) bufferCount;
+  sqe->addr = (uint64_t) ring.buffers;
+  sqe->len = bufferSize;
+  sqe->buf_group = URING_BUFFER_GROUP;
+
+  io_uring_cqe *cqe = uringSubmit(ring, 1) < 0 ? nullptr : uringPeek(ring);
+  if (!cqe || cqe->res < 0) {
+    uringFree(ring);
+    errno = 0;
+    return false;
+  }
+  uringAdvance(ring);
+  ring.enters = 0;
+
+  return true;
+}
+
+/**
+ * Returns whether the kernel supports an operation.
+ */
+bool uringSupports(Uring &ring, int opcode) {
+  size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+  auto *probe = (io_uring_probe *) calloc(1, size);
+  bool supported = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) >= 0
+                   && opcode <= probe->last_op &&
+                   (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  errno = 0;
+
+  return supported;
+}
+
+/**
+ * Releases the rings and buffers of an io_uring instance.
+ */
+void uringFree(Uring &ring) {
+  if (ring.fd >= 0) close(ring.fd);
+  if (ring.sqes && ring.sqes != MAP_FAILED) {
+    munmap(ring.sqes, ring.sqEntries * sizeof(io_uring_sqe));
+  }
+  if (ring.cqRing && ring.cqRing != MAP_FAILED && ring.cqRing != ring.sqRing) {
+    munmap(ring.cqRing, ring.cqRingSize);
+  }
+  if (ring.sqRing && ring.sqRing != MAP_FAILED) munmap(ring.sqRing, ring.sqRingSize);
+  free(ring.buffers);
+
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+}
+
+/**
+ * Returns a cleared SQE to fill in. Submits the prepared SQEs first if the submission ring is full.
+ */
+io_uring_sqe *uringGetSqe(Uring &ring) {
+  if (ring.sqeTail - loadAcquire(ring.sqHead) >= ring.sqEntries) uringSubmit(ring, 0);
+
+  io_uring_sqe *sqe = &ring.sqes[ring.sqeTail & ring.sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sqeTail++;
+
+  return sqe;
+}
+
+/**
+ * Prepares an accept that keeps completing once per new connection.
+ */
+void uringPrepAcceptMultishot(Uring &ring, int fd, uint64_t userData) {
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = userData;
+}
+
+/**
+ * Prepares a receive that keeps completing into provided buffers until the connection closes or
+ * the buffers run out.
+ */
+void uringPrepRecvMultishot(Uring &ring, int fd, uint64_t userData) {
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = userData;
+}
+
+/**
+ * Prepares a read of a pipe that keeps completing into provided buffers (Linux 6.7).
+ */
+void uringPrepReadMultishot(Uring &ring, int fd, uint64_t userData) {
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = URING_OP_READ_MULTISHOT;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = userData;
+}
+
+/**
+ * Prepares a single read into a provided buffer.
+ */
+void uringPrepRead(Uring &ring, int fd, uint64_t userData) {
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->off = (uint64_t) -1;  // Current file position, as pipes have no offset
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = userData;
+}
+
+/**
+ * Prepares a poll for input that completes once the descriptor becomes readable.
+ */
+void uringPrepPoll(Uring &ring, int fd, uint64_t userData) {
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = userData;
+}
+
+/**
+ * Prepares a poll for input that completes every time the descriptor becomes readable.
+ */
+void uringPrepPollMultishot(Uring &ring, int fd, uint64_t userData) {
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = userData;
+}
+
+/**
+ * Prepares a timeout that completes with -ETIME once the time has passed. The timespec is read
+ * when the SQE is submitted.
+ */
+void uringPrepTimeout(Uring &ring, __kernel_timespec *timeout, uint64_t userData) {
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t) timeout;
+  sqe->len = 1;
+  sqe->user_data = userData;
+}
+
+/**
+ * Prepares a send (IORING_OP_SEND) or write (IORING_OP_WRITE). data must stay valid until the
+ * completion arrives.
+ */
+void uringPrepWrite(Uring &ring, int opcode, int fd, const char *data, size_t length,
+                    uint64_t userData) {
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = (uint8_t) opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) data;
+  sqe->len = (uint32_t) length;
+  sqe->off = (uint64_t) -1;
+  sqe->msg_flags = opcode == IORING_OP_SEND ? MSG_NOSIGNAL : 0;
+  sqe->user_data = userData;
+}
+
+/**
+ * Returns whether prepared SQEs are waiting to be submitted.
+ */
+bool uringPending(Uring &ring) {
+  return ring.sqeTail != *ring.sqTail;
+}
+
+/**
+ * Submits every prepared SQE and waits until at least waitFor completions are available, with a
+ * single io_uring_enter() call. Returns the number of SQEs submitted, or -1 on failure.
+ */
+int uringSubmit(Uring &ring, unsigned waitFor) {
+  unsigned toSubmit = ring.sqeTail - *ring.sqTail;
+  storeRelease(ring.sqTail, ring.sqeTail);
+
+  ring.enters++;
+  int submitted = (int) syscall(__NR_io_uring_enter, ring.fd, toSubmit, waitFor,
+                                waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  if (submitted < 0 && errno == EINTR) {
+    errno = 0;
+    return 0;
+  }
+
+  return submitted;
+}
+
+/**
+ * Returns the oldest unseen completion, or nullptr if there is none. Does not enter the kernel.
+ */
+io_uring_cqe *uringPeek(Uring &ring) {
+  unsigned head = *ring.cqHead;
+  if (head == loadAcquire(ring.cqTail)) return nullptr;
+  return &ring.cqes[head & ring.cqMask];
+}
+
+/**
+ * Marks the completion returned by uringPeek() as seen.
+ */
+void uringAdvance(Uring &ring) {
+  storeRelease(ring.cqHead, *ring.cqHead + 1);
+}
+
+/**
+ * Returns the provided buffer a completion was received into, or nullptr if it has none.
+ */
+char *uringBuffer(Uring &ring, io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) return nullptr;
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  return ring.buffers + (size_t) bid * ring.bufSize;
+}
+
+/**
+ * Gives the buffer of a completion back to the kernel once its data has been copied out. Only a
+ * failure to return it produces a completion, with user data 0.
+ */
+void uringRecycleBuffer(Uring &ring, io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) return;
+  unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+  io_uring_sqe *sqe = uringGetSqe(ring);
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = 1;
+  sqe->addr = (uint64_t) (ring.buffers + (size_t) bid * ring.bufSize);
+  sqe->len = ring.bufSize;
+  sqe->off = bid;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
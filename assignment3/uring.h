@@ -0,0 +1,88 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string>
+
+#define URING_BUFFER_GROUP 0
+#define URING_OP_READ_MULTISHOT 49  // Added in Linux 6.7, missing from older kernel headers
+
+using namespace std;
+
+/**
+ * I/O backends of the controller and the switch
+ */
+typedef enum {
+    IO_BACKEND_POLL,
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_URING
+} IoBackend;
+
+/**
+ * An io_uring instance set up without liburing, with a group of provided receive buffers
+ */
+typedef struct {
+    int fd;  // -1 if io_uring is unavailable
+    unsigned sqEntries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    io_uring_sqe *sqes;
+    unsigned sqeTail;  // SQEs prepared so far, including ones not yet submitted
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    char *buffers;
+    unsigned bufCount;
+    unsigned bufSize;
+    uint64_t enters;  // io_uring_enter() calls
+} Uring;
+
+string ioBackendName(IoBackend backend);
+
+bool parseIoBackend(const string &text, IoBackend &backend);
+
+bool uringInit(Uring &ring, unsigned entries, unsigned bufferCount, unsigned bufferSize);
+
+bool uringSupports(Uring &ring, int opcode);
+
+void uringFree(Uring &ring);
+
+io_uring_sqe *uringGetSqe(Uring &ring);
+
+void uringPrepAcceptMultishot(Uring &ring, int fd, uint64_t userData);
+
+void uringPrepRecvMultishot(Uring &ring, int fd, uint64_t userData);
+
+void uringPrepReadMultishot(Uring &ring, int fd, uint64_t userData);
+
+void uringPrepRead(Uring &ring, int fd, uint64_t userData);
+
+void uringPrepPoll(Uring &ring, int fd, uint64_t userData);
+
+void uringPrepPollMultishot(Uring &ring, int fd, uint64_t userData);
+
+void uringPrepTimeout(Uring &ring, __kernel_timespec *timeout, uint64_t userData);
+
+void uringPrepWrite(Uring &ring, int opcode, int fd, const char *data, size_t length,
+                    uint64_t userData);
+
+bool uringPending(Uring &ring);
+
+int uringSubmit(Uring &ring, unsigned waitFor);
+
+io_uring_cqe *uringPeek(Uring &ring);
+
+void uringAdvance(Uring &ring);
+
+char *uringBuffer(Uring &ring, io_uring_cqe *cqe);
+
+void uringRecycleBuffer(Uring &ring, io_uring_cqe *cqe);
+
+#endif
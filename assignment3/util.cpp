@@ -6,6 +6,8 @@
 #include <unistd.h>
 #include <cstring>
 #include <poll.h>
+#include "ip.h"
+#include "util.h"
 
 using namespace std;
 
@@ -15,12 +17,12 @@ using namespace std;
  * https://stackoverflow.com/questions/1894886/parsing-a-comma-delimited-stdstring
  * https://stackoverflow.com/a/1894955
  */
-vector<int> parsePacketMessage(string &message) {
-  vector<int> packetContents;
+vector<int64_t> parsePacketMessage(string &message) {
+  vector<int64_t> packetContents;
   stringstream ss(message);
 
-  // Split packet string into ints (comma delimited)
-  int i = 0;
+  // Split packet string into integers (comma delimited). Addresses use the full 32-bit range.
+  int64_t i = 0;
   while (ss >> i) {
     packetContents.push_back(i);
     if (ss.peek() == ',') ss.ignore();
@@ -39,15 +41,35 @@ string makeFifoName(int senderId, int receiverId) {
 /**
  * Parse a packet string. Return the packet type and its message info.
  */
-pair<string, vector<int>> parsePacketString(string &s) {
+pair<string, vector<int64_t>> parsePacketString(string &s) {
   string packetType = s.substr(0, s.find(':'));
 
   string packetMessageToken = s.substr(s.find(':') + 1);
-  vector<int> packetMessage = parsePacketMessage(packetMessageToken);
+  vector<int64_t> packetMessage = parsePacketMessage(packetMessageToken);
 
   return make_pair(packetType, packetMessage);
 }
 
+/**
+ * Appends newly read bytes to a connection's pending data and returns every complete packet.
+ * Packets are newline terminated so that several of them can share one write; a trailing partial
+ * packet is kept in pending until the rest of it arrives.
+ */
+vector<string> extractPackets(string &pending, const char *data, size_t length) {
+  vector<string> packets;
+  pending.append(data, length);
+
+  size_t start = 0;
+  size_t end;
+  while ((end = pending.find(PACKET_DELIMITER, start)) != string::npos) {
+    if (end > start) packets.push_back(pending.substr(start, end - start));
+    start = end + 1;
+  }
+  pending.erase(0, start);
+
+  return packets;
+}
+
 /**
  * Parses switch ID from command line argument input.
  * Returns switch ID if ID is valid. Returns -1 if switch has no connection to
@@ -82,7 +104,7 @@ void trim(string &s) {
 /**
  * Print a formatted message based on a transmitted/received packet.
  */
-void printPacketMessage(string &direction, int srcId, int destId, string &type, vector<int> msg) {
+void printPacketMessage(string &direction, int srcId, int destId, string &type, vector<int64_t> msg) {
   string src = "sw" + to_string(srcId);
   string dest = "sw" + to_string(destId);
 
@@ -90,30 +112,23 @@ void printPacketMessage(string &direction, int srcId, int destId, string &type,
   if (type == "OPEN") {
     dest = "cont";
 
-    string port1;
-    if (msg[1] == -1) {
-      port1 = "null";
-    } else {
-      port1 = "sw" + to_string(msg[1]);
+    // The neighbours follow the switch's range, one per port. The local port comes after them.
+    packetString = ":\n         (port0= cont";
+    size_t port = 1;
+    for (; port + 2 < msg.size(); port++) {
+      packetString += ", port" + to_string(port) + "= " +
+                      (msg[port + 2] == -1 ? "null" : "sw" + to_string(msg[port + 2]));
     }
-
-    string port2;
-    if (msg[2] == -1) {
-      port2 = "null";
-    } else {
-      port2 = "sw" + to_string(msg[2]);
-    }
-
-    packetString = ":\n         (port0= cont, port1= "+ port1 + ", port2= " + port2 + ", port3= " +
-                   to_string(msg[3]) + "-" + to_string(msg[4]) + ")";
+    packetString += ", port" + to_string(port) + "= " +
+                    formatIpRange((uint32_t) msg[1], (uint32_t) msg[2]) + ")";
   } else if (type == "ACK") {
     src = "cont";
     packetString = "";
   } else if (type == "QUERY") {
     dest = "cont";
 
-    packetString = ":  header= (srcIP= " + to_string(msg[0]) + ", destIP= " + to_string(msg[1]) +
-                   ")";
+    packetString = ":  header= (srcIP= " + formatIp((uint32_t) msg[0]) + ", destIP= " +
+                   formatIp((uint32_t) msg[1]) + ")";
   } else if (type == "ADD") {
     src = "cont";
 
@@ -124,12 +139,18 @@ void printPacketMessage(string &direction, int srcId, int destId, string &type,
       action = "FORWARD";
     }
 
-    packetString = ":\n         (srcIp= 0-1000, destIp= " + to_string(msg[1]) + "-" +
-                   to_string(msg[2]) + ", action= " + action + ":" + to_string(msg[3]) +
-                   ", pri= 4, pktCount= 0";
+    packetString = ":\n         (srcIp= " + formatIpRange(0, IP_MAX) + ", destIp= " +
+                   formatIpRange((uint32_t) msg[1], (uint32_t) msg[2]) + ", action= " + action +
+                   ":" + to_string(msg[3]) + ", pri= 4, pktCount= 0";
   } else if (type == "RELAY") {
-    packetString = ":  header= (srcIP= " + to_string(msg[0]) +", destIP= " +
-                   to_string(msg[1]) + ")";
+    packetString = ":  header= (srcIP= " + formatIp((uint32_t) msg[0]) +", destIP= " +
+                   formatIp((uint32_t) msg[1]) + ")";
+  }
+
+  // Traced packets carry a trace ID after the fields above
+  size_t traceField = type == "ADD" ? 5 : 2;
+  if ((type == "QUERY" || type == "RELAY" || type == "ADD") && msg.size() >= traceField + 2) {
+    packetString += "  trace= " + to_string(msg[traceField]);
   }
 
   printf("%s (src= %s, dest= %s) [%s]%s\n", direction.c_str(), src.c_str(),
@@ -1,20 +1,25 @@
 #ifndef UTIL_H_
 #define UTIL_H_
 
+#include <stdint.h>
 #include <string>
 #include <utility>
 #include <vector>
 
+#define PACKET_DELIMITER '\n'
+
 using namespace std;
 
 string makeFifoName(int senderId, int receiverId);
 
-pair<string, vector<int>> parsePacketString(string &s);
+pair<string, vector<int64_t>> parsePacketString(string &s);
+
+vector<string> extractPackets(string &pending, const char *data, size_t length);
 
 int parseSwitchId(const string &input);
 
 void trim(string &s);
 
-void printPacketMessage(string &direction, int srcId, int destId, string &type, vector<int> msg);
+void printPacketMessage(string &direction, int srcId, int destId, string &type, vector<int64_t> msg);
 
 #endif
\ No newline at end of file
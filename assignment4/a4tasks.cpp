@@ -8,6 +8,7 @@
 #include <sys/times.h>
 #include <cstring>
 #include <pthread.h>
+#include "statseg.h"
 
 #define NTASKS 25
 #define MAX_NAME_LEN 32
@@ -28,7 +29,7 @@ typedef struct {
     long totalIdleTime;
     long totalWaitTime;
     char name[MAX_NAME_LEN];
-    vector<string> requiredResources;
+    vector<pair<string, int>> requiredResources;  // Name and amount, parsed once from the task line
 } Task;
 
 // Global variables
@@ -38,6 +39,8 @@ map<string, int> resources; // Global map of resource names to resource amounts
 vector<Task> taskList; // Global list of tasks
 pthread_mutex_t threadMutex, iterationMutex, monitorMutex; // Mutexes
 pthread_t taskThreadList[NTASKS]; // Global list of task threads
+map<string, int> maxResources; // Resource amounts before any task holds them
+StatPublisher stats; // Counters shared with external readers such as a3top, guarded by monitorMutex
 
 /**
  * A utility function for converting string inputs into integers. Handles strtol() failures.
@@ -128,6 +131,43 @@ void monitorPrint() {
          idleString.c_str());
 }
 
+/**
+ * Creates the stats segment: the total iterations and the task status counts, then the runs of
+ * every task and the amount held of every resource, as far as they fit.
+ */
+void openTaskStats() {
+  vector<StatDefinition> definitions = {{"iterations", STAT_COUNTER}, {"wait", STAT_GAUGE},
+                                        {"run", STAT_GAUGE}, {"idle", STAT_GAUGE}};
+  for (auto &task : taskList) definitions.push_back({string(task.name) + ".runs", STAT_COUNTER});
+  for (auto &resource : resources) definitions.push_back({resource.first + ".held", STAT_GAUGE});
+
+  maxResources = resources;
+  openStatSegment(stats, "a4tasks", definitions);
+}
+
+/**
+ * Publishes the task counters to the stats segment if they are due. Must hold monitorMutex. The
+ * held resources are those of running tasks, so that the resource map guarded by iterationMutex
+ * is not read here.
+ */
+void publishTaskStats() {
+  if (!statsDue(stats)) return;
+
+  vector<uint64_t> values(4, 0);
+  map<string, int> held;
+  for (auto &task : taskList) {
+    values[0] += task.timesExecuted;
+    values[1 + task.status]++;
+    if (task.status != RUN) continue;
+
+    for (auto &reqResource : task.requiredResources) held[reqResource.first] += reqResource.second;
+  }
+
+  for (auto &task : taskList) values.push_back((uint64_t) task.timesExecuted);
+  for (auto &resource : maxResources) values.push_back((uint64_t) held[resource.first]);
+  publishStats(stats, values);
+}
+
 /**
  * Monitor thread that prints out details periodically.
  */
@@ -206,10 +246,16 @@ void parseTaskFile(char *taskFilePath) {
 
         char *resource = strtok(nullptr, " ");
 
-        // Add resource strings to list
+        // Add name:amount pairs to list
         while (resource != nullptr) {
           string str(resource);
-          newTask.requiredResources.push_back(str);
+          size_t separator = str.find(':');
+          if (separator == string::npos) {
+            printf("Error: Invalid resource %s. Expected 'name:amount'.\n", resource);
+            exit(EXIT_FAILURE);
+          }
+          newTask.requiredResources.emplace_back(str.substr(0, separator),
+                                                 strToInt(&str[separator + 1]));
           resource = strtok(nullptr, " ");
         }
 
@@ -224,11 +270,7 @@ void parseTaskFile(char *taskFilePath) {
  */
 bool hasEnoughResources(Task *task) {
   for (auto &reqResource : task->requiredResources) {
-    char resource[MAX_NAME_LEN];
-    strcpy(resource, reqResource.c_str());
-    char *resourceName = strtok(resource, ":");
-
-    if (resources[resourceName] < strToInt(strtok(nullptr, ":"))) return false;
+    if (resources[reqResource.first] < reqResource.second) return false;
   }
   return true;
 }
@@ -238,10 +280,7 @@ bool hasEnoughResources(Task *task) {
  */
 void assignResources(Task *task) {
   for (auto &reqResource : task->requiredResources) {
-    char resource[MAX_NAME_LEN];
-    strcpy(resource, reqResource.c_str());
-    char *resourceName = strtok(resource, ":");
-    resources[resourceName] -= strToInt(strtok(nullptr, ":"));
+    resources[reqResource.first] -= reqResource.second;
   }
 }
 
@@ -251,10 +290,7 @@ void assignResources(Task *task) {
  */
 void returnResources(Task *task) {
   for (auto &reqResource : task->requiredResources) {
-    char resource[MAX_NAME_LEN];
-    strcpy(resource, reqResource.c_str());
-    char *resourceName = strtok(resource, ":");
-    resources[resourceName] += strToInt(strtok(nullptr, ":"));
+    resources[reqResource.first] += reqResource.second;
   }
 }
 
@@ -268,6 +304,7 @@ void executeIterations(Task *task) {
 
   lockMutex(&monitorMutex);
   task->status = WAIT;
+  publishTaskStats();
   unlockMutex(&monitorMutex);
 
   waitStart = times(&tmswaitstart);
@@ -289,6 +326,7 @@ void executeIterations(Task *task) {
     // After resources are taken, simulate the execution of the process
     lockMutex(&monitorMutex);
     task->status = RUN;
+    publishTaskStats();
     unlockMutex(&monitorMutex);
     delay(task->busyTime);
     task->totalBusyTime += task->busyTime;
@@ -301,18 +339,21 @@ void executeIterations(Task *task) {
     // Wait for idle time and increment iteration counter
     lockMutex(&monitorMutex);
     task->status = IDLE;
+    publishTaskStats();
     unlockMutex(&monitorMutex);
 
     delay(task->idleTime);
     task->totalIdleTime += task->idleTime;
     iterationCounter += 1;
-    task->timesExecuted += 1;
-
-    if (iterationCounter == nIter) return;
 
+    // Count the iteration under monitorMutex, where the stats are published from
     lockMutex(&monitorMutex);
-    task->status = WAIT;
+    task->timesExecuted += 1;
+    if (iterationCounter < nIter) task->status = WAIT;
+    publishTaskStats();
     unlockMutex(&monitorMutex);
+
+    if (iterationCounter == nIter) return;
     waitStart = times(&tmswaitstart);
   }
 }
@@ -365,11 +406,7 @@ void printTerminationInfo() {
 
     // Print the required resources
     for (auto &reqResource : taskList.at(i).requiredResources) {
-      char resourceString[MAX_NAME_LEN];
-      strcpy(resourceString, reqResource.c_str());
-
-      char *resourceName = strtok(resourceString, ":");
-      printf("\t %s: (needed=\t%d, held= 0)\n", resourceName, strToInt(strtok(nullptr, ":")));
+      printf("\t %s: (needed=\t%d, held= 0)\n", reqResource.first.c_str(), reqResource.second);
     }
 
     printf("\t (RUN: %d times, WAIT: %lu msec\n\n", taskList.at(i).timesExecuted,
@@ -426,6 +463,7 @@ int main(int argc, char **argv) {
   }
 
   parseTaskFile(fileName); // Parse task file and populate global lists
+  openTaskStats();
 
   pthread_t newPthreadId;
 